@@ -2,7 +2,7 @@ TEMPLATE = app
 CONFIG += console
 CONFIG -= app_bundle
 #CONFIG -= qt
-CONFIG += c++11
+CONFIG += c++14
 
 SOURCES += main.cpp \
     fileaccessor.cpp \
@@ -14,7 +14,15 @@ SOURCES += main.cpp \
     constants.cpp \
     filesystemarea.cpp \
     blockbuffer.cpp \
-    fsdescriptoriterator.cpp
+    fsdescriptoriterator.cpp \
+    dentrycache.cpp \
+    bloomfilter.cpp \
+    lzcodec.cpp \
+    crc32c.cpp \
+    journal.cpp \
+    transaction.cpp \
+    consistencychecker.cpp \
+    asyncfilesystem.cpp
 
 include(deployment.pri)
 qtcAddDeployment()
@@ -32,7 +40,21 @@ HEADERS += \
     project_exceptions.h \
     filesystemarea.h \
     blockbuffer.h \
-    fsdescriptoriterator.h
+    fsdescriptoriterator.h \
+    dentrycache.h \
+    bloomfilter.h \
+    directorytree.h \
+    fileblockmap.h \
+    handletable.h \
+    blockreferencetable.h \
+    fingerprintindex.h \
+    lzcodec.h \
+    crc32c.h \
+    journal.h \
+    transaction.h \
+    consistencychecker.h \
+    locktable.h \
+    asyncfilesystem.h
 
 
 win32:DEFINES += WIN32
@@ -0,0 +1,129 @@
+#include "asyncfilesystem.h"
+
+#include <algorithm>
+
+AsyncFileSystem::AsyncFileSystem(FileSystem &fileSystem, unsigned threads) :
+    _fileSystem(fileSystem)
+{
+    if(threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for(unsigned i = 0; i < threads; i++) {
+        _workers.emplace_back(&AsyncFileSystem::workerLoop, this);
+    }
+}
+
+AsyncFileSystem::~AsyncFileSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(_queueMutex);
+        _stopping = true;
+    }
+    _queueCondition.notify_all();
+    for(auto &worker : _workers) {
+        worker.join();
+    }
+}
+
+std::future<descriptorIndex_tp> AsyncFileSystem::lookup(const session &client, const std::string &path)
+{
+    return submit([this, client, path]() {
+        return _fileSystem.lookup(client, path);
+    });
+}
+
+std::future<descriptorIndex_tp> AsyncFileSystem::makeFile(const session &client, const std::string &name, bool compressed)
+{
+    return submit([this, client, name, compressed]() {
+        return _fileSystem.makeFile(client, name, compressed);
+    });
+}
+
+std::future<bool> AsyncFileSystem::unlinkFile(const session &client, const std::string &name)
+{
+    return submit([this, client, name]() {
+        return _fileSystem.unlinkFile(client, name);
+    });
+}
+
+std::future<AsyncFileSystem::openedFileDescriptor_tp> AsyncFileSystem::openFile(const session &client, const std::string &path)
+{
+    return submit([this, client, path]() {
+        return _fileSystem.openFile(client, path);
+    });
+}
+
+std::future<void> AsyncFileSystem::closeFile(openedFileDescriptor_tp fd)
+{
+    return submitFileOperation(fd, [this, fd]() {
+        _fileSystem.closeFile(fd);
+    });
+}
+
+std::future<std::vector<char>> AsyncFileSystem::readFile(openedFileDescriptor_tp fd, uint64_t size)
+{
+    return submitFileOperation(fd, [this, fd, size]() {
+        std::vector<char> data(size);
+        data.resize(_fileSystem.readFile(fd, data.data(), size));
+        return data;
+    });
+}
+
+std::future<uint64_t> AsyncFileSystem::writeFile(openedFileDescriptor_tp fd, std::vector<char> data)
+{
+    auto shared = std::make_shared<std::vector<char>>(std::move(data));
+    return submitFileOperation(fd, [this, fd, shared]() {
+        return _fileSystem.writeFile(fd, shared->data(), shared->size());
+    });
+}
+
+std::future<void> AsyncFileSystem::flushFile(openedFileDescriptor_tp fd)
+{
+    return submitFileOperation(fd, [this, fd]() {
+        _fileSystem.flushFile(fd);
+    });
+}
+
+void AsyncFileSystem::enqueue(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(_queueMutex);
+        _queue.push_back(std::move(task));
+    }
+    _queueCondition.notify_one();
+}
+
+void AsyncFileSystem::fileOperationDone(openedFileDescriptor_tp fd)
+{
+    std::function<void()> next;
+    {
+        std::lock_guard<std::mutex> lock(_filesMutex);
+        auto found = _fileQueues.find(fd);
+        if(found->second.pending.empty()) {
+            // also closed file, reused descriptor starts with new queue
+            _fileQueues.erase(found);
+            return;
+        }
+        next = std::move(found->second.pending.front());
+        found->second.pending.pop_front();
+    }
+    // worker of finished operation is not blocked, next one is taken from common queue
+    enqueue(std::move(next));
+}
+
+void AsyncFileSystem::workerLoop()
+{
+    while(true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(_queueMutex);
+            _queueCondition.wait(lock, [this]() { return _stopping || !_queue.empty(); });
+            if(_queue.empty()) {
+                return;     // stopping, queued operations are done
+            }
+            task = std::move(_queue.front());
+            _queue.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,118 @@
+#ifndef ASYNCFILESYSTEM_H
+#define ASYNCFILESYSTEM_H
+
+#include "filesystem.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief The AsyncFileSystem class
+ * Future returning operations over thread safe FileSystem. Operations are queued and executed
+ * by pool of worker threads, so one client thread can keep many operations in flight,
+ * exceptions of operation are rethrown by future get().
+ *
+ * Operations of one opened file are executed in submission order (its cursor is shared),
+ * operations of different files and metadata operations run concurrently.
+ * Session is copied at submission time, FileSystem must stay mounted until all futures are ready.
+ */
+class AsyncFileSystem
+{
+    AsyncFileSystem(const AsyncFileSystem &) = delete;
+    AsyncFileSystem &operator =(const AsyncFileSystem &) = delete;
+
+public:
+    using session = FileSystem::session;
+    using openedFileDescriptor_tp = FileSystem::openedFileDescriptor_tp;
+
+    /**
+     * @param threads 0 for hardware concurrency
+     */
+    explicit AsyncFileSystem(FileSystem &fileSystem, unsigned threads = 0);
+    // waits for queued operations
+    ~AsyncFileSystem();
+
+    std::future<descriptorIndex_tp> lookup(const session &client, const std::string &path);
+    std::future<descriptorIndex_tp> makeFile(const session &client, const std::string &name, bool compressed = false);
+    std::future<bool> unlinkFile(const session &client, const std::string &name);
+
+    std::future<openedFileDescriptor_tp> openFile(const session &client, const std::string &path);
+    std::future<void> closeFile(openedFileDescriptor_tp fd);
+    // data read from current offset, shorter than size at the end of file
+    std::future<std::vector<char>> readFile(openedFileDescriptor_tp fd, uint64_t size);
+    // bytes written to current offset
+    std::future<uint64_t> writeFile(openedFileDescriptor_tp fd, std::vector<char> data);
+    std::future<void> flushFile(openedFileDescriptor_tp fd);
+
+private:
+    // operations of one opened file, next one is queued when running one ends
+    struct fileQueue {
+        bool running = false;
+        std::deque<std::function<void()>> pending;
+    };
+
+    template<typename Function>
+    auto submit(Function function) -> std::future<decltype(function())>;
+    // starts after previous operation of fd
+    template<typename Function>
+    auto submitFileOperation(openedFileDescriptor_tp fd, Function function) -> std::future<decltype(function())>;
+
+    void enqueue(std::function<void()> task);
+    // queues next operation of fd, drops queue of file without operations
+    void fileOperationDone(openedFileDescriptor_tp fd);
+    void workerLoop();
+
+    FileSystem &_fileSystem;
+
+    std::mutex _queueMutex;
+    std::condition_variable _queueCondition;
+    std::deque<std::function<void()>> _queue;
+    bool _stopping = false;
+    std::vector<std::thread> _workers;
+
+    // files with running operation
+    std::mutex _filesMutex;
+    std::unordered_map<openedFileDescriptor_tp, fileQueue> _fileQueues;
+};
+
+template<typename Function>
+auto AsyncFileSystem::submit(Function function) -> std::future<decltype(function())>
+{
+    // std::function needs copyable target, task is shared
+    auto task = std::make_shared<std::packaged_task<decltype(function())()>>(std::move(function));
+    auto result = task->get_future();
+    enqueue([task]() { (*task)(); });
+    return result;
+}
+
+template<typename Function>
+auto AsyncFileSystem::submitFileOperation(openedFileDescriptor_tp fd, Function function) -> std::future<decltype(function())>
+{
+    auto task = std::make_shared<std::packaged_task<decltype(function())()>>(std::move(function));
+    auto result = task->get_future();
+    // exception is stored by task, next operation is started in any case
+    std::function<void()> operation = [this, fd, task]() {
+        (*task)();
+        fileOperationDone(fd);
+    };
+    {
+        std::lock_guard<std::mutex> lock(_filesMutex);
+        fileQueue &queue = _fileQueues[fd];
+        if(queue.running) {
+            queue.pending.push_back(std::move(operation));
+            return result;
+        }
+        queue.running = true;
+    }
+    enqueue(std::move(operation));
+    return result;
+}
+
+#endif // ASYNCFILESYSTEM_H
@@ -47,7 +47,11 @@ uint64_t BlockBufferLocker::length() const
 void BlockBufferLocker::flush()
 {
     if((_type == SyncType::WriteOnly || _type == SyncType::ReadWrite) && isValid()) {
-        _fsFile->write(_blockAddress, atBlock());
+        if(_metadata) {
+            _fsFile->writeMetadata(_blockAddress, atBlock());
+        } else {
+            _fsFile->write(_blockAddress, atBlock());
+        }
     }
 }
 
@@ -56,6 +60,14 @@ bool BlockBufferLocker::isValid() const
     return _isValid;
 }
 
+void BlockBufferLocker::release()
+{
+    if(isValid() && _blockBuffer != nullptr) {
+        _bufferPool->unlockBuffer(_blockBuffer);
+        _blockBuffer = nullptr;
+    }
+}
+
 void BlockBufferLocker::ensureValid() const
 {
     if(!isValid()) {
@@ -75,12 +87,11 @@ void BlockBufferLocker::setSyncType(const SyncType &type)
 BlockBufferLocker::~BlockBufferLocker()
 {
     flush();
-    if(isValid()) {
-        _bufferPool->unlockBuffer(_blockBuffer);
-    }
+    release();
 }
 
-BlockBufferLocker::BlockBufferLocker(BlockBufferLocker &&other)
+BlockBufferLocker::BlockBufferLocker(BlockBufferLocker &&other) :
+    _isValid(false)
 {
     *this = std::move(other);
 }
@@ -92,6 +103,7 @@ BlockBufferLocker &BlockBufferLocker::operator =(BlockBufferLocker &&other)
     }
 
     this->flush();
+    this->release();
 
     _type = std::move(other._type);
     _fsFile = std::move(other._fsFile);
@@ -99,6 +111,7 @@ BlockBufferLocker &BlockBufferLocker::operator =(BlockBufferLocker &&other)
     _blockBuffer = std::move(other._blockBuffer);
     _blockAddress = std::move(other._blockAddress);
     _isValid = std::move(other._isValid);
+    _metadata = other._metadata;
 
     other._isValid = false;
 
@@ -107,6 +120,7 @@ BlockBufferLocker &BlockBufferLocker::operator =(BlockBufferLocker &&other)
 
 void BlockBufferPool::setDefaultBuffersSize(uint64_t size)
 {
+    std::lock_guard<std::mutex> lock(_mutex);
     if(!_occupied.empty()) {
         throw bad_state_exception("You cannot change buffer size if you have occupied buffers.");
     }
@@ -132,6 +146,7 @@ byte_tp *BlockBufferPool::getAnyFreeBuffer()
     if(logEnabled) {
         std::clog << "\tlock\n";
     }
+    std::lock_guard<std::mutex> lock(_mutex);
     return _free.empty() ? lockNewBuffer() : lockFreeBuffer();
 }
 
@@ -140,6 +155,7 @@ void BlockBufferPool::unlockBuffer(byte_tp *buffer)
     if(logEnabled) {
         std::clog << "\tunlock " << buffer << "\n";
     }
+    std::lock_guard<std::mutex> lock(_mutex);
     _occupied.erase(buffer);
     _free.push_front(buffer);
 }
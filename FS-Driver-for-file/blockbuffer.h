@@ -9,6 +9,7 @@ using namespace fs_excetion;
 
 #include <memory>
 #include <list>
+#include <mutex>
 #include <unordered_set>
 
 class BlockFileAccessor;
@@ -51,6 +52,7 @@ public:
 
 private:
     void ensureValid() const;
+    void release();
 
     // mutable for lazy initialize
     mutable byte_tp *_blockBuffer = nullptr;
@@ -60,6 +62,9 @@ private:
     BlockFileAccessor *_fsFile;
     SyncType _type;
     bool _isValid = true;
+
+protected:
+    bool _metadata = false;     // checksum is updated on flush
 };
 
 template<typename T>
@@ -71,6 +76,7 @@ class TypedBufferLocker : public BlockBufferLocker
         BlockBufferLocker(pool, file, block, type)
     {
         static_assert(std::is_base_of<FileSystemBlock, T>::value, "T must be derived from FileSystemBlock");
+        _metadata = isMetadataBlock<T>::value;
     }
 
 public:
@@ -116,6 +122,7 @@ private:
     byte_tp *lockNewBuffer();
 
     uint64_t _bufferSize = 0;
+    std::mutex _mutex;      // buffers are locked by threads sharing accessor
     mutable std::list<byte_tp *> _free;
     mutable std::unordered_set<byte_tp *> _occupied;    // debug
 };
@@ -0,0 +1,105 @@
+#ifndef BLOCKREFERENCETABLE_H
+#define BLOCKREFERENCETABLE_H
+
+#include "project_exceptions.h"
+#include "fileblockmap.h"
+
+#include <cstring>
+#include <limits>
+
+/**
+ * @brief The BlockReferenceTable class
+ * Reference counters of shared data blocks, stored in a hidden sparse file as 16 bit counter per block.
+ * Counter is the number of additional owners, 0 (also a hole) means block has one owner.
+ *
+ * BlockSource is the same as for FileBlockMap, table blocks are never shared.
+ * Changes of descriptor are not saved, caller must update it if descriptorChanged().
+ */
+template<typename BlockSource>
+class BlockReferenceTable
+{
+public:
+    using counter_tp = uint16_t;
+
+    BlockReferenceTable(BlockSource source, FSDescriptor *descriptor) :
+        _source(source),
+        _map(source, descriptor)
+    { }
+
+    static constexpr uint64_t countersInBlock = sizeof(FSDataBlock::data) / sizeof(counter_tp);
+
+    counter_tp get(blockAddress_tp block)
+    {
+        blockAddress_tp tableBlock = _map.get(block / countersInBlock);
+        if(tableBlock == Constants::HEADER_ADDRESS()) {
+            return 0;
+        }
+        TypedBufferLocker<FSDataBlock> counters = _source.template readBlock<FSDataBlock>(tableBlock, SyncType::ReadOnly);
+        return counterAt(*counters, block);
+    }
+
+    void increment(blockAddress_tp block)
+    {
+        blockAddress_tp tableBlock = _map.getForWrite(block / countersInBlock);
+        TypedBufferLocker<FSDataBlock> counters;
+        if(tableBlock == Constants::HEADER_ADDRESS()) {
+            tableBlock = _source.allocBlock();
+            counters = _source.template readBlock<FSDataBlock>(tableBlock, SyncType::WriteOnly);
+            memset(counters->data, 0, sizeof(counters->data));
+            _map.set(block / countersInBlock, tableBlock);
+            _descriptorChanged = true;
+        } else {
+            counters = _source.template readBlock<FSDataBlock>(tableBlock, SyncType::ReadWrite);
+        }
+
+        counter_tp counter = counterAt(*counters, block);
+        if(counter == std::numeric_limits<counter_tp>::max()) {
+            counters.setSyncType(SyncType::ReadOnly);
+            throw fs_excetion::no_enough_fs_entry("Too many references to block " + std::to_string(block) + ".");
+        }
+        setCounter(*counters, block, counter + 1);
+    }
+
+    /**
+     * @return false if block has one owner (nothing is changed)
+     */
+    bool decrement(blockAddress_tp block)
+    {
+        blockAddress_tp tableBlock = _map.get(block / countersInBlock);
+        if(tableBlock == Constants::HEADER_ADDRESS()) {
+            return false;
+        }
+        TypedBufferLocker<FSDataBlock> counters = _source.template readBlock<FSDataBlock>(tableBlock, SyncType::ReadOnly);
+        counter_tp counter = counterAt(*counters, block);
+        if(counter == 0) {
+            return false;
+        }
+        counters.setSyncType(SyncType::ReadWrite);
+        setCounter(*counters, block, counter - 1);
+        return true;
+    }
+
+    bool descriptorChanged() const
+    {
+        return _descriptorChanged;
+    }
+
+private:
+    static counter_tp counterAt(const FSDataBlock &counters, blockAddress_tp block)
+    {
+        counter_tp counter;
+        memcpy(&counter, counters.data + (block % countersInBlock) * sizeof(counter_tp), sizeof(counter));
+        return counter;
+    }
+
+    static void setCounter(FSDataBlock &counters, blockAddress_tp block, counter_tp counter)
+    {
+        memcpy(counters.data + (block % countersInBlock) * sizeof(counter_tp), &counter, sizeof(counter));
+    }
+
+    BlockSource _source;
+    FileBlockMap<BlockSource> _map;
+    bool _descriptorChanged = false;
+};
+
+#endif // BLOCKREFERENCETABLE_H
@@ -0,0 +1,54 @@
+#include "bloomfilter.h"
+
+#include <algorithm>
+
+constexpr uint64_t DirectoryBloomFilter::bitsPerElement;
+constexpr uint64_t DirectoryBloomFilter::hashCount;
+constexpr uint64_t DirectoryBloomFilter::minBits;
+
+DirectoryBloomFilter::DirectoryBloomFilter(uint64_t expectedElements) :
+    _expectedElements(std::max<uint64_t>(expectedElements, minBits / bitsPerElement))
+{
+    constexpr uint64_t wordBits = 64;
+    uint64_t words = (_expectedElements * bitsPerElement + wordBits - 1) / wordBits;
+    _bits.assign(words, 0);
+    _bitsCount = words * wordBits;
+}
+
+void DirectoryBloomFilter::add(uint64_t hash)
+{
+    for(uint64_t i = 0; i < hashCount; i++) {
+        uint64_t bit = bitIndex(hash, i);
+        _bits[bit / 64] |= uint64_t(1) << (bit & 63);
+    }
+    _added++;
+}
+
+void DirectoryBloomFilter::remove()
+{
+    _removed++;
+}
+
+bool DirectoryBloomFilter::mayContain(uint64_t hash) const
+{
+    for(uint64_t i = 0; i < hashCount; i++) {
+        uint64_t bit = bitIndex(hash, i);
+        if((_bits[bit / 64] & (uint64_t(1) << (bit & 63))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DirectoryBloomFilter::needRebuild() const
+{
+    return _added > _expectedElements || _removed > _expectedElements;
+}
+
+uint64_t DirectoryBloomFilter::bitIndex(uint64_t hash, uint64_t i) const
+{
+    // double hashing: h1 + i * h2
+    uint64_t h1 = hash & 0xFFFFFFFF;
+    uint64_t h2 = (hash >> 32) | 1;
+    return (h1 + i * h2) % _bitsCount;
+}
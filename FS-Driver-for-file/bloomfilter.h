@@ -0,0 +1,43 @@
+#ifndef BLOOMFILTER_H
+#define BLOOMFILTER_H
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief The DirectoryBloomFilter class
+ * In-memory filter of directory entry names, works with name hashes
+ * (directoryEntry::nameHash(), PaddedName::hash()).
+ * mayContain() == false means that name is definitely absent.
+ * Removed names are not cleared, filter only counts them and asks for rebuild.
+ */
+class DirectoryBloomFilter
+{
+public:
+    explicit DirectoryBloomFilter(uint64_t expectedElements = 0);
+
+    void add(uint64_t nameHash);
+    void remove();
+    bool mayContain(uint64_t nameHash) const;
+
+    /**
+     * @return true if filter contains too many added or removed elements
+     * and false positive rate becomes high
+     */
+    bool needRebuild() const;
+
+    static constexpr uint64_t bitsPerElement = 16;
+    static constexpr uint64_t hashCount = 7;
+    static constexpr uint64_t minBits = 256;
+
+private:
+    uint64_t bitIndex(uint64_t hash, uint64_t i) const;
+
+    std::vector<uint64_t> _bits;
+    uint64_t _bitsCount;
+    uint64_t _expectedElements;
+    uint64_t _added = 0;
+    uint64_t _removed = 0;
+};
+
+#endif // BLOOMFILTER_H
@@ -0,0 +1,580 @@
+#include "consistencychecker.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cstring>
+#include <exception>
+#include <thread>
+#include <unordered_set>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using std::to_string;
+
+namespace {
+
+constexpr uint64_t bitsInWord = 64;
+// descriptor blocks taken by thread at once, threads stay busy if descriptors are not evenly spread
+constexpr uint64_t chunkBlocks = 16;
+// as BlockReferenceTable
+using counter_tp = uint16_t;
+
+/**
+ * @brief duplicates |= (accumulated & part) | partDuplicates; accumulated |= part
+ */
+void mergeBitMaps(uint64_t *accumulated, uint64_t *duplicates, const uint64_t *part, const uint64_t *partDuplicates, uint64_t words)
+{
+    uint64_t i = 0;
+#ifdef __SSE2__
+    for(; i + 2 <= words; i += 2) {
+        __m128i acc = _mm_loadu_si128(reinterpret_cast<const __m128i *>(accumulated + i));
+        __m128i dup = _mm_loadu_si128(reinterpret_cast<const __m128i *>(duplicates + i));
+        __m128i bits = _mm_loadu_si128(reinterpret_cast<const __m128i *>(part + i));
+        __m128i partDup = _mm_loadu_si128(reinterpret_cast<const __m128i *>(partDuplicates + i));
+        dup = _mm_or_si128(dup, _mm_or_si128(_mm_and_si128(acc, bits), partDup));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(duplicates + i), dup);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(accumulated + i), _mm_or_si128(acc, bits));
+    }
+#endif
+    for(; i < words; i++) {
+        duplicates[i] |= (accumulated[i] & part[i]) | partDuplicates[i];
+        accumulated[i] |= part[i];
+    }
+}
+
+// slots are filled in order, never written slot is all zeros
+uint64_t usedSlots(const directoryEntry *entries, uint64_t count)
+{
+    uint64_t used = 0;
+    while(used < count && entries[used].descriptor != Constants::INVALID_DESCRIPTOR_ID()) {
+        used++;
+    }
+    return used;
+}
+
+std::string ownerName(descriptorIndex_tp owner)
+{
+    return owner == Constants::INVALID_DESCRIPTOR_ID() ? "shared segment" : "descriptor " + to_string(owner);
+}
+
+}
+
+struct ConsistencyChecker::partialResult {
+    explicit partialResult(uint64_t blocks) :
+        reachable((blocks + bitsInWord - 1) / bitsInWord, 0),
+        duplicates(reachable.size(), 0)
+    {
+    }
+
+    std::vector<uint64_t> reachable;    // used data blocks and full descriptor blocks
+    std::vector<uint64_t> duplicates;   // blocks reached more than once
+    std::unordered_map<blockAddress_tp, uint64_t> owners;   // of blocks with reference counter
+    std::vector<blockAddress_tp> sharedSegments;
+    std::unordered_map<descriptorIndex_tp, uint64_t> links;     // directory entries pointing to descriptor
+    std::vector<std::pair<descriptorIndex_tp, int64_t>> references;    // used descriptors
+    std::vector<directoryFix> directories;
+
+    uint64_t problemsCount = 0;
+    std::vector<std::string> problems;
+    uint64_t freeDescriptors = 0;
+    uint64_t descriptorsChecked = 0;
+
+    std::vector<char> descriptorBlock;
+    std::vector<char> block;
+};
+
+ConsistencyChecker::ConsistencyChecker(std::shared_ptr<FormatedFileAccessor> file, unsigned threads) :
+    _file(file),
+    _threads(threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency()))
+{
+}
+
+ConsistencyChecker::report ConsistencyChecker::check()
+{
+    loadReferenceCounters();
+
+    const uint64_t blocks = header().dataBlockEnd() + 1;
+    const blockAddress_tp begin = header().descriptorsBegin();
+    const blockAddress_tp end = header().descriptorsEnd() + 1;
+
+    std::vector<std::unique_ptr<partialResult>> parts;
+    std::vector<std::exception_ptr> errors(_threads);
+    std::vector<std::thread> workers;
+    std::atomic<uint64_t> nextChunk(0);
+    for(unsigned t = 0; t < _threads; t++) {
+        parts.emplace_back(new partialResult(blocks));
+    }
+    for(unsigned t = 0; t < _threads; t++) {
+        workers.emplace_back([&, t]() {
+            try {
+                for(;;) {
+                    blockAddress_tp first = begin + nextChunk++ * chunkBlocks;
+                    if(first >= end) {
+                        break;
+                    }
+                    checkDescriptorBlocks(*parts[t], first, std::min(end, first + chunkBlocks));
+                }
+            } catch(...) {
+                errors[t] = std::current_exception();
+            }
+        });
+    }
+    for(std::thread &worker : workers) {
+        worker.join();
+    }
+    for(std::exception_ptr &error : errors) {
+        if(error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    partialResult &total = *parts[0];
+    for(unsigned t = 1; t < _threads; t++) {
+        merge(total, *parts[t]);
+        parts[t].reset();
+    }
+    walkSharedSegments(total);
+
+    report result;
+    for(uint64_t word = 0; word < total.duplicates.size(); word++) {
+        for(uint64_t bit = 0; total.duplicates[word] != 0 && bit < bitsInWord; bit++) {
+            blockAddress_tp block = word * bitsInWord + bit;
+            if((total.duplicates[word] >> bit & 1) != 0 && _counters.count(block) == 0) {
+                addProblem(total, "Block " + to_string(block) + " is used more than once, but it is not shared.");
+            }
+        }
+    }
+    for(const auto &counter : _counters) {
+        auto owners = total.owners.find(counter.first);
+        uint64_t ownersCount = owners == total.owners.end() ? 0 : owners->second;
+        if(ownersCount != counter.second + 1) {
+            addProblem(total, "Shared block " + to_string(counter.first) + " has " + to_string(ownersCount)
+                       + " owners, reference counter is " + to_string(counter.second) + ".");
+            result.blockOwners.emplace_back(counter.first, ownersCount);
+        }
+    }
+
+    for(const auto &references : total.references) {
+        uint64_t links = 0;
+        auto it = total.links.find(references.first);
+        if(it != total.links.end()) {
+            links = it->second;
+            total.links.erase(it);
+        }
+        if(references.second != static_cast<int64_t>(links)) {
+            addProblem(total, "Descriptor " + to_string(references.first) + " has " + to_string(references.second)
+                       + " references, " + to_string(links) + " directory entries point to it.");
+            result.referencesCounts.emplace_back(references.first, links);
+        }
+    }
+    for(const auto &links : total.links) {
+        addProblem(total, to_string(links.second) + " directory entries point to free descriptor " + to_string(links.first) + ".");
+    }
+
+    compareBitMap(total, result);
+    result.freeDescriptorsCount = total.freeDescriptors;
+    if(header().freeBlocks != result.freeBlocksCount || header().freeDescriptors != result.freeDescriptorsCount) {
+        addProblem(total, "Free counters are " + to_string(header().freeBlocks) + " blocks and " + to_string(header().freeDescriptors)
+                   + " descriptors, must be " + to_string(result.freeBlocksCount) + " and " + to_string(result.freeDescriptorsCount) + ".");
+    }
+
+    result.directories = std::move(total.directories);
+    result.problemsCount = total.problemsCount;
+    result.problems = std::move(total.problems);
+    result.descriptorsChecked = total.descriptorsChecked;
+    return result;
+}
+
+const FSHeader &ConsistencyChecker::header() const
+{
+    return _file->headerExcept();
+}
+
+void ConsistencyChecker::readBlock(blockAddress_tp block, std::vector<char> &buffer) const
+{
+    // single block reads are served from journal, so not checkpointed metadata is checked
+    buffer.resize(header().blockByteSize);
+    _file->readBlocks(block, buffer.data(), 1);
+}
+
+bool ConsistencyChecker::isDataBlock(blockAddress_tp block) const
+{
+    return block >= header().dataBlockBegin() && block <= header().dataBlockEnd();
+}
+
+void ConsistencyChecker::loadReferenceCounters()
+{
+    _counters.clear();
+    descriptorIndex_tp tableIndex = header().blockReferencesDescriptor;
+    if(tableIndex == Constants::INVALID_DESCRIPTOR_ID()) {
+        return;
+    }
+
+    std::vector<char> buffer;
+    readBlock(header().descriptorsBegin() + tableIndex / header().descriptorsInBlock(), buffer);
+    const FSDescriptor table = reinterpret_cast<const FSDescriptorsContainerBlock *>(buffer.data())
+                                    ->descriptors[tableIndex % header().descriptorsInBlock()];
+
+    const uint64_t countersInBlock = header().blockByteSize / sizeof(counter_tp);
+    std::vector<char> counters;
+    auto loadCounters = [&](uint64_t tableBlock, blockAddress_tp address) {
+        if(!isDataBlock(address)) {
+            return;
+        }
+        readBlock(address, counters);
+        for(uint64_t i = 0; i < countersInBlock; i++) {
+            counter_tp counter;
+            memcpy(&counter, counters.data() + i * sizeof(counter), sizeof(counter));
+            if(counter != 0) {
+                _counters[tableBlock * countersInBlock + i] = counter;
+            }
+        }
+    };
+
+    uint64_t tableBlock = 0;
+    for(blockAddress_tp address : table.dataSegments) {
+        loadCounters(tableBlock++, address);
+    }
+    std::unordered_set<blockAddress_tp> walked;
+    for(blockAddress_tp segment = table.nextDataSegment; isDataBlock(segment) && walked.insert(segment).second; ) {
+        readBlock(segment, buffer);
+        const FSDescriptorDataPart part = *reinterpret_cast<const FSDescriptorDataPart *>(buffer.data());
+        for(blockAddress_tp address : part.dataBlocks) {
+            loadCounters(tableBlock++, address);
+        }
+        segment = part.nextSegment;
+    }
+}
+
+void ConsistencyChecker::checkDescriptorBlocks(partialResult &result, blockAddress_tp first, blockAddress_tp end) const
+{
+    const uint64_t descriptorsInBlock = header().descriptorsInBlock();
+    for(blockAddress_tp block = first; block < end; block++) {
+        readBlock(block, result.descriptorBlock);
+        const FSDescriptorsContainerBlock *container = reinterpret_cast<const FSDescriptorsContainerBlock *>(result.descriptorBlock.data());
+
+        bool full = true;
+        // descriptor 0 is not valid
+        for(uint64_t i = block == header().descriptorsBegin() ? 1 : 0; i < descriptorsInBlock; i++) {
+            const FSDescriptor &descriptor = container->descriptors[i];
+            descriptorIndex_tp index = (block - header().descriptorsBegin()) * descriptorsInBlock + i;
+            switch(descriptor.type) {
+            case DescriptorVariant::None:
+                full = false;
+                result.freeDescriptors++;
+                continue;
+            case DescriptorVariant::File:
+                checkFile(result, index, descriptor);
+                break;
+            case DescriptorVariant::Directory:
+                if(descriptor.parent == Constants::INVALID_DESCRIPTOR_ID() || descriptor.parent > header().descriptorsCount()) {
+                    addProblem(result, "Directory " + to_string(index) + " has bad parent " + to_string(descriptor.parent) + ".");
+                }
+                if(descriptor.isTreeDirectory()) {
+                    checkTreeDirectory(result, index, descriptor);
+                } else {
+                    checkListDirectory(result, index, descriptor);
+                }
+                break;
+            case DescriptorVariant::SymLink:
+                break;
+            default:
+                addProblem(result, "Descriptor " + to_string(index) + " has unknown type " + to_string(descriptor.type) + ".");
+                break;
+            }
+            result.references.emplace_back(index, descriptor.referencesCount);
+            result.descriptorsChecked++;
+        }
+        if(full) {
+            result.reachable[block / bitsInWord] |= uint64_t(1) << (block % bitsInWord);
+        }
+    }
+}
+
+void ConsistencyChecker::checkFile(partialResult &result, descriptorIndex_tp index, const FSDescriptor &descriptor) const
+{
+    for(blockAddress_tp block : descriptor.dataSegments) {
+        if(block != Constants::HEADER_ADDRESS()) {
+            markBlock(result, index, block);
+        }
+    }
+    walkFileSegments(result, index, descriptor.nextDataSegment);
+}
+
+void ConsistencyChecker::checkListDirectory(partialResult &result, descriptorIndex_tp index, const FSDescriptor &descriptor) const
+{
+    const uint64_t inDescriptor = header().entriesInDirectoryDescriptor;
+    const uint64_t inBlock = header().entriesInDirectoryBlock;
+    const uint64_t entries = descriptor.firstFreeElementIndex;
+    const uint64_t neededSegments = entries > inDescriptor ? (entries - inDescriptor + inBlock - 1) / inBlock : 0;
+
+    // segments after needed ones are not walked, they are cut at repair
+    std::vector<blockAddress_tp> chain;
+    std::vector<FSDescriptorDataPart> segments;
+    std::unordered_set<blockAddress_tp> walked;
+    blockAddress_tp segment = descriptor.nextDataSegment;
+    while(segment != Constants::HEADER_ADDRESS() && chain.size() < neededSegments) {
+        if(!isDataBlock(segment) || !walked.insert(segment).second) {
+            addProblem(result, "Directory " + to_string(index) + " has broken segments chain at block " + to_string(segment) + ".");
+            break;
+        }
+        readBlock(segment, result.block);
+        segments.push_back(*reinterpret_cast<const FSDescriptorDataPart *>(result.block.data()));
+        chain.push_back(segment);
+        segment = segments.back().nextSegment;
+    }
+
+    directoryFix fix{index, entries, descriptor.lastSegment, descriptor.preLastSegment, false, Constants::HEADER_ADDRESS()};
+    if(segment != Constants::HEADER_ADDRESS()) {
+        if(chain.size() == neededSegments) {
+            addProblem(result, "Directory " + to_string(index) + " has segments after last needed segment.");
+        }
+        fix.truncateChain = true;
+        fix.chainEnd = chain.empty() ? Constants::HEADER_ADDRESS() : chain.back();
+    }
+    if(chain.size() < neededSegments) {
+        addProblem(result, "Directory " + to_string(index) + " has " + to_string(entries) + " entries in "
+                   + to_string(chain.size()) + " segments, " + to_string(neededSegments) + " segments are needed.");
+        // entries of lost segments are dropped, last segment is used up to first never written slot
+        while(!chain.empty() && usedSlots(segments.back().directoryEntries, inBlock) == 0) {
+            chain.pop_back();
+            segments.pop_back();
+            fix.truncateChain = true;
+            fix.chainEnd = chain.empty() ? Constants::HEADER_ADDRESS() : chain.back();
+        }
+        fix.entriesCount = chain.empty() ? usedSlots(descriptor.directoryEntries, inDescriptor)
+                                         : inDescriptor + (chain.size() - 1) * inBlock + usedSlots(segments.back().directoryEntries, inBlock);
+    }
+    fix.lastSegment = chain.empty() ? Constants::HEADER_ADDRESS() : chain.back();
+    fix.preLastSegment = chain.size() < 2 ? Constants::HEADER_ADDRESS() : chain[chain.size() - 2];
+    if(fix.lastSegment != descriptor.lastSegment || fix.preLastSegment != descriptor.preLastSegment) {
+        addProblem(result, "Directory " + to_string(index) + " has wrong last segments.");
+    }
+
+    uint64_t rest = fix.entriesCount;
+    for(uint64_t i = 0; i < std::min(rest, inDescriptor); i++) {
+        addLink(result, index, descriptor.directoryEntries[i]);
+    }
+    rest -= std::min(rest, inDescriptor);
+    for(size_t s = 0; s < chain.size(); s++) {
+        markBlock(result, index, chain[s]);
+        blockAddress_tp previous = s == 0 ? Constants::HEADER_ADDRESS() : chain[s - 1];
+        if(segments[s].prevSegment != previous) {
+            addProblem(result, "Directory " + to_string(index) + " segment " + to_string(chain[s]) + " has wrong previous segment.");
+        }
+        for(uint64_t i = 0; i < std::min(rest, inBlock); i++) {
+            addLink(result, index, segments[s].directoryEntries[i]);
+        }
+        rest -= std::min(rest, inBlock);
+    }
+
+    if(fix.entriesCount != entries || fix.truncateChain
+            || fix.lastSegment != descriptor.lastSegment || fix.preLastSegment != descriptor.preLastSegment) {
+        result.directories.push_back(fix);
+    }
+}
+
+void ConsistencyChecker::checkTreeDirectory(partialResult &result, descriptorIndex_tp index, const FSDescriptor &descriptor) const
+{
+    uint64_t entries = 0;
+    std::vector<blockAddress_tp> nodes;
+    if(descriptor.nextDataSegment != Constants::HEADER_ADDRESS()) {
+        nodes.push_back(descriptor.nextDataSegment);
+    }
+    while(!nodes.empty()) {
+        blockAddress_tp address = nodes.back();
+        nodes.pop_back();
+        if(!markBlock(result, index, address)) {
+            continue;
+        }
+        readBlock(address, result.block);
+        const FSDirectoryTreeNode *node = reinterpret_cast<const FSDirectoryTreeNode *>(result.block.data());
+        if(node->isLeaf != 0) {
+            uint64_t count = std::min<uint64_t>(node->count, ARRAY_LENGTH(node->entries));
+            if(count != node->count) {
+                addProblem(result, "Directory " + to_string(index) + " leaf " + to_string(address) + " has bad entries count.");
+            }
+            for(uint64_t i = 0; i < count; i++) {
+                addLink(result, index, node->entries[i]);
+            }
+            entries += count;
+        } else {
+            uint64_t count = std::min<uint64_t>(node->count, ARRAY_LENGTH(node->items));
+            if(count != node->count) {
+                addProblem(result, "Directory " + to_string(index) + " node " + to_string(address) + " has bad items count.");
+            }
+            nodes.push_back(node->firstChild);
+            for(uint64_t i = 0; i < count; i++) {
+                nodes.push_back(node->items[i].child);
+            }
+        }
+    }
+
+    if(entries != descriptor.firstFreeElementIndex) {
+        addProblem(result, "Directory " + to_string(index) + " has " + to_string(descriptor.firstFreeElementIndex)
+                   + " entries, its tree has " + to_string(entries) + ".");
+        result.directories.push_back({index, entries, descriptor.lastSegment, descriptor.preLastSegment, false, Constants::HEADER_ADDRESS()});
+    }
+}
+
+void ConsistencyChecker::walkFileSegments(partialResult &result, descriptorIndex_tp index, blockAddress_tp segment) const
+{
+    while(segment != Constants::HEADER_ADDRESS()) {
+        if(!markBlock(result, index, segment)) {
+            return;
+        }
+        if(_counters.count(segment) != 0) {
+            result.sharedSegments.push_back(segment);
+            return;
+        }
+        readBlock(segment, result.block);
+        const FSDescriptorDataPart *part = reinterpret_cast<const FSDescriptorDataPart *>(result.block.data());
+        for(blockAddress_tp block : part->dataBlocks) {
+            if(block != Constants::HEADER_ADDRESS()) {
+                markBlock(result, index, block);
+            }
+        }
+        segment = part->nextSegment;
+    }
+}
+
+void ConsistencyChecker::walkSharedSegments(partialResult &result) const
+{
+    std::unordered_set<blockAddress_tp> walked;
+    // walkFileSegments appends segments shared by shared segments
+    for(size_t i = 0; i < result.sharedSegments.size(); i++) {
+        blockAddress_tp segment = result.sharedSegments[i];
+        if(!walked.insert(segment).second) {
+            continue;
+        }
+        readBlock(segment, result.block);
+        const FSDescriptorDataPart part = *reinterpret_cast<const FSDescriptorDataPart *>(result.block.data());
+        for(blockAddress_tp block : part.dataBlocks) {
+            if(block != Constants::HEADER_ADDRESS()) {
+                markBlock(result, Constants::INVALID_DESCRIPTOR_ID(), block);
+            }
+        }
+        walkFileSegments(result, Constants::INVALID_DESCRIPTOR_ID(), part.nextSegment);
+    }
+}
+
+bool ConsistencyChecker::markBlock(partialResult &result, descriptorIndex_tp owner, blockAddress_tp block) const
+{
+    if(!isDataBlock(block)) {
+        addProblem(result, "Block " + to_string(block) + " of " + ownerName(owner) + " is out of data area.");
+        return false;
+    }
+    uint64_t &word = result.reachable[block / bitsInWord];
+    const uint64_t bit = uint64_t(1) << (block % bitsInWord);
+    if(_counters.count(block) != 0) {
+        result.owners[block]++;
+        word |= bit;
+        return true;
+    }
+    if((word & bit) != 0) {
+        result.duplicates[block / bitsInWord] |= bit;
+        return false;
+    }
+    word |= bit;
+    return true;
+}
+
+void ConsistencyChecker::addLink(partialResult &result, descriptorIndex_tp directory, const directoryEntry &entry) const
+{
+    if(entry.descriptor == Constants::INVALID_DESCRIPTOR_ID() || entry.descriptor > header().descriptorsCount()) {
+        addProblem(result, "Directory " + to_string(directory) + " entry '" + entry.name(header().filenameLength)
+                   + "' has bad descriptor " + to_string(entry.descriptor) + ".");
+        return;
+    }
+    result.links[entry.descriptor]++;
+}
+
+void ConsistencyChecker::merge(partialResult &total, partialResult &part) const
+{
+    mergeBitMaps(total.reachable.data(), total.duplicates.data(), part.reachable.data(), part.duplicates.data(), total.reachable.size());
+    for(const auto &owners : part.owners) {
+        total.owners[owners.first] += owners.second;
+    }
+    total.sharedSegments.insert(total.sharedSegments.end(), part.sharedSegments.begin(), part.sharedSegments.end());
+    for(const auto &links : part.links) {
+        total.links[links.first] += links.second;
+    }
+    total.references.insert(total.references.end(), part.references.begin(), part.references.end());
+    total.directories.insert(total.directories.end(), part.directories.begin(), part.directories.end());
+
+    for(std::string &problem : part.problems) {
+        if(total.problems.size() < maxReportedProblems) {
+            total.problems.push_back(std::move(problem));
+        }
+    }
+    total.problemsCount += part.problemsCount;
+    total.freeDescriptors += part.freeDescriptors;
+    total.descriptorsChecked += part.descriptorsChecked;
+}
+
+void ConsistencyChecker::compareBitMap(partialResult &total, report &result) const
+{
+    const uint64_t bitsInBlock = header().bitsInBitMapBlock();
+    const blockAddress_tp first = header().descriptorsBegin();
+    const blockAddress_tp last = header().dataBlockEnd();
+    const blockAddress_tp dataBegin = header().dataBlockBegin();
+
+    std::vector<char> bitMapBlock;
+    blockAddress_tp loadedBitMapBlock = Constants::HEADER_ADDRESS();
+    for(uint64_t word = first / bitsInWord; word <= last / bitsInWord; word++) {
+        blockAddress_tp bitMapAddress = header().bitMapBegin() + word * bitsInWord / bitsInBlock;
+        if(bitMapAddress != loadedBitMapBlock) {
+            readBlock(bitMapAddress, bitMapBlock);
+            loadedBitMapBlock = bitMapAddress;
+        }
+        // bit i of block byte j is block j * 8 + i, so word is little endian
+        uint64_t onDisk;
+        memcpy(&onDisk, bitMapBlock.data() + (word * bitsInWord % bitsInBlock) / 8, sizeof(onDisk));
+
+        uint64_t checked = ~uint64_t(0);
+        uint64_t data = ~uint64_t(0);
+        blockAddress_tp wordBegin = word * bitsInWord;
+        for(uint64_t bit = 0; bit < bitsInWord; bit++) {
+            blockAddress_tp block = wordBegin + bit;
+            if(block < first || block > last) {
+                checked &= ~(uint64_t(1) << bit);
+            }
+            if(block < dataBegin || block > last) {
+                data &= ~(uint64_t(1) << bit);
+            }
+        }
+
+        const uint64_t expected = total.reachable[word];
+        result.freeBlocksCount += std::bitset<bitsInWord>(~expected & data).count();
+        uint64_t differs = (expected ^ onDisk) & checked;
+        for(uint64_t bit = 0; differs != 0 && bit < bitsInWord; bit++) {
+            if((differs >> bit & 1) == 0) {
+                continue;
+            }
+            blockAddress_tp block = wordBegin + bit;
+            bool used = (expected >> bit & 1) != 0;
+            if(used) {
+                result.usedBlocks.push_back(block);
+            } else {
+                result.freeBlocks.push_back(block);
+            }
+        }
+    }
+    if(!result.usedBlocks.empty()) {
+        addProblem(total, to_string(result.usedBlocks.size()) + " used blocks are free in bitmap.");
+    }
+    if(!result.freeBlocks.empty()) {
+        addProblem(total, to_string(result.freeBlocks.size()) + " free blocks are used in bitmap.");
+    }
+}
+
+void ConsistencyChecker::addProblem(partialResult &result, const std::string &problem)
+{
+    result.problemsCount++;
+    if(result.problems.size() < maxReportedProblems) {
+        result.problems.push_back(problem);
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef CONSISTENCYCHECKER_H
+#define CONSISTENCYCHECKER_H
+
+#include "fileaccessor.h"
+#include "filesystemblock.h"
+#include "constants.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/**
+ * @brief The ConsistencyChecker class
+ * Read only file system check. Descriptor blocks are sharded between threads, every thread walks
+ * files and directories of its descriptors into own partial bitmap of reachable blocks,
+ * partial bitmaps are merged at the end. Blocks are read directly, buffer pool is not used.
+ *
+ * Checked: bitmap bits of data blocks (reachable) and descriptor blocks (full),
+ * referencesCount (directory entries pointing to descriptor), firstFreeElementIndex and segments chain
+ * of directories, reference counters of shared blocks, free counters of header.
+ * Found problems are described in report with values needed for repair.
+ */
+class ConsistencyChecker
+{
+public:
+    struct directoryFix {
+        descriptorIndex_tp directory;
+        uint64_t entriesCount;              // firstFreeElementIndex
+        blockAddress_tp lastSegment;
+        blockAddress_tp preLastSegment;
+        // segments chain is cut after chainEnd (HEADER_ADDRESS() for descriptor) if truncateChain
+        bool truncateChain;
+        blockAddress_tp chainEnd;
+    };
+
+    struct report {
+        uint64_t problemsCount = 0;
+        std::vector<std::string> problems;  // first maxReportedProblems descriptions
+
+        std::vector<blockAddress_tp> usedBlocks;    // free in bitmap, must be used
+        std::vector<blockAddress_tp> freeBlocks;    // used in bitmap, must be free
+        std::vector<std::pair<descriptorIndex_tp, int64_t>> referencesCounts;
+        std::vector<directoryFix> directories;
+        std::vector<std::pair<blockAddress_tp, uint64_t>> blockOwners;     // shared block and its owners count
+
+        uint64_t freeBlocksCount = 0;
+        uint64_t freeDescriptorsCount = 0;
+        uint64_t descriptorsChecked = 0;
+    };
+
+    static constexpr uint64_t maxReportedProblems = 100;
+
+    /**
+     * @param threads 0 for hardware concurrency
+     */
+    explicit ConsistencyChecker(std::shared_ptr<FormatedFileAccessor> file, unsigned threads = 0);
+
+    report check();
+
+private:
+    struct partialResult;
+
+    const FSHeader &header() const;
+    void readBlock(blockAddress_tp block, std::vector<char> &buffer) const;
+    bool isDataBlock(blockAddress_tp block) const;
+
+    void loadReferenceCounters();
+    void checkDescriptorBlocks(partialResult &result, blockAddress_tp first, blockAddress_tp end) const;
+    void checkFile(partialResult &result, descriptorIndex_tp index, const FSDescriptor &descriptor) const;
+    void checkListDirectory(partialResult &result, descriptorIndex_tp index, const FSDescriptor &descriptor) const;
+    void checkTreeDirectory(partialResult &result, descriptorIndex_tp index, const FSDescriptor &descriptor) const;
+    // segments chain of file, stops at shared segment, it is walked once by walkSharedSegments
+    void walkFileSegments(partialResult &result, descriptorIndex_tp index, blockAddress_tp segment) const;
+    void walkSharedSegments(partialResult &result) const;
+    // false if block must not be walked: it is out of data area or it was already reached by not shared link
+    bool markBlock(partialResult &result, descriptorIndex_tp owner, blockAddress_tp block) const;
+    void addLink(partialResult &result, descriptorIndex_tp directory, const directoryEntry &entry) const;
+
+    void merge(partialResult &total, partialResult &part) const;
+    void compareBitMap(partialResult &total, report &result) const;
+
+    static void addProblem(partialResult &result, const std::string &problem);
+
+    std::shared_ptr<FormatedFileAccessor> _file;
+    unsigned _threads;
+    // reference counters of shared blocks (not zero only), loaded before check
+    std::unordered_map<blockAddress_tp, uint64_t> _counters;
+};
+
+#endif // CONSISTENCYCHECKER_H
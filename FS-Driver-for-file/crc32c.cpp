@@ -0,0 +1,163 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_SSE42
+#include <nmmintrin.h>
+#endif
+
+namespace {
+
+constexpr uint32_t polynomial = 0x82F63B78;     // reversed Castagnoli polynomial
+
+struct crcTables {
+    uint32_t table[8][256];
+
+    crcTables() {
+        for(uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for(int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+            }
+            table[0][i] = crc;
+        }
+        for(uint32_t i = 0; i < 256; i++) {
+            for(int slice = 1; slice < 8; slice++) {
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+const crcTables &tables()
+{
+    static const crcTables instance;
+    return instance;
+}
+
+uint32_t crc32cTable(const unsigned char *data, size_t size, uint32_t crc)
+{
+    const auto &t = tables().table;
+    while(size >= 8) {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, data, sizeof(low));
+        memcpy(&high, data + 4, sizeof(high));
+        low ^= crc;
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while(size-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardwareSerial(const unsigned char *data, size_t size, uint32_t crc)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while(size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+    while(size >= 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+        data += 4;
+        size -= 4;
+    }
+    while(size-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+#ifdef __x86_64__
+constexpr size_t parallelLength = 336;      // bytes of every stream in one round
+
+/**
+ * @brief appends parallelLength zero bytes to crc register, crc is linear so it is a sum of table values for every byte
+ */
+struct crcShift {
+    uint32_t table[4][256];
+
+    crcShift() {
+        static const unsigned char zeros[parallelLength] = {};
+        for(int byte = 0; byte < 4; byte++) {
+            for(uint32_t value = 0; value < 256; value++) {
+                table[byte][value] = crc32cHardwareSerial(zeros, parallelLength, value << (8 * byte));
+            }
+        }
+    }
+
+    uint32_t apply(uint32_t crc) const {
+        return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^ table[2][(crc >> 16) & 0xFF] ^ table[3][crc >> 24];
+    }
+};
+
+// three independent streams hide crc32 instruction latency
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(const unsigned char *data, size_t size, uint32_t crc)
+{
+    static const crcShift shift;
+    while(size >= 3 * parallelLength) {
+        uint64_t crcA = crc;
+        uint64_t crcB = 0;
+        uint64_t crcC = 0;
+        for(size_t i = 0; i < parallelLength; i += 8) {
+            uint64_t wordA;
+            uint64_t wordB;
+            uint64_t wordC;
+            memcpy(&wordA, data + i, sizeof(wordA));
+            memcpy(&wordB, data + parallelLength + i, sizeof(wordB));
+            memcpy(&wordC, data + 2 * parallelLength + i, sizeof(wordC));
+            crcA = _mm_crc32_u64(crcA, wordA);
+            crcB = _mm_crc32_u64(crcB, wordB);
+            crcC = _mm_crc32_u64(crcC, wordC);
+        }
+        crc = shift.apply(static_cast<uint32_t>(crcA)) ^ static_cast<uint32_t>(crcB);
+        crc = shift.apply(crc) ^ static_cast<uint32_t>(crcC);
+        data += 3 * parallelLength;
+        size -= 3 * parallelLength;
+    }
+    return crc32cHardwareSerial(data, size, crc);
+}
+#else
+uint32_t crc32cHardware(const unsigned char *data, size_t size, uint32_t crc)
+{
+    return crc32cHardwareSerial(data, size, crc);
+}
+#endif
+
+bool hasHardwareCrc()
+{
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+}
+#endif
+
+}
+
+uint32_t crc32c(const void *data, size_t size, uint32_t crc)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+#ifdef CRC32C_SSE42
+    if(hasHardwareCrc()) {
+        return ~crc32cHardware(bytes, size, crc);
+    }
+#endif
+    return ~crc32cTable(bytes, size, crc);
+}
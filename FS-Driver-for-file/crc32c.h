@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief CRC32C (Castagnoli), uses SSE4.2 crc32 instruction if processor supports it,
+ * table driven (slicing by 8) otherwise
+ */
+uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0);
+
+#endif // CRC32C_H
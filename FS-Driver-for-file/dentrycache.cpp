@@ -0,0 +1,94 @@
+#include "dentrycache.h"
+
+constexpr size_t DentryCache::defaultCapacity;
+
+DentryCache::DentryCache(size_t capacity) :
+    _capacity(capacity)
+{
+}
+
+bool DentryCache::find(descriptorIndex_tp directory, const std::string &name, descriptorIndex_tp *result)
+{
+    auto it = _entries.find(key_tp{directory, name});
+    if(it == _entries.end()) {
+        return false;
+    }
+    _lru.splice(_lru.begin(), _lru, it->second);
+    *result = it->second->second;
+    return true;
+}
+
+void DentryCache::insert(descriptorIndex_tp directory, const std::string &name, descriptorIndex_tp descriptor)
+{
+    if(_capacity == 0) {
+        return;
+    }
+
+    key_tp key{directory, name};
+    auto it = _entries.find(key);
+    if(it != _entries.end()) {
+        it->second->second = descriptor;
+        _lru.splice(_lru.begin(), _lru, it->second);
+        return;
+    }
+
+    _lru.emplace_front(key, descriptor);
+    _entries.emplace(std::move(key), _lru.begin());
+    shrink();
+}
+
+void DentryCache::insertNegative(descriptorIndex_tp directory, const std::string &name)
+{
+    insert(directory, name, Constants::INVALID_DESCRIPTOR_ID());
+}
+
+void DentryCache::erase(descriptorIndex_tp directory, const std::string &name)
+{
+    auto it = _entries.find(key_tp{directory, name});
+    if(it != _entries.end()) {
+        _lru.erase(it->second);
+        _entries.erase(it);
+    }
+}
+
+void DentryCache::eraseDirectory(descriptorIndex_tp directory)
+{
+    for(auto it = _lru.begin(); it != _lru.end(); ) {
+        if(it->first.directory == directory) {
+            _entries.erase(it->first);
+            it = _lru.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void DentryCache::clear()
+{
+    _entries.clear();
+    _lru.clear();
+}
+
+size_t DentryCache::size() const
+{
+    return _entries.size();
+}
+
+size_t DentryCache::capacity() const
+{
+    return _capacity;
+}
+
+void DentryCache::setCapacity(size_t capacity)
+{
+    _capacity = capacity;
+    shrink();
+}
+
+void DentryCache::shrink()
+{
+    while(_entries.size() > _capacity) {
+        _entries.erase(_lru.back().first);
+        _lru.pop_back();
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef DENTRYCACHE_H
+#define DENTRYCACHE_H
+
+#include "constants.h"
+
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief The DentryCache class
+ * LRU cache of (directory descriptor, name) -> descriptor lookups.
+ * Negative entries store Constants::INVALID_DESCRIPTOR_ID().
+ */
+class DentryCache
+{
+public:
+    explicit DentryCache(size_t capacity = defaultCapacity);
+
+    /**
+     * @brief find cached lookup result
+     * @param result set to found descriptor or INVALID_DESCRIPTOR_ID() for negative entry
+     * @return false if there is no cached result
+     */
+    bool find(descriptorIndex_tp directory, const std::string &name, descriptorIndex_tp *result);
+
+    void insert(descriptorIndex_tp directory, const std::string &name, descriptorIndex_tp descriptor);
+    void insertNegative(descriptorIndex_tp directory, const std::string &name);
+
+    void erase(descriptorIndex_tp directory, const std::string &name);
+    void eraseDirectory(descriptorIndex_tp directory);
+    void clear();
+
+    size_t size() const;
+    size_t capacity() const;
+    void setCapacity(size_t capacity);
+
+    static constexpr size_t defaultCapacity = 4096;
+
+private:
+    struct key_tp {
+        descriptorIndex_tp directory;
+        std::string name;
+
+        bool operator ==(const key_tp &other) const {
+            return directory == other.directory && name == other.name;
+        }
+    };
+
+    struct keyHash {
+        size_t operator()(const key_tp &key) const {
+            return std::hash<std::string>()(key.name) ^ (std::hash<descriptorIndex_tp>()(key.directory) * 31);
+        }
+    };
+
+    using lruList_tp = std::list<std::pair<key_tp, descriptorIndex_tp>>;
+
+    void shrink();
+
+    size_t _capacity;
+    lruList_tp _lru;     // most recently used in front
+    std::unordered_map<key_tp, lruList_tp::iterator, keyHash> _entries;
+};
+
+#endif // DENTRYCACHE_H
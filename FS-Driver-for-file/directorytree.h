@@ -0,0 +1,370 @@
+#ifndef DIRECTORYTREE_H
+#define DIRECTORYTREE_H
+
+#include "project_exceptions.h"
+#include "filesystemblock.h"
+#include "blockbuffer.h"
+#include "constants.h"
+
+#include <vector>
+#include <utility>
+#include <cassert>
+#include <cstring>
+
+/**
+ * @brief The DirectoryTree class
+ * B+tree directory layout. Root block is stored in descriptor nextDataSegment,
+ * entries count in descriptor firstFreeElementIndex. Leafs are linked for range scans.
+ * Empty nodes are released, but not full nodes are not merged.
+ *
+ * BlockSource must provide:
+ *   template<typename T> TypedBufferLocker<T> readBlock(blockAddress_tp block, SyncType type) const;
+ *   blockAddress_tp allocBlock() const;
+ *   void deallocBlock(blockAddress_tp block) const;
+ *
+ * Changes of descriptor are not saved, caller must update it.
+ */
+template<typename BlockSource>
+class DirectoryTree
+{
+    using node_tp = FSDirectoryTreeNode;
+    using nodeLocker_tp = TypedBufferLocker<FSDirectoryTreeNode>;
+    // inner node address and index of child (-1 for firstChild)
+    using path_tp = std::vector<std::pair<blockAddress_tp, int64_t>>;
+
+public:
+    DirectoryTree(BlockSource source, FSDescriptor *descriptor) :
+        _source(source),
+        _descriptor(descriptor)
+    {
+        assert(descriptor->isTreeDirectory());
+    }
+
+    static constexpr uint32_t leafCapacity = ARRAY_LENGTH(FSDirectoryTreeNode::entries);
+    static constexpr uint32_t innerCapacity = ARRAY_LENGTH(FSDirectoryTreeNode::items);
+
+    /**
+     * @return entry descriptor or Constants::INVALID_DESCRIPTOR_ID()
+     */
+    descriptorIndex_tp find(const PaddedName &name) const
+    {
+        if(root() == Constants::HEADER_ADDRESS()) {
+            return Constants::INVALID_DESCRIPTOR_ID();
+        }
+        nodeLocker_tp leaf = findLeaf(keyOf(name), nullptr);
+        bool found = false;
+        uint32_t pos = lowerBound(*leaf, keyOf(name), &found);
+        return found ? leaf->entries[pos].descriptor : Constants::INVALID_DESCRIPTOR_ID();
+    }
+
+    void insert(const directoryEntry &entry)
+    {
+        const char *key = entry.__name;
+        if(root() == Constants::HEADER_ADDRESS()) {
+            blockAddress_tp leafAddress = _source.allocBlock();
+            nodeLocker_tp leaf = readNode(leafAddress, SyncType::WriteOnly);
+            leaf->initLeaf();
+            leaf->entries[0] = entry;
+            leaf->count = 1;
+            setRoot(leafAddress);
+            _descriptor->firstFreeElementIndex++;
+            return;
+        }
+
+        path_tp path;
+        nodeLocker_tp leaf = findLeaf(key, &path, SyncType::ReadWrite);
+        bool found = false;
+        uint32_t pos = lowerBound(*leaf, key, &found);
+        // names are checked by FileSystem before anything is allocated
+        assert(!found);
+        _descriptor->firstFreeElementIndex++;
+
+        if(leaf->count < leafCapacity) {
+            insertToLeaf(*leaf, pos, entry);
+            return;
+        }
+
+        // split leaf, left part keeps lower half
+        blockAddress_tp leafAddress = _leafAddress;
+        blockAddress_tp newLeafAddress = _source.allocBlock();
+        nodeLocker_tp newLeaf = readNode(newLeafAddress, SyncType::WriteOnly);
+        newLeaf->initLeaf();
+
+        uint32_t leftCount = (leafCapacity + 1) / 2;
+        uint32_t moved = leaf->count - leftCount;
+        memcpy(newLeaf->entries, leaf->entries + leftCount, moved * sizeof(directoryEntry));
+        newLeaf->count = moved;
+        leaf->count = leftCount;
+
+        newLeaf->nextLeaf = leaf->nextLeaf;
+        newLeaf->prevLeaf = leafAddress;
+        if(leaf->nextLeaf != Constants::HEADER_ADDRESS()) {
+            nodeLocker_tp next = readNode(leaf->nextLeaf, SyncType::ReadWrite);
+            next->prevLeaf = newLeafAddress;
+        }
+        leaf->nextLeaf = newLeafAddress;
+
+        if(pos <= leftCount) {
+            insertToLeaf(*leaf, pos, entry);
+        } else {
+            insertToLeaf(*newLeaf, pos - leftCount, entry);
+        }
+
+        insertToParent(path, newLeaf->entries[0].__name, newLeafAddress);
+    }
+
+    /**
+     * @param removed set to removed entry descriptor
+     * @return false if there is no such name
+     */
+    bool remove(const PaddedName &name, descriptorIndex_tp *removed = nullptr)
+    {
+        if(root() == Constants::HEADER_ADDRESS()) {
+            return false;
+        }
+        path_tp path;
+        nodeLocker_tp leaf = findLeaf(keyOf(name), &path, SyncType::ReadWrite);
+        bool found = false;
+        uint32_t pos = lowerBound(*leaf, keyOf(name), &found);
+        if(!found) {
+            leaf.setSyncType(SyncType::ReadOnly);
+            return false;
+        }
+        if(removed != nullptr) {
+            *removed = leaf->entries[pos].descriptor;
+        }
+        memmove(leaf->entries + pos, leaf->entries + pos + 1, (leaf->count - pos - 1) * sizeof(directoryEntry));
+        leaf->count--;
+        _descriptor->firstFreeElementIndex--;
+
+        if(leaf->count != 0) {
+            return true;
+        }
+
+        // release empty leaf
+        blockAddress_tp leafAddress = _leafAddress;
+        if(leaf->prevLeaf != Constants::HEADER_ADDRESS()) {
+            nodeLocker_tp prev = readNode(leaf->prevLeaf, SyncType::ReadWrite);
+            prev->nextLeaf = leaf->nextLeaf;
+        }
+        if(leaf->nextLeaf != Constants::HEADER_ADDRESS()) {
+            nodeLocker_tp next = readNode(leaf->nextLeaf, SyncType::ReadWrite);
+            next->prevLeaf = leaf->prevLeaf;
+        }
+        leaf.setSyncType(SyncType::ReadOnly);
+        _source.deallocBlock(leafAddress);
+
+        removeFromParent(path);
+        return true;
+    }
+
+    /**
+     * @brief visit entries in name order starting from first name >= from
+     * @param from lower bound, nullptr to start from first entry
+     * @param visitor bool(const directoryEntry &), return false to stop
+     */
+    template<typename Visitor>
+    void scan(const PaddedName *from, Visitor visitor) const
+    {
+        if(root() == Constants::HEADER_ADDRESS()) {
+            return;
+        }
+        nodeLocker_tp leaf;
+        uint32_t pos = 0;
+        if(from != nullptr) {
+            leaf = findLeaf(keyOf(*from), nullptr);
+            bool found;
+            pos = lowerBound(*leaf, keyOf(*from), &found);
+        } else {
+            leaf = readNode(root(), SyncType::ReadOnly);
+            while(!leaf->isLeaf) {
+                leaf = readNode(leaf->firstChild, SyncType::ReadOnly);
+            }
+        }
+
+        while(true) {
+            for(; pos < leaf->count; pos++) {
+                if(!visitor(const_cast<const directoryEntry &>(leaf->entries[pos]))) {
+                    return;
+                }
+            }
+            if(leaf->nextLeaf == Constants::HEADER_ADDRESS()) {
+                return;
+            }
+            leaf = readNode(leaf->nextLeaf, SyncType::ReadOnly);
+            pos = 0;
+        }
+    }
+
+private:
+    static const char *keyOf(const PaddedName &name) {
+        return reinterpret_cast<const char *>(name.words);
+    }
+
+    static int compareKeys(const char *first, const char *second) {
+        return memcmp(first, second, sizeof(directoryEntry::__name));
+    }
+
+    blockAddress_tp root() const {
+        return _descriptor->nextDataSegment;
+    }
+
+    void setRoot(blockAddress_tp address) {
+        _descriptor->nextDataSegment = address;
+    }
+
+    nodeLocker_tp readNode(blockAddress_tp address, SyncType type) const {
+        return _source.template readBlock<FSDirectoryTreeNode>(address, type);
+    }
+
+    // index of last item with key <= name, -1 for firstChild
+    static int64_t childIndex(node_tp &node, const char *key) {
+        int64_t left = 0;
+        int64_t right = node.count;
+        while(left < right) {
+            int64_t middle = (left + right) / 2;
+            if(compareKeys(node.items[middle].key, key) <= 0) {
+                left = middle + 1;
+            } else {
+                right = middle;
+            }
+        }
+        return left - 1;
+    }
+
+    static blockAddress_tp childAt(node_tp &node, int64_t index) {
+        return index < 0 ? node.firstChild : node.items[index].child;
+    }
+
+    static uint32_t lowerBound(node_tp &leaf, const char *key, bool *found) {
+        uint32_t left = 0;
+        uint32_t right = leaf.count;
+        while(left < right) {
+            uint32_t middle = (left + right) / 2;
+            if(compareKeys(leaf.entries[middle].__name, key) < 0) {
+                left = middle + 1;
+            } else {
+                right = middle;
+            }
+        }
+        *found = left < leaf.count && compareKeys(leaf.entries[left].__name, key) == 0;
+        return left;
+    }
+
+    nodeLocker_tp findLeaf(const char *key, path_tp *path, SyncType leafSync = SyncType::ReadOnly) const {
+        blockAddress_tp address = root();
+        nodeLocker_tp node = readNode(address, SyncType::ReadOnly);
+        while(!node->isLeaf) {
+            int64_t index = childIndex(*node, key);
+            if(path != nullptr) {
+                path->emplace_back(address, index);
+            }
+            address = childAt(*node, index);
+            node = readNode(address, SyncType::ReadOnly);
+        }
+        _leafAddress = address;
+        node.setSyncType(leafSync);
+        return node;
+    }
+
+    static void insertToLeaf(node_tp &leaf, uint32_t pos, const directoryEntry &entry) {
+        memmove(leaf.entries + pos + 1, leaf.entries + pos, (leaf.count - pos) * sizeof(directoryEntry));
+        leaf.entries[pos] = entry;
+        leaf.count++;
+    }
+
+    void insertToParent(path_tp &path, const char *separatorKey, blockAddress_tp rightAddress) {
+        node_tp::innerItem item;
+        memcpy(item.key, separatorKey, sizeof(item.key));
+        item.child = rightAddress;
+
+        while(!path.empty()) {
+            auto position = path.back();
+            path.pop_back();
+
+            nodeLocker_tp node = readNode(position.first, SyncType::ReadWrite);
+            uint32_t insertPos = static_cast<uint32_t>(position.second + 1);
+            if(node->count < innerCapacity) {
+                memmove(node->items + insertPos + 1, node->items + insertPos, (node->count - insertPos) * sizeof(item));
+                node->items[insertPos] = item;
+                node->count++;
+                return;
+            }
+
+            // split inner node, middle key goes up
+            std::vector<node_tp::innerItem> items(node->items, node->items + node->count);
+            items.insert(items.begin() + insertPos, item);
+            uint32_t middle = static_cast<uint32_t>(items.size() / 2);
+
+            blockAddress_tp newNodeAddress = _source.allocBlock();
+            nodeLocker_tp newNode = readNode(newNodeAddress, SyncType::WriteOnly);
+            newNode->initInner(items[middle].child);
+            newNode->count = static_cast<uint32_t>(items.size() - middle - 1);
+            memcpy(newNode->items, items.data() + middle + 1, newNode->count * sizeof(item));
+
+            node->count = middle;
+            memcpy(node->items, items.data(), middle * sizeof(item));
+
+            item = items[middle];
+            item.child = newNodeAddress;
+        }
+
+        // root was split
+        blockAddress_tp newRootAddress = _source.allocBlock();
+        nodeLocker_tp newRoot = readNode(newRootAddress, SyncType::WriteOnly);
+        newRoot->initInner(root());
+        newRoot->items[0] = item;
+        newRoot->count = 1;
+        setRoot(newRootAddress);
+    }
+
+    void removeFromParent(path_tp &path) {
+        while(true) {
+            if(path.empty()) {
+                // removed node was root
+                setRoot(Constants::HEADER_ADDRESS());
+                return;
+            }
+            auto position = path.back();
+            path.pop_back();
+
+            nodeLocker_tp node = readNode(position.first, SyncType::ReadWrite);
+            if(position.second < 0) {
+                if(node->count == 0) {
+                    node.setSyncType(SyncType::ReadOnly);
+                    _source.deallocBlock(position.first);
+                    continue;
+                }
+                node->firstChild = node->items[0].child;
+                memmove(node->items, node->items + 1, (node->count - 1) * sizeof(node_tp::innerItem));
+            } else {
+                uint32_t pos = static_cast<uint32_t>(position.second);
+                memmove(node->items + pos, node->items + pos + 1, (node->count - pos - 1) * sizeof(node_tp::innerItem));
+            }
+            node->count--;
+            break;
+        }
+
+        // inner root with one child is not needed
+        while(true) {
+            nodeLocker_tp rootNode = readNode(root(), SyncType::ReadOnly);
+            if(rootNode->isLeaf || rootNode->count != 0) {
+                return;
+            }
+            blockAddress_tp oldRoot = root();
+            setRoot(rootNode->firstChild);
+            _source.deallocBlock(oldRoot);
+        }
+    }
+
+    BlockSource _source;
+    FSDescriptor *_descriptor;
+    mutable blockAddress_tp _leafAddress = Constants::HEADER_ADDRESS();   // address of leaf found by last findLeaf()
+};
+
+template<typename BlockSource>
+constexpr uint32_t DirectoryTree<BlockSource>::leafCapacity;
+template<typename BlockSource>
+constexpr uint32_t DirectoryTree<BlockSource>::innerCapacity;
+
+#endif // DIRECTORYTREE_H
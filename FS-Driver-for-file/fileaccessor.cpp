@@ -2,9 +2,13 @@
 
 #include "project_exceptions.h"
 using namespace fs_excetion;
+#include "crc32c.h"
 
 #include <cstring>
 #include <stdexcept>
+#include <iostream>
+#include <algorithm>
+#include <limits>
 
 BlockFileAccessor::~BlockFileAccessor()
 {
@@ -87,6 +91,27 @@ void BlockFileAccessor::write(blockAddress_tp offset, std::vector<const FileSyst
     }
 }
 
+void BlockFileAccessor::writeMetadata(blockAddress_tp offset, const FileSystemBlock *block)
+{
+    if(block == nullptr || block->blockData() == nullptr) {
+        throw std::invalid_argument("Nullpointer to block.");
+    }
+    checkOpen();
+    _writeMetadata(offset, block->blockData(), getBlockSize());
+}
+
+void BlockFileAccessor::readBlocks(blockAddress_tp first, char *buffer, uint64_t count) const
+{
+    checkOpen();
+    _read(first, buffer, count * getBlockSize());
+}
+
+void BlockFileAccessor::writeBlocks(blockAddress_tp first, const char *buffer, uint64_t count)
+{
+    checkOpen();
+    _write(first, buffer, count * getBlockSize());
+}
+
 blockAddress_tp BlockFileAccessor::lastBlockAddress() const
 {
     checkOpen();
@@ -110,6 +135,7 @@ blockAddress_tp BlockFileAccessor::lastBlockAddress() const
 
 void BlockFileAccessor::_write(blockAddress_tp block, const char *buffer, uint64_t size)
 {
+    std::lock_guard<std::mutex> lock(_fileMutex);
     _file.seekp(blockToPosType(block));
     _file.write(buffer, size);
     _file.flush();
@@ -117,10 +143,23 @@ void BlockFileAccessor::_write(blockAddress_tp block, const char *buffer, uint64
 
 void BlockFileAccessor::_read(blockAddress_tp blockAddr, char *buffer, uint64_t size) const
 {
+    std::lock_guard<std::mutex> lock(_fileMutex);
     _file.seekg(blockToPosType(blockAddr));
     _file.read(buffer, size);
 }
 
+void BlockFileAccessor::_writeMetadata(blockAddress_tp block, const char *buffer, uint64_t size)
+{
+    _write(block, buffer, size);
+    metadataWritten(block, buffer);
+}
+
+bool BlockFileAccessor::_readMetadata(blockAddress_tp block, char *buffer, uint64_t size) const
+{
+    _read(block, buffer, size);
+    return isValidMetadata(block, buffer);
+}
+
 void BlockFileAccessor::updateBlockConfiguration()
 {
     checkOpen();
@@ -192,6 +231,17 @@ uint64_t BlockFileAccessor::getBlockSize() const
     return _blockSize;
 }
 
+constexpr uint64_t FormatedFileAccessor::maxCachedChecksumBlocks;
+
+FormatedFileAccessor::~FormatedFileAccessor()
+{
+    try {
+        close();
+    } catch(const std::exception &e) {
+        std::cerr << "Checksums are not written: " << e.what() << "\n";
+    }
+}
+
 const FSHeader &FormatedFileAccessor::headerExcept() const
 {
     checkOpen();
@@ -203,6 +253,42 @@ void FormatedFileAccessor::open(std::string path, uint64_t blockSize)
 {
     BlockFileAccessor::open(path, blockSize);
     syncHeaderFromFile();
+    if(isFormatedFS() && _header.version != FSHeader::currentVersion) {
+        // areas of other layouts are unknown, file can only be formatted
+        return;
+    }
+    if(hasJournal()) {
+        uint64_t replayed = _journal.open(_header.journalBegin, _header.journalEnd);
+        if(replayed != 0) {
+            std::clog << "Metadata journal: " << replayed << " transactions replayed.\n";
+        }
+    }
+    openChecksums();
+}
+
+void FormatedFileAccessor::close()
+{
+    // checkpoint changes home locations, checksums are written after it
+    _journal.close();
+    bool headerChanged = false;
+    if(hasChecksums()) {
+        syncChecksums();
+        if(_header.checksumsSynced == 0) {
+            _header.checksumsSynced = 1;
+            headerChanged = true;
+        }
+    }
+    if(isFormatedFS() && _header.countersSynced == 0) {
+        _header.countersSynced = 1;
+        headerChanged = true;
+    }
+    if(headerChanged) {
+        syncHeaderToFile();
+    }
+    _checksumBlocks.clear();
+    _checksumBlocksIndex.clear();
+    _reservedBlocks = 0;
+    BlockFileAccessor::close();
 }
 
 const FSHeader *FormatedFileAccessor::header() const
@@ -217,14 +303,108 @@ const FSHeader *FormatedFileAccessor::header() const
 void FormatedFileAccessor::syncHeaderToFile()
 {
     checkOpen();
+    Transaction *transaction = activeTransaction();
+    if(transaction != nullptr && transaction->_headerSaved) {
+        FSHeader committed = transaction->_previousHeader;
+        keepAccessorFields(committed);
+        BlockFileAccessor::_write(Constants::HEADER_ADDRESS(), committed.blockData(), sizeof(FSHeader));
+        return;
+    }
     BlockFileAccessor::_write(Constants::HEADER_ADDRESS(), _header.blockData(), sizeof(FSHeader));
 }
 
+void FormatedFileAccessor::restoreHeader(const FSHeader &header)
+{
+    FSHeader restored = header;
+    keepAccessorFields(restored);
+    _header.freeBlocks = restored.freeBlocks;
+    _header.freeDescriptors = restored.freeDescriptors;
+    // layout fields are read by other threads, they are not rewritten if only counters were changed
+    if(memcmp(&_header, &restored, sizeof(FSHeader)) != 0) {
+        _header = restored;
+    }
+}
+
+void FormatedFileAccessor::keepAccessorFields(FSHeader &header) const
+{
+    header.checksumsSynced = _header.checksumsSynced;
+    header.countersSynced = _header.countersSynced;
+    header.bitMapLazyBegin = _header.bitMapLazyBegin;
+    header.descriptorsLazyBegin = _header.descriptorsLazyBegin;
+    header.checksumsLazyBegin = _header.checksumsLazyBegin;
+}
+
+std::array<FormatedFileAccessor::lazyArea, 3> FormatedFileAccessor::lazyAreas() const
+{
+    return {{
+        {&FSHeader::bitMapLazyBegin, _header.bitMapEnd()},
+        {&FSHeader::descriptorsLazyBegin, _header.descriptorsEnd()},
+        {&FSHeader::checksumsLazyBegin, _header.checksumsEnd}
+    }};
+}
+
+void FormatedFileAccessor::readInitialized(blockAddress_tp first, char *buffer, uint64_t size) const
+{
+    std::lock_guard<std::mutex> lock(_lazyMutex);
+    const uint64_t blockSize = getBlockSize();
+    blockAddress_tp last = first + (size + blockSize - 1) / blockSize - 1;
+    for(const lazyArea &area : lazyAreas()) {
+        blockAddress_tp lazyBegin = _header.*area.lazyBegin;
+        if(lazyBegin != Constants::HEADER_ADDRESS() && first >= lazyBegin && last <= area.end) {
+            memset(buffer, 0, size);
+            return;
+        }
+    }
+
+    BlockFileAccessor::_read(first, buffer, size);
+    for(const lazyArea &area : lazyAreas()) {
+        blockAddress_tp lazyBegin = _header.*area.lazyBegin;
+        if(lazyBegin == Constants::HEADER_ADDRESS()) {
+            continue;
+        }
+        blockAddress_tp begin = std::max(first, lazyBegin);
+        blockAddress_tp end = std::min(last, area.end);
+        if(begin <= end) {
+            uint64_t offset = (begin - first) * blockSize;
+            memset(buffer + offset, 0, std::min(size, (end - first + 1) * blockSize) - offset);
+        }
+    }
+}
+
+void FormatedFileAccessor::initializeBlocks(blockAddress_tp first, uint64_t count)
+{
+    if(count == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_lazyMutex);
+    blockAddress_tp last = first + count - 1;
+    bool changed = false;
+    for(const lazyArea &area : lazyAreas()) {
+        blockAddress_tp &lazyBegin = _header.*area.lazyBegin;
+        if(lazyBegin == Constants::HEADER_ADDRESS() || last < lazyBegin || first > area.end) {
+            continue;
+        }
+        // cleared by chunks, header is not written for every touched block
+        blockAddress_tp clearEnd = std::min(area.end, std::max(last, lazyBegin + lazyInitBlocks - 1));
+        std::vector<char> zeros(std::min(clearEnd - lazyBegin + 1, lazyInitBlocks) * getBlockSize(), 0);
+        for(blockAddress_tp block = lazyBegin; block <= clearEnd; block += lazyInitBlocks) {
+            uint64_t blocks = std::min(clearEnd - block + 1, lazyInitBlocks);
+            BlockFileAccessor::_write(block, zeros.data(), blocks * getBlockSize());
+        }
+        lazyBegin = (clearEnd == area.end) ? Constants::HEADER_ADDRESS() : clearEnd + 1;
+        changed = true;
+    }
+    // replayed journal or written blocks must not be hidden by old marks after crash
+    if(changed) {
+        syncHeaderToFile();
+    }
+}
+
 void FormatedFileAccessor::syncHeaderFromFile()
 {
     BlockFileAccessor::_read(Constants::HEADER_ADDRESS(), reinterpret_cast<char *>(&_header), sizeof(FSHeader));
     if(isFormatedFS()){
-        setBlockSize(header()->blockByteSize);
+        setBlockSize(_header.blockByteSize);
     }
 }
 
@@ -233,8 +413,9 @@ void FormatedFileAccessor::ensureValidFS() const
     if(!isFormatedFS()) {
         throw file_not_formated_exception("This file system is not valid.");
     } else {
-        if(_header.version != 1) {
-            throw file_not_formated_exception("Unsupported filesystem version.");
+        if(_header.version != FSHeader::currentVersion) {
+            // older layouts are not converted, directories would be misread
+            throw file_not_formated_exception("Unsupported filesystem version " + std::to_string(_header.version) + ", format the file again.");
         }
     }
 }
@@ -249,9 +430,399 @@ void FormatedFileAccessor::formatFS(const FSHeader &header)
     if(!header.signature.isValidSignature()) {
         throw bad_state_exception("Bad header");
     }
+    // changes of previous file system are not written over new one
+    _journal.discard();
     _header = header;
+    _reservedBlocks = 0;
+    if(hasChecksums()) {
+        _header.checksumsLazyBegin = _header.checksumsBegin;
+    }
     syncHeaderToFile();
     setBlockSize(_header.blockByteSize);
+
+    // checksums area is lazy, its blocks are read as zeros
+    _checksumBlocks.clear();
+    _checksumBlocksIndex.clear();
+    _checksumsInBlock = getBlockSize() / sizeof(uint32_t);
+    if(hasJournal()) {
+        _journal.format(_header.journalBegin, _header.journalEnd);
+    }
+}
+
+void FormatedFileAccessor::updateHeader(const FSHeader &header)
+{
+    ensureValidFS();
+    if(!header.signature.isValidSignature() || header.blockByteSize != _header.blockByteSize) {
+        throw bad_state_exception("Bad header");
+    }
+    // checksums state is kept by accessor
+    FSHeader changed = header;
+    changed.checksumsBegin = _header.checksumsBegin;
+    changed.checksumsEnd = _header.checksumsEnd;
+    changed.checksumsSynced = _header.checksumsSynced;
+    changed.journalBegin = _header.journalBegin;
+    changed.journalEnd = _header.journalEnd;
+    changed.freeBlocks = _header.freeBlocks;
+    changed.freeDescriptors = _header.freeDescriptors;
+    keepAccessorFields(changed);
+    FSHeader previous = _header;
+    _header = changed;
+    Transaction *transaction = activeTransaction();
+    if(transaction != nullptr) {
+        transaction->headerChanged(previous);     // written at commit
+        return;
+    }
+    syncHeaderToFile();
+}
+
+void FormatedFileAccessor::changeFreeCounters(int64_t blocks, int64_t descriptors)
+{
+    ensureValidFS();
+    if(_header.countersSynced != 0) {
+        // header is marked before first change, so crash does not leave wrong counters
+        _header.countersSynced = 0;
+        syncHeaderToFile();
+    }
+    Transaction *transaction = activeTransaction();
+    if(transaction != nullptr) {
+        transaction->countersChanged(_header);
+    }
+    _header.freeBlocks += blocks;
+    _header.freeDescriptors += descriptors;
+}
+
+void FormatedFileAccessor::setFreeCounters(uint64_t blocks, uint64_t descriptors)
+{
+    ensureValidFS();
+    _header.freeBlocks = blocks;
+    _header.freeDescriptors = descriptors;
+}
+
+bool FormatedFileAccessor::reserveBlocks(uint64_t count)
+{
+    std::unique_lock<std::mutex> lock(_transactionMutex, std::defer_lock);
+    if(!ownsTransaction()) {
+        lock.lock();
+    }
+    ensureValidFS();
+    if(_header.freeBlocks < _reservedBlocks + count) {
+        return false;
+    }
+    _reservedBlocks += count;
+    return true;
+}
+
+void FormatedFileAccessor::releaseBlocks(uint64_t count)
+{
+    std::unique_lock<std::mutex> lock(_transactionMutex, std::defer_lock);
+    if(!ownsTransaction()) {
+        lock.lock();
+    }
+    _reservedBlocks -= std::min(count, _reservedBlocks);
+}
+
+uint64_t FormatedFileAccessor::availableBlocks() const
+{
+    std::unique_lock<std::mutex> lock(_transactionMutex, std::defer_lock);
+    if(!ownsTransaction()) {
+        lock.lock();
+    }
+    return _header.freeBlocks > _reservedBlocks ? _header.freeBlocks - _reservedBlocks : 0;
+}
+
+uint64_t FormatedFileAccessor::transactionRoom() const
+{
+    if(!_journal.isOpen()) {
+        return std::numeric_limits<uint64_t>::max();
+    }
+    uint64_t capacity = _journal.recordCapacity();
+    Transaction *transaction = activeTransaction();
+    uint64_t used = (transaction != nullptr) ? transaction->_blocks.size() : 0;
+    return capacity > used ? capacity - used : 0;
+}
+
+void FormatedFileAccessor::setRollbackHandler(std::function<void()> handler)
+{
+    _rollbackHandler = handler;
+}
+
+FSHeader FormatedFileAccessor::headerSnapshot() const
+{
+    if(ownsTransaction()) {
+        return headerExcept();
+    }
+    std::lock_guard<std::mutex> lock(_transactionMutex);
+    return headerExcept();
+}
+
+bool FormatedFileAccessor::beginTransaction(Transaction *transaction)
+{
+    if(ownsTransaction()) {
+        return false;
+    }
+    _transactionMutex.lock();
+    _transactionOwner = std::this_thread::get_id();
+    _transaction = transaction;
+    return true;
+}
+
+void FormatedFileAccessor::finishTransaction()
+{
+    _transaction = nullptr;
+    _transactionOwner = std::thread::id();
+    _transactionMutex.unlock();
+}
+
+bool FormatedFileAccessor::ownsTransaction() const
+{
+    return _transactionOwner == std::this_thread::get_id();
+}
+
+Transaction *FormatedFileAccessor::activeTransaction() const
+{
+    return ownsTransaction() ? _transaction : nullptr;
+}
+
+void FormatedFileAccessor::commitTransaction(Transaction &transaction)
+{
+    if(_journal.isOpen() && transaction._blocks.size() > _journal.recordCapacity()) {
+        // transaction is committed in one record or not at all, replay never applies part of it
+        uint64_t blocks = transaction._blocks.size();
+        rollbackTransaction(transaction);
+        throw file_system_exception("Operation changes " + std::to_string(blocks) + " metadata blocks, journal record holds "
+                                    + std::to_string(_journal.recordCapacity()) + ". Changes are rolled back.");
+    }
+    // blocks are applied by owner thread, other threads see them after lock is released
+    _transaction = nullptr;
+    try {
+        applyTransaction(transaction);
+    } catch(...) {
+        finishTransaction();
+        throw;
+    }
+    finishTransaction();
+}
+
+void FormatedFileAccessor::applyTransaction(const Transaction &transaction)
+{
+    if(_journal.isOpen()) {
+        _journal.beginTransaction(transaction._blocks.size());
+        for(const auto &block : transaction._blocks) {
+            applyMetadata(block.first, block.second.data());
+        }
+        _journal.endTransaction();
+    } else {
+        // sorted blocks, contiguous run is written at once
+        std::vector<char> run;
+        auto it = transaction._blocks.begin();
+        while(it != transaction._blocks.end()) {
+            blockAddress_tp first = it->first;
+            run.clear();
+            for(blockAddress_tp expected = first; it != transaction._blocks.end() && it->first == expected; ++it, ++expected) {
+                run.insert(run.end(), it->second.begin(), it->second.end());
+                metadataWritten(it->first, it->second.data());
+            }
+            initializeBlocks(first, run.size() / getBlockSize());
+            BlockFileAccessor::_write(first, run.data(), run.size());
+        }
+    }
+    if(transaction._headerChanged) {
+        // header written home must not describe blocks which are not committed yet
+        if(_journal.isOpen()) {
+            _journal.commit();
+        }
+        syncHeaderToFile();
+    }
+}
+
+void FormatedFileAccessor::rollbackTransaction(Transaction &transaction)
+{
+    _transaction = nullptr;
+    if(transaction._headerSaved) {
+        restoreHeader(transaction._previousHeader);
+    }
+    // handler resets cached state before other threads could use it
+    if(_rollbackHandler) {
+        _rollbackHandler();
+    }
+    finishTransaction();
+}
+
+void FormatedFileAccessor::applyMetadata(blockAddress_tp block, const char *data)
+{
+    initializeBlocks(block, 1);
+    if(_journal.isOpen()) {
+        _journal.log(block, data);
+    } else {
+        BlockFileAccessor::_write(block, data, getBlockSize());
+    }
+    metadataWritten(block, data);
+}
+
+void FormatedFileAccessor::resetChecksum(blockAddress_tp block)
+{
+    if(!hasChecksum(block)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_checksumsMutex);
+    checksumBlock &entry = cachedChecksums(block);
+    uint64_t i = block % _checksumsInBlock;
+    if(entry.checksums[i] != 0) {
+        setChecksum(block, 0);
+        entry.verified[i] = false;
+    }
+}
+
+void FormatedFileAccessor::syncChecksums()
+{
+    std::lock_guard<std::mutex> lock(_checksumsMutex);
+    writeChecksums();
+}
+
+void FormatedFileAccessor::writeChecksums()
+{
+    for(checksumBlock &entry : _checksumBlocks) {
+        if(entry.dirty) {
+            writeChecksumBlock(entry);
+        }
+    }
+}
+
+void FormatedFileAccessor::writeChecksumBlock(checksumBlock &entry)
+{
+    initializeBlocks(_header.checksumsBegin + entry.index, 1);
+    BlockFileAccessor::_write(_header.checksumsBegin + entry.index, reinterpret_cast<const char *>(entry.checksums.data()), getBlockSize());
+    entry.dirty = false;
+}
+
+bool FormatedFileAccessor::isValidMetadata(blockAddress_tp block, const char *data) const
+{
+    if(!hasChecksum(block)) {
+        return true;
+    }
+    uint64_t index;
+    uint64_t i;
+    uint32_t expected;
+    {
+        std::lock_guard<std::mutex> lock(_checksumsMutex);
+        checksumBlock &entry = cachedChecksums(block);
+        index = entry.index;
+        i = block % _checksumsInBlock;
+        if(entry.checksums[i] == 0 || entry.verified[i]) {
+            return true;
+        }
+        expected = entry.checksums[i];
+    }
+    // checksum is computed without lock
+    if(expected != metadataChecksum(data, getBlockSize())) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(_checksumsMutex);
+    auto it = _checksumBlocksIndex.find(index);
+    if(it != _checksumBlocksIndex.end()) {
+        it->second->verified[i] = true;
+    }
+    return true;
+}
+
+void FormatedFileAccessor::metadataWritten(blockAddress_tp block, const char *data)
+{
+    if(!hasChecksum(block)) {
+        return;
+    }
+    uint32_t checksum = metadataChecksum(data, getBlockSize());
+    std::lock_guard<std::mutex> lock(_checksumsMutex);
+    checksumBlock &entry = cachedChecksums(block);
+    uint64_t i = block % _checksumsInBlock;
+    if(entry.checksums[i] != checksum) {
+        setChecksum(block, checksum);
+    }
+    entry.verified[i] = true;
+}
+
+bool FormatedFileAccessor::hasJournal() const
+{
+    return isFormatedFS() && _header.journalBegin != Constants::HEADER_ADDRESS();
+}
+
+bool FormatedFileAccessor::hasChecksums() const
+{
+    return isFormatedFS() && _header.checksumsBegin != Constants::HEADER_ADDRESS();
+}
+
+bool FormatedFileAccessor::hasChecksum(blockAddress_tp block) const
+{
+    return block < _header.checksumsBegin;
+}
+
+void FormatedFileAccessor::openChecksums()
+{
+    _checksumBlocks.clear();
+    _checksumBlocksIndex.clear();
+    if(!hasChecksums()) {
+        return;
+    }
+    _checksumsInBlock = getBlockSize() / sizeof(uint32_t);
+    if(_header.checksumsSynced != 0) {
+        return;
+    }
+    // last changes could be lost, blocks are checked again after next write
+    std::clog << "File system was not unmounted, metadata checksums are reset.\n";
+    _header.checksumsLazyBegin = _header.checksumsBegin;
+    _header.checksumsSynced = 1;
+    syncHeaderToFile();
+}
+
+FormatedFileAccessor::checksumBlock &FormatedFileAccessor::cachedChecksums(blockAddress_tp block) const
+{
+    uint64_t index = block / _checksumsInBlock;
+    if(!_checksumBlocks.empty() && _checksumBlocks.front().index == index) {
+        return _checksumBlocks.front();
+    }
+    auto it = _checksumBlocksIndex.find(index);
+    if(it != _checksumBlocksIndex.end()) {
+        _checksumBlocks.splice(_checksumBlocks.begin(), _checksumBlocks, it->second);
+        return _checksumBlocks.front();
+    }
+
+    if(_checksumBlocks.size() >= maxCachedChecksumBlocks) {
+        checksumBlock &last = _checksumBlocks.back();
+        if(last.dirty) {
+            // changed checksums are written by reader too, file is shared by accessor methods
+            const_cast<FormatedFileAccessor *>(this)->writeChecksumBlock(last);
+        }
+        _checksumBlocksIndex.erase(last.index);
+        _checksumBlocks.pop_back();
+    }
+    _checksumBlocks.push_front(checksumBlock{index, std::vector<uint32_t>(_checksumsInBlock), std::vector<bool>(_checksumsInBlock, false), false});
+    checksumBlock &entry = _checksumBlocks.front();
+    try {
+        readInitialized(_header.checksumsBegin + index, reinterpret_cast<char *>(entry.checksums.data()), getBlockSize());
+    } catch(...) {
+        _checksumBlocks.pop_front();
+        throw;
+    }
+    _checksumBlocksIndex.emplace(index, _checksumBlocks.begin());
+    return entry;
+}
+
+void FormatedFileAccessor::setChecksum(blockAddress_tp block, uint32_t checksum)
+{
+    if(_header.checksumsSynced != 0) {
+        // header is marked before first change, so crash does not leave not valid checksums
+        _header.checksumsSynced = 0;
+        syncHeaderToFile();
+    }
+    checksumBlock &entry = cachedChecksums(block);
+    entry.checksums[block % _checksumsInBlock] = checksum;
+    entry.dirty = true;
+}
+
+uint32_t FormatedFileAccessor::metadataChecksum(const char *data, uint64_t size)
+{
+    // 0 means not checked block
+    uint32_t checksum = crc32c(data, size);
+    return checksum == 0 ? 1 : checksum;
 }
 
 void FormatedFileAccessor::_write(blockAddress_tp block, const char *buffer, uint64_t size)
@@ -260,14 +831,66 @@ void FormatedFileAccessor::_write(blockAddress_tp block, const char *buffer, uin
         throw std::invalid_argument("Bad block address. Attempt read from header block.");
     }
     ensureValidFS();
+    uint64_t count = (size + getBlockSize() - 1) / getBlockSize();
+    Transaction *transaction = activeTransaction();
+    if(transaction != nullptr) {
+        transaction->revoke(block, count);
+    }
+    if(_journal.isOpen()) {
+        _journal.revoke(block, count);
+    }
+    initializeBlocks(block, count);
     BlockFileAccessor::_write(block, buffer, size);
 }
 
 void FormatedFileAccessor::_read(blockAddress_tp offset, char *buffer, uint64_t size) const
+{
+    readLatest(offset, buffer, size);
+}
+
+bool FormatedFileAccessor::_readMetadata(blockAddress_tp block, char *buffer, uint64_t size) const
+{
+    // versions kept in memory are written through accessor, only blocks read from file are checked
+    return !readLatest(block, buffer, size) || isValidMetadata(block, buffer);
+}
+
+bool FormatedFileAccessor::readLatest(blockAddress_tp offset, char *buffer, uint64_t size) const
 {
     if(offset == Constants::HEADER_ADDRESS()) {
         throw std::invalid_argument("Bad block address. Attempt read from header block.");
     }
     ensureValidFS();
-    return BlockFileAccessor::_read(offset, buffer, size);
+    if(size == getBlockSize()) {
+        // home location is not up to date
+        Transaction *transaction = activeTransaction();
+        if(transaction != nullptr && transaction->read(offset, buffer, size)) {
+            return false;
+        }
+        if(_journal.isOpen() && _journal.read(offset, buffer)) {
+            return false;
+        }
+    }
+    readInitialized(offset, buffer, size);
+    return true;
+}
+
+void FormatedFileAccessor::_writeMetadata(blockAddress_tp block, const char *buffer, uint64_t size)
+{
+    if(block == Constants::HEADER_ADDRESS()) {
+        throw std::invalid_argument("Bad block address. Attempt write to header block.");
+    }
+    ensureValidFS();
+    Transaction *transaction = activeTransaction();
+    if(transaction != nullptr) {
+        transaction->write(block, buffer, size);
+        return;
+    }
+    if(!ownsTransaction()) {
+        // single block is applied as transaction, it is not mixed with transaction of other thread
+        Transaction single(this);
+        _writeMetadata(block, buffer, size);
+        single.commit();
+        return;
+    }
+    applyMetadata(block, buffer);
 }
@@ -5,28 +5,45 @@
 #include "filesystemblock.h"
 #include "constants.h"
 #include "blockbuffer.h"
+#include "journal.h"
+#include "transaction.h"
 
 #include <vector>
 #include <string>
 #include <fstream>
+#include <mutex>
+#include <functional>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <list>
+#include <unordered_map>
 
 // TODO: refactor buffer
 
 class BlockFileAccessor
 {
+    friend class MetadataJournal;   // journal records and checkpoints are written directly
+
 public:
     BlockFileAccessor() = default;
     virtual ~BlockFileAccessor();
 
     bool create(std::string path, std::ofstream::pos_type size);
     void open(std::string path, uint64_t _blockSize = 0);
-    void close();
+    virtual void close();
 
     void clearBlock(blockAddress_tp block);
     void clearBlocks(blockAddress_tp begin, blockAddress_tp end);   // inclusive begin and end
 
     void write(blockAddress_tp offset, const FileSystemBlock *block, uint64_t size = 0);
     void write(blockAddress_tp offset, std::vector<const FileSystemBlock*> data, uint64_t _blockSize);    // TODO:
+    // write block of file system structure, its checksum is updated when it is applied
+    void writeMetadata(blockAddress_tp offset, const FileSystemBlock *block);
+
+    // direct transfer of count sequential blocks, buffer pool is not used
+    void readBlocks(blockAddress_tp first, char *buffer, uint64_t count) const;
+    void writeBlocks(blockAddress_tp first, const char *buffer, uint64_t count);
 
     template<typename T>
     TypedBufferLocker<T> read(blockAddress_tp offset, SyncType type, uint64_t size = 0) const
@@ -40,7 +57,14 @@ public:
         }
         TypedBufferLocker<T> res = _bufferPool.getLock<T>(offset, const_cast<BlockFileAccessor *>(this), type);
         if(type == SyncType::ReadOnly || type == SyncType::ReadWrite) {
-            _read(offset, reinterpret_cast<char *>(res.data()), size);
+            char *data = reinterpret_cast<char *>(res.data());
+            if(!isMetadataBlock<T>::value) {
+                _read(offset, data, size);
+            } else if(!_readMetadata(offset, data, size)) {
+                // corrupted block must not be written back with new checksum
+                res.setSyncType(SyncType::None);
+                throw checksum_exception("Checksum mismatch in metadata block " + std::to_string(offset) + ".");
+            }
         }
         return res;
     }
@@ -60,6 +84,13 @@ protected:
     virtual void _write(blockAddress_tp block, const char *buffer, uint64_t size);
 
     virtual void _read(blockAddress_tp offset, char *buffer, uint64_t size = 0) const;
+    virtual void _writeMetadata(blockAddress_tp block, const char *buffer, uint64_t size);
+    // false if checksum of metadata block does not match
+    virtual bool _readMetadata(blockAddress_tp block, char *buffer, uint64_t size) const;
+
+    // metadata checksums, BlockFileAccessor does not keep them
+    virtual bool isValidMetadata(blockAddress_tp, const char *) const { return true; }
+    virtual void metadataWritten(blockAddress_tp, const char *) { }
 
     void checkOpen(std::string errMessage = "") const;
     void checkValidBlockSize() const;
@@ -70,34 +101,157 @@ protected:
     mutable BlockBufferPool _bufferPool;
 
 private:
+    mutable std::mutex _fileMutex;      // journal checkpoints are written from other thread
     mutable std::fstream _file;
     uint64_t _blockSize = 0;
     blockAddress_tp _lastBlockAddress = 0;
     std::ofstream::pos_type _fileSize = 0;
 };
 
+/**
+ * @brief The FormatedFileAccessor class
+ * Accessor is shared by threads. Outermost transaction holds transaction lock until it is finished:
+ * metadata changes of threads are serialized, blocks of active transaction are seen by its thread only.
+ * Open, format and close must not run concurrently with other calls.
+ */
 class FormatedFileAccessor : public BlockFileAccessor
 {
+    friend class Transaction;
+
 public:
+    ~FormatedFileAccessor() override;
+
     const FSHeader *header() const;
     const FSHeader &headerExcept() const;
+    // header copy without changes of active transaction of other thread
+    FSHeader headerSnapshot() const;
 
     void open(std::string path, uint64_t _blockSize = 0);
+    // changed checksums are written before close
+    void close() override;
 
     bool isFormatedFS() const;
 //    void formatFS(uint64_t blockSize, uint64_t .../*other parameters*/);
     void formatFS(const FSHeader &header);
+    // write changed header of formated file system
+    void updateHeader(const FSHeader &header);
+    // free counters of header are written lazily: with next header change or at close
+    void changeFreeCounters(int64_t blocks, int64_t descriptors);
+    // counters are recounted by file system
+    void setFreeCounters(uint64_t blocks, uint64_t descriptors);
+
+    /**
+     * @brief reserve free blocks for delayed allocation, other allocations can not use them
+     * @return false if there are not enough free blocks which are not reserved
+     */
+    bool reserveBlocks(uint64_t count);
+    void releaseBlocks(uint64_t count);
+    // free blocks which are not reserved
+    uint64_t availableBlocks() const;
+
+    /**
+     * @brief metadata blocks which active transaction of calling thread can still change
+     * Journal record holds whole transaction, larger transaction is rolled back at commit.
+     * Maximum of uint64_t if file system has no journal.
+     */
+    uint64_t transactionRoom() const;
+
+    // called after transaction rollback, cached state of file system could describe discarded changes
+    void setRollbackHandler(std::function<void()> handler);
+
+    /**
+     * @brief block is not checked until it is written as metadata, must be called for allocated data blocks
+     */
+    void resetChecksum(blockAddress_tp block);
+    // write changed checksum blocks
+    void syncChecksums();
 
 private:
     virtual void _write(blockAddress_tp block, const char *buffer, uint64_t size) final;
     virtual void _read(blockAddress_tp offset, char *buffer, uint64_t size) const final;
+    void _writeMetadata(blockAddress_tp block, const char *buffer, uint64_t size) override;
+    bool _readMetadata(blockAddress_tp block, char *buffer, uint64_t size) const override;
+    // false if version from active transaction or journal is copied, home location is not up to date
+    bool readLatest(blockAddress_tp block, char *buffer, uint64_t size) const;
+
+    bool hasJournal() const;
+
+    // false if transaction joins active one of this thread, otherwise waits for transaction lock
+    bool beginTransaction(Transaction *transaction);
+    void commitTransaction(Transaction &transaction);
+    void rollbackTransaction(Transaction &transaction);
+    void applyTransaction(const Transaction &transaction);
+    // releases transaction lock
+    void finishTransaction();
+    bool ownsTransaction() const;
+    // outermost transaction of calling thread or nullptr
+    Transaction *activeTransaction() const;
+    // write to journal or home location, checksum is updated
+    void applyMetadata(blockAddress_tp block, const char *data);
+
+    bool isValidMetadata(blockAddress_tp block, const char *data) const override;
+    void metadataWritten(blockAddress_tp block, const char *data) override;
+
+    bool hasChecksums() const;
+    // called for blocks of valid file system, checksumsBegin is HEADER_ADDRESS() if it has no checksums
+    bool hasChecksum(blockAddress_tp block) const;
+    // checksum blocks are read on demand, they are reset if file system was not unmounted
+    void openChecksums();
+    struct checksumBlock;
+    // must be called with _checksumsMutex locked, least recently used block is written if it is changed
+    checksumBlock &cachedChecksums(blockAddress_tp block) const;
+    // must be called with _checksumsMutex locked
+    void setChecksum(blockAddress_tp block, uint32_t checksum);
+    void writeChecksums();
+    void writeChecksumBlock(checksumBlock &entry);
+    static uint32_t metadataChecksum(const char *data, uint64_t size);
 
     void ensureValidFS() const;
 
+    // header of active transaction is written at its commit, previous one is written before
     void syncHeaderToFile();
+    // restore header saved by transaction, flags kept by accessor are not changed
+    void restoreHeader(const FSHeader &header);
+    // copy flags and lazy format marks of current header
+    void keepAccessorFields(FSHeader &header) const;
+
+    struct lazyArea {
+        blockAddress_tp FSHeader::*lazyBegin;
+        blockAddress_tp end;
+    };
+    std::array<lazyArea, 3> lazyAreas() const;
+    // not initialized blocks of lazy areas are read as zeros
+    void readInitialized(blockAddress_tp first, char *buffer, uint64_t size) const;
+    // must be called before blocks are written, lazy areas are cleared up to them
+    void initializeBlocks(blockAddress_tp first, uint64_t count);
+    static constexpr uint64_t lazyInitBlocks = 64;     // cleared at once
     void syncHeaderFromFile();
 
     FSHeader _header;
+    MetadataJournal _journal{this};
+    Transaction *_transaction = nullptr;    // outermost active transaction, used by owner thread only
+    mutable std::mutex _transactionMutex;
+    std::atomic<std::thread::id> _transactionOwner;
+    std::function<void()> _rollbackHandler;
+    uint64_t _reservedBlocks = 0;           // changed with transaction lock
+
+    // lazy format marks of header, they are changed with transaction lock
+    mutable std::mutex _lazyMutex;
+
+    // checksums are read by threads without transaction lock
+    mutable std::mutex _checksumsMutex;
+    struct checksumBlock {
+        uint64_t index;                     // block of checksums area
+        std::vector<uint32_t> checksums;    // for blocks [index * checksumsInBlock : (index + 1) * checksumsInBlock)
+        // block was checked or written while checksums are cached, all changes of file go through accessor
+        std::vector<bool> verified;
+        bool dirty;
+    };
+    using checksumBlocks_tp = std::list<checksumBlock>;
+    mutable checksumBlocks_tp _checksumBlocks;     // most recently used in front
+    mutable std::unordered_map<uint64_t, checksumBlocks_tp::iterator> _checksumBlocksIndex;
+    uint64_t _checksumsInBlock = 0;
+    static constexpr uint64_t maxCachedChecksumBlocks = 64;
 };
 
 #endif // FILEACCESSOR_H
@@ -0,0 +1,316 @@
+#ifndef FILEBLOCKMAP_H
+#define FILEBLOCKMAP_H
+
+#include "filesystemblock.h"
+#include "blockbuffer.h"
+#include "constants.h"
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+/**
+ * @brief The FileBlockMap class
+ * Maps file block index to data block address. First blocks are stored in descriptor dataSegments,
+ * next ones in the chain of FSDescriptorDataPart segments started at descriptor nextDataSegment.
+ * Constants::HEADER_ADDRESS() means not allocated block.
+ *
+ * Current segment is kept between calls, so sequential access reads every segment once.
+ * Position can be saved with getCursor() and restored with setCursor() by next map of the same file.
+ *
+ * Blocks can be shared between cloned files. Reference to a block is owned by the descriptor or segment
+ * which points to it, so a shared segment shares everything reachable from it. Shared segment is copied
+ * before change, the copy takes references to all blocks it points to.
+ *
+ * BlockSource must provide:
+ *   template<typename T> TypedBufferLocker<T> readBlock(blockAddress_tp block, SyncType type) const;
+ *   blockAddress_tp allocBlock() const;
+ *   bool hasSharedBlocks() const;
+ *   bool isBlockShared(blockAddress_tp block) const;
+ *   void shareBlock(blockAddress_tp block) const;
+ *   bool unshareBlock(blockAddress_tp block) const;     // false if block was not shared
+ *
+ * Changes of descriptor are not saved, caller must update it.
+ */
+template<typename BlockSource>
+class FileBlockMap
+{
+    using segmentLocker_tp = TypedBufferLocker<FSDescriptorDataPart>;
+
+public:
+    /**
+     * @brief position in segments chain, segment 0 is descriptor
+     */
+    struct cursor {
+        uint64_t segmentNumber = 0;
+        blockAddress_tp segmentAddress = Constants::HEADER_ADDRESS();
+    };
+
+    FileBlockMap(BlockSource source, FSDescriptor *descriptor) :
+        _source(source),
+        _descriptor(descriptor)
+    {
+        assert(descriptor->type == DescriptorVariant::File);
+    }
+
+    static constexpr uint64_t blocksInDescriptor = ARRAY_LENGTH(FSDescriptor::dataSegments);
+    static constexpr uint64_t blocksInSegment = ARRAY_LENGTH(FSDescriptorDataPart::dataBlocks);
+
+    /**
+     * @return data block address or Constants::HEADER_ADDRESS() if block is not allocated
+     */
+    blockAddress_tp get(uint64_t fileBlock)
+    {
+        if(fileBlock < blocksInDescriptor) {
+            return _descriptor->dataSegments[fileBlock];
+        }
+        if(!moveToSegment(segmentOf(fileBlock), false)) {
+            return Constants::HEADER_ADDRESS();
+        }
+        return _segment->dataBlocks[indexInSegment(fileBlock)];
+    }
+
+    /**
+     * @brief get block address before change. Segments on the way to block are not shared after call,
+     * so block sharing is decided by its own references only
+     */
+    blockAddress_tp getForWrite(uint64_t fileBlock)
+    {
+        if(fileBlock < blocksInDescriptor) {
+            return _descriptor->dataSegments[fileBlock];
+        }
+        moveToSegment(segmentOf(fileBlock), true);
+        return _segment->dataBlocks[indexInSegment(fileBlock)];
+    }
+
+    /**
+     * @brief find first block in [fromBlock:endBlock) which is mapped (or is a hole if mapped is false)
+     * @return endBlock if there is no such block
+     */
+    uint64_t findBlock(uint64_t fromBlock, uint64_t endBlock, bool mapped)
+    {
+        for(uint64_t block = fromBlock; block < endBlock; block++) {
+            if(block >= blocksInDescriptor && !moveToSegment(segmentOf(block), false)) {
+                // end of segments chain, rest of file is a hole
+                return mapped ? endBlock : block;
+            }
+            if((get(block) != Constants::HEADER_ADDRESS()) == mapped) {
+                return block;
+            }
+        }
+        return endBlock;
+    }
+
+    /**
+     * @brief set data block address, allocates missing segments
+     */
+    void set(uint64_t fileBlock, blockAddress_tp address)
+    {
+        if(fileBlock < blocksInDescriptor) {
+            _descriptor->dataSegments[fileBlock] = address;
+            return;
+        }
+        moveToSegment(segmentOf(fileBlock), true);
+        _segment->dataBlocks[indexInSegment(fileBlock)] = address;
+        markSegmentChanged();
+    }
+
+    /**
+     * @brief unmap blocks >= blocksCount, segments without mapped range are unlinked
+     * @param released receives addresses of unmapped data blocks and segments.
+     * Shared segment is not included, its reference is released instead.
+     */
+    void truncate(uint64_t blocksCount, std::vector<blockAddress_tp> *released)
+    {
+        restart();
+        for(uint64_t i = blocksCount; i < blocksInDescriptor; i++) {
+            if(_descriptor->dataSegments[i] != Constants::HEADER_ADDRESS()) {
+                released->push_back(_descriptor->dataSegments[i]);
+                _descriptor->dataSegments[i] = Constants::HEADER_ADDRESS();
+            }
+        }
+
+        blockAddress_tp rest = Constants::HEADER_ADDRESS();
+        if(blocksCount <= blocksInDescriptor) {
+            rest = _descriptor->nextDataSegment;
+            _descriptor->nextDataSegment = Constants::HEADER_ADDRESS();
+        } else {
+            uint64_t lastSegment = segmentOf(blocksCount - 1);
+            if(!moveToSegment(lastSegment, false)) {
+                return;     // chain is shorter
+            }
+            moveToSegment(lastSegment, true);
+            for(uint64_t i = indexInSegment(blocksCount - 1) + 1; i < blocksInSegment; i++) {
+                if(_segment->dataBlocks[i] != Constants::HEADER_ADDRESS()) {
+                    released->push_back(_segment->dataBlocks[i]);
+                    _segment->dataBlocks[i] = Constants::HEADER_ADDRESS();
+                    markSegmentChanged();
+                }
+            }
+            rest = _segment->nextSegment;
+            if(rest != Constants::HEADER_ADDRESS()) {
+                _segment->nextSegment = Constants::HEADER_ADDRESS();
+                markSegmentChanged();
+            }
+        }
+        restart();
+
+        while(rest != Constants::HEADER_ADDRESS()) {
+            if(_source.unshareBlock(rest)) {
+                break;  // rest of chain is still used by other file
+            }
+            segmentLocker_tp segment = _source.template readBlock<FSDescriptorDataPart>(rest, SyncType::ReadOnly);
+            for(uint64_t i = 0; i < blocksInSegment; i++) {
+                if(segment->dataBlocks[i] != Constants::HEADER_ADDRESS()) {
+                    released->push_back(segment->dataBlocks[i]);
+                }
+            }
+            released->push_back(rest);
+            rest = segment->nextSegment;
+        }
+    }
+
+    /**
+     * @brief write changed segment to file, position is kept
+     */
+    void flush()
+    {
+        _segment = segmentLocker_tp();
+    }
+
+    /**
+     * @brief true if shared segments were copied, saved cursors of the file are not valid
+     */
+    bool segmentsCopied() const
+    {
+        return _segmentsCopied;
+    }
+
+    cursor getCursor() const
+    {
+        return _cursor;
+    }
+
+    /**
+     * @brief continue from saved position, segment must be still in the chain
+     */
+    void setCursor(const cursor &position)
+    {
+        flush();
+        _cursor = position;
+        // file could be cloned after cursor was saved
+        _pathPrivate = (position.segmentNumber == 0 || !_source.hasSharedBlocks());
+    }
+
+private:
+    static uint64_t segmentOf(uint64_t fileBlock)
+    {
+        return (fileBlock - blocksInDescriptor) / blocksInSegment + 1;
+    }
+
+    static uint64_t indexInSegment(uint64_t fileBlock)
+    {
+        return (fileBlock - blocksInDescriptor) % blocksInSegment;
+    }
+
+    void markSegmentChanged()
+    {
+        if(_segment.syncType() == SyncType::ReadOnly) {
+            _segment.setSyncType(SyncType::ReadWrite);
+        }
+    }
+
+    void restart()
+    {
+        flush();
+        _cursor = cursor();
+        _pathPrivate = true;
+    }
+
+    // replace loaded shared segment with its copy, returns copy address
+    blockAddress_tp copySegment(blockAddress_tp shared)
+    {
+        blockAddress_tp copyAddress = _source.allocBlock();
+        segmentLocker_tp copy = _source.template readBlock<FSDescriptorDataPart>(copyAddress, SyncType::WriteOnly);
+        memcpy(copy.data(), _segment.data(), copy.length());
+        for(uint64_t i = 0; i < blocksInSegment; i++) {
+            if(copy->dataBlocks[i] != Constants::HEADER_ADDRESS()) {
+                _source.shareBlock(copy->dataBlocks[i]);
+            }
+        }
+        if(copy->nextSegment != Constants::HEADER_ADDRESS()) {
+            _source.shareBlock(copy->nextSegment);
+        }
+        _source.unshareBlock(shared);
+        _segment = std::move(copy);
+        _segmentsCopied = true;
+        return copyAddress;
+    }
+
+    // segment 0 is descriptor
+    bool moveToSegment(uint64_t segment, bool forWrite)
+    {
+        assert(segment != 0);
+        if(_cursor.segmentNumber > segment || (forWrite && !_pathPrivate)) {
+            restart();
+        }
+        if(_cursor.segmentNumber != 0 && !_segment.isValid()) {
+            _segment = _source.template readBlock<FSDescriptorDataPart>(_cursor.segmentAddress, SyncType::ReadOnly);
+        }
+
+        while(_cursor.segmentNumber < segment) {
+            blockAddress_tp next = (_cursor.segmentNumber == 0) ? _descriptor->nextDataSegment : _segment->nextSegment;
+            if(next == Constants::HEADER_ADDRESS()) {
+                if(!forWrite) {
+                    return false;
+                }
+                next = _source.allocBlock();
+                segmentLocker_tp newSegment = _source.template readBlock<FSDescriptorDataPart>(next, SyncType::WriteOnly);
+                memset(newSegment.data(), 0, newSegment.length());
+                newSegment->init();
+                linkSegment(next);
+                _segment = std::move(newSegment);
+            } else if(_pathPrivate && _source.isBlockShared(next)) {
+                segmentLocker_tp previous = std::move(_segment);
+                _segment = _source.template readBlock<FSDescriptorDataPart>(next, SyncType::ReadOnly);
+                if(forWrite) {
+                    next = copySegment(next);
+                    if(_cursor.segmentNumber == 0) {
+                        _descriptor->nextDataSegment = next;
+                    } else {
+                        previous->nextSegment = next;
+                        previous.setSyncType(SyncType::ReadWrite);
+                    }
+                } else {
+                    _pathPrivate = false;
+                }
+            } else {
+                _segment = _source.template readBlock<FSDescriptorDataPart>(next, SyncType::ReadOnly);
+            }
+            _cursor.segmentAddress = next;
+            _cursor.segmentNumber++;
+        }
+        return true;
+    }
+
+    // set link to next segment in current position (descriptor or loaded segment)
+    void linkSegment(blockAddress_tp next)
+    {
+        if(_cursor.segmentNumber == 0) {
+            _descriptor->nextDataSegment = next;
+        } else {
+            _segment->nextSegment = next;
+            markSegmentChanged();
+        }
+    }
+
+    BlockSource _source;
+    FSDescriptor *_descriptor;
+
+    cursor _cursor;
+    segmentLocker_tp _segment;     // loaded lazily for _cursor
+    bool _pathPrivate = true;      // segments from descriptor to _cursor are not shared
+    bool _segmentsCopied = false;
+};
+
+#endif // FILEBLOCKMAP_H
@@ -5,10 +5,19 @@
 using namespace fs_excetion;
 #include "fsdescriptoriterator.h"
 #include "path.h"
+#include "directorytree.h"
+#include "fileblockmap.h"
+#include "blockreferencetable.h"
+#include "lzcodec.h"
 
 #include <iostream>
 #include <cassert>
 #include <limits>
+#include <cstring>
+#include <algorithm>
+
+constexpr uint64_t FileSystem::maxWriteTransaction;
+constexpr uint64_t FileSystem::transactionStepBlocks;
 
 FileSystem::FileSystem(std::shared_ptr<FormatedFileAccessor> fsFile) :
     _fsFile(fsFile),
@@ -16,25 +25,18 @@ FileSystem::FileSystem(std::shared_ptr<FormatedFileAccessor> fsFile) :
     _descriptors(fsFile),
     _dataBlocks(fsFile)
 {
-    descriptorAlgorithmCallbacks callbacks;
-    callbacks.readExtendedSegment = [this](blockAddress_tp block) -> TypedBufferLocker<FSDescriptorDataPart> {
-        return _dataBlocks.readData<FSDescriptorDataPart>(block, SyncType::ReadWrite);
-    };
-    callbacks.allocNewFreeBlock = [this]() -> blockAddress_tp {
-        return findAndAllocateFreeDataBlock();
-    };
-    callbacks.deallocBlock = [this](blockAddress_tp block) {
-        _bitMap.set(block, false);
-    };
-    callbacks.updateDescriptor = [this](descriptorIndex_tp descriptorIndex, const FSDescriptor& descriptor) {
-        _descriptors.updateDescriptor(descriptorIndex, descriptor);
-    };
-    _descriptorAlgo.setCallbacks(callbacks);
+    _descriptorAlgo.setSource(FileSystemBlockSource(this));
+    _fsFile->setRollbackHandler([this]() { resetCachedState(); });
 }
 
 FileSystem::~FileSystem()
 {
-
+    _fsFile->setRollbackHandler(nullptr);
+    try {
+        flushFileHandles(Constants::INVALID_DESCRIPTOR_ID());
+    } catch(const std::exception &e) {
+        std::cerr << "Buffered data is not written: " << e.what() << "\n";
+    }
 }
 
 void FileSystem::registerCommands(Console *console)
@@ -43,6 +45,7 @@ void FileSystem::registerCommands(Console *console)
     console->addCommand("umount", new ClassCommandWrapper<FileSystem>(this, &FileSystem::umount));
 
     console->addCommand("filestat", new ClassCommandWrapper<FileSystem>(this, &FileSystem::filestat));
+    console->addCommand("df", new ClassCommandWrapper<FileSystem>(this, &FileSystem::df));
     console->addCommand("ls", new ClassCommandWrapper<FileSystem>(this, &FileSystem::ls));
 
     console->addCommand("create", new ClassCommandWrapper<FileSystem>(this, &FileSystem::create));
@@ -51,10 +54,17 @@ void FileSystem::registerCommands(Console *console)
 
     console->addCommand("read", new ClassCommandWrapper<FileSystem>(this, &FileSystem::read));
     console->addCommand("write", new ClassCommandWrapper<FileSystem>(this, &FileSystem::write));
+    console->addCommand("flush", new ClassCommandWrapper<FileSystem>(this, &FileSystem::flush));
+    console->addCommand("seek", new ClassCommandWrapper<FileSystem>(this, &FileSystem::seek));
+    console->addCommand("seek_data", new ClassCommandWrapper<FileSystem>(this, &FileSystem::seekData));
+    console->addCommand("seek_hole", new ClassCommandWrapper<FileSystem>(this, &FileSystem::seekHole));
 
     console->addCommand("link", new ClassCommandWrapper<FileSystem>(this, &FileSystem::link));
     console->addCommand("unlink", new ClassCommandWrapper<FileSystem>(this, &FileSystem::unlink));
 
+    console->addCommand("clone", new ClassCommandWrapper<FileSystem>(this, &FileSystem::clone));
+    console->addCommand("dedupe", new ClassCommandWrapper<FileSystem>(this, &FileSystem::dedupe));
+    console->addCommand("check", new ClassCommandWrapper<FileSystem>(this, &FileSystem::check));
     console->addCommand("truncate", new ClassCommandWrapper<FileSystem>(this, &FileSystem::truncate));
 
     console->addCommand("mkdir", new ClassCommandWrapper<FileSystem>(this, &FileSystem::mkdir));
@@ -73,6 +83,8 @@ void FileSystem::registerCommands(Console *console)
 void FileSystem::mount(arguments str)
 {
     checkArgumentsCount(str, 1);
+    std::unique_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    flushFileHandles(Constants::INVALID_DESCRIPTOR_ID());
     _fsFile->open(str.at(0));
     if(_fsFile->isFormatedFS()) {
         fileFormatChanged();
@@ -80,154 +92,1307 @@ void FileSystem::mount(arguments str)
     }
 }
 
-void FileSystem::umount()
+void FileSystem::umount()
+{
+    std::unique_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    flushFileHandles(Constants::INVALID_DESCRIPTOR_ID());
+    {
+        std::lock_guard<std::mutex> lock(_handlesMutex);
+        _opennedFiles.clear();
+    }
+    _dirtyFilesCount = 0;
+    resetCachedState();
+    _consoleSession = session();
+    _fsFile->close();
+}
+
+void FileSystem::df(arguments, outputStream out)
+{
+    statistics stat = statFS();
+    out << "Block size: " << stat.blockSize
+        << "\nBlocks: " << stat.totalBlocks << " total, " << stat.totalBlocks - stat.freeBlocks << " used, " << stat.freeBlocks << " free"
+        << "\nDescriptors: " << stat.totalDescriptors << " total, " << stat.totalDescriptors - stat.freeDescriptors << " used, " << stat.freeDescriptors << " free\n";
+}
+
+FileSystem::statistics FileSystem::statFS() const
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    FSHeader snapshot = _fsFile->headerSnapshot();
+    statistics stat;
+    stat.blockSize = snapshot.blockByteSize;
+    stat.totalBlocks = snapshot.dataBlocksCount();
+    stat.freeBlocks = snapshot.freeBlocks;
+    stat.totalDescriptors = snapshot.descriptorsCount();
+    stat.freeDescriptors = snapshot.freeDescriptors;
+    return stat;
+}
+
+ConsistencyChecker::report FileSystem::checkFileSystem(bool repair)
+{
+    std::unique_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    // checker reads blocks directly, delayed writes must be in file system
+    flushFileHandles(Constants::INVALID_DESCRIPTOR_ID());
+    ConsistencyChecker::report report = ConsistencyChecker(_fsFile).check();
+    if(repair && report.problemsCount != 0) {
+        repairFileSystem(report);
+    }
+    return report;
+}
+
+void FileSystem::check(arguments arg, outputStream out)
+{
+    bool repair = !arg.empty() && arg.at(0) == "-r";
+    if(!arg.empty() && !repair) {
+        throw file_system_exception("Usage: check [-r]");
+    }
+
+    ConsistencyChecker::report report = checkFileSystem(repair);
+    out << "Descriptors checked: " << report.descriptorsChecked
+        << "\nProblems: " << report.problemsCount << "\n";
+    for(const std::string &problem : report.problems) {
+        out << "\t" << problem << "\n";
+    }
+    if(report.problemsCount > report.problems.size()) {
+        out << "\t...\n";
+    }
+    if(repair && report.problemsCount != 0) {
+        out << "Repaired.\n";
+    }
+}
+
+void FileSystem::filestat(arguments arg, outputStream out)
+{
+    checkArgumentsCount(arg, 1);
+    descriptorIndex_tp descriptorId = static_cast<descriptorIndex_tp>(std::stoll(arg.at(0)));
+
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    FSDescriptor descriptor;
+    try {
+        descriptor = _descriptors.getDescriptor(descriptorId);
+    } catch(const std::invalid_argument &) {
+        out << "Bad descriptor\n";
+        return;
+    }
+
+    if(descriptor.type == DescriptorVariant::None) {
+        out << "Descriptor does not exist\n";
+        return;
+    }
+
+    using std::to_string;
+
+    out << "File statistic: \n\tid: " << descriptorId;
+    if(descriptor.type == DescriptorVariant::File) {
+        out << "\n\tSize: " << descriptor.fileSize;
+        out << "\n\tCompressed: " << (descriptor.isCompressedFile() ? "true" : "false");
+    }
+    out << "\n\tType: "     << to_string(descriptor.type) <<
+           "\n\tReferences: " << descriptor.referencesCount <<
+           "\n\tHas extended blocks: " << (descriptor.nextDataSegment == Constants::HEADER_ADDRESS() ? "false" : "true") << "\n";
+}
+
+void FileSystem::ls(arguments arg, outputStream out)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    auto curFolder = currentDirectory(_consoleSession);
+    auto maxFilename = header().filenameLength;
+    directoryLocks_tp::sharedGuard lock(_directoryLocks, {curFolder});
+
+    bool longFormat = false;
+    string prefix;
+    for(size_t i = 0; i < arg.size(); i++) {
+        if(arg[i] == "-l") {
+            longFormat = true;
+        } else if(arg[i] == "-p" && i + 1 < arg.size()) {
+            prefix = arg[++i];
+        }
+    }
+
+    if(longFormat) {
+        out << "name\tdescriptor\ttype\treferences\tsize\n";
+        for(const directoryEntryPlus &entry : readDirectoryPlus(curFolder, prefix)) {
+            const FSDescriptor &descriptor = entry.descriptor;
+            out << entry.name << "\t" << entry.index << "\t" << std::to_string(descriptor.type) << "\t" << descriptor.referencesCount << "\t";
+            if(descriptor.type == DescriptorVariant::File) {
+                out << descriptor.fileSize;
+            } else {
+                out << "-";
+            }
+            out << "\n";
+        }
+        return;
+    }
+
+    out << "name\tdescriptor\n";
+    for(const directoryEntry &entry : readDirectory(curFolder, prefix)) {
+        out << entry.toString(maxFilename) << "\n";
+    }
+}
+
+void FileSystem::create(arguments arg)
+{
+    checkArgumentsCount(arg, 1);
+    bool compressed = arg.at(0) == "-c";
+    if(compressed) {
+        checkArgumentsCount(arg, 2);
+    }
+    makeFile(_consoleSession, arg.at(compressed ? 1 : 0), compressed);
+}
+
+void FileSystem::open(arguments arg, outputStream out)
+{
+    checkArgumentsCount(arg, 1);
+    auto openedDescriptor = openFile(arg.at(0));
+    out << "Opened file descriptor: " << openedDescriptor << "\n";
+}
+
+void FileSystem::close(arguments arg, outputStream out)
+{
+    checkArgumentsCount(arg, 1);
+    uint64_t descriptorToClose = std::stoull(arg.at(0));
+    closeFile(descriptorToClose);
+    out << "Descriptor: " << descriptorToClose << " closed.\n";
+}
+
+void FileSystem::read(arguments arg, outputStream out)
+{
+    checkArgumentsCount(arg, 2);
+    openedFileDescriptor_tp fd = std::stoull(arg.at(0));
+    uint64_t size = std::stoull(arg.at(1));
+
+    std::vector<char> buffer(size);
+    uint64_t readCount = readFile(fd, buffer.data(), size);
+    out.write(buffer.data(), readCount);
+    out << "\nRead " << readCount << " bytes.\n";
+}
+
+void FileSystem::write(arguments arg, outputStream out)
+{
+    checkArgumentsCount(arg, 2);
+    openedFileDescriptor_tp fd = std::stoull(arg.at(0));
+    string data = arg.at(1);
+    for(size_t i = 2; i < arg.size(); i++) {
+        data += " " + arg[i];
+    }
+
+    uint64_t writeCount = writeFile(fd, data.data(), data.size());
+    out << "Written " << writeCount << " bytes.\n";
+}
+
+void FileSystem::flush(arguments arg, outputStream out)
+{
+    checkArgumentsCount(arg, 1);
+    openedFileDescriptor_tp fd = std::stoull(arg.at(0));
+    flushFile(fd);
+    out << "Descriptor: " << fd << " flushed.\n";
+}
+
+void FileSystem::seek(arguments arg, outputStream out)
+{
+    checkArgumentsCount(arg, 2);
+    openedFileDescriptor_tp fd = std::stoull(arg.at(0));
+    openedFileOffset_tp offset = std::stoull(arg.at(1));
+    seekFile(fd, offset);
+    out << "Offset: " << offset << "\n";
+}
+
+void FileSystem::seekData(arguments arg, outputStream out)
+{
+    checkArgumentsCount(arg, 2);
+    openedFileOffset_tp offset = seekFileData(std::stoull(arg.at(0)), std::stoull(arg.at(1)));
+    out << "Offset: " << offset << "\n";
+}
+
+void FileSystem::seekHole(arguments arg, outputStream out)
+{
+    checkArgumentsCount(arg, 2);
+    openedFileOffset_tp offset = seekFileHole(std::stoull(arg.at(0)), std::stoull(arg.at(1)));
+    out << "Offset: " << offset << "\n";
+}
+
+FileSystem::openedFileDescriptor_tp FileSystem::openFile(const std::string &path)
+{
+    return openFile(_consoleSession, path);
+}
+
+FileSystem::openedFileDescriptor_tp FileSystem::openFile(const session &client, const std::string &path)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    auto descriptor = getLastPathElementDescriptor(currentDirectory(client), path);
+    auto stream = std::make_shared<openedFileStream>(openedFileStream{descriptor, 0, {}, 0, {}, 0, false, 0, {}, _cachedStateGeneration});
+    std::lock_guard<std::mutex> lock(_handlesMutex);
+    return _opennedFiles.insert(stream);
+}
+
+void FileSystem::closeFile(openedFileDescriptor_tp fd)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    lockedFile file = lockOpenedFile(fd);
+    try {
+        flushOpenedFile(*file.stream);
+    } catch(...) {
+        std::lock_guard<std::mutex> lock(_handlesMutex);
+        _opennedFiles.erase(fd);
+        throw;
+    }
+    std::lock_guard<std::mutex> lock(_handlesMutex);
+    if(!_opennedFiles.erase(fd)) {
+        throw file_system_exception("Descriptor currently not open.");
+    }
+}
+
+uint64_t FileSystem::readFile(openedFileDescriptor_tp fd, char *buffer, uint64_t size)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    lockedFile file = lockOpenedFile(fd);
+    openedFileStream &stream = *file.stream;
+    flushFileHandles(stream.descriptor);
+    FSDescriptor descriptor = openedFileDescriptor(stream);
+    if(stream.offset >= descriptor.fileSize) {
+        return 0;
+    }
+    size = std::min<uint64_t>(size, descriptor.fileSize - stream.offset);
+
+    const uint64_t blockSize = header().blockByteSize;
+    FileBlockMap<FileSystemBlockSource> blockMap(FileSystemBlockSource(this), &descriptor);
+    blockMap.setCursor(stream.cursor);
+
+    if(descriptor.isCompressedFile()) {
+        readCompressedData(stream, blockMap, stream.offset, buffer, size);
+        stream.offset += size;
+        stream.cursor = blockMap.getCursor();
+        return size;
+    }
+
+    uint64_t done = 0;
+    while(done < size) {
+        uint64_t position = stream.offset + done;
+        uint64_t fileBlock = position / blockSize;
+        uint64_t offsetInBlock = position % blockSize;
+        blockAddress_tp address = blockMap.get(fileBlock);
+
+        if(offsetInBlock != 0 || size - done < blockSize) {
+            uint64_t count = std::min(blockSize - offsetInBlock, size - done);
+            if(address == Constants::HEADER_ADDRESS()) {
+                memset(buffer + done, 0, count);
+            } else {
+                TypedBufferLocker<FSDataBlock> block = _dataBlocks.readData(address, SyncType::ReadOnly);
+                memcpy(buffer + done, block->data + offsetInBlock, count);
+            }
+            done += count;
+            continue;
+        }
+
+        // whole blocks, contiguous run is read directly to user buffer
+        uint64_t maxBlocks = (size - done) / blockSize;
+        uint64_t blocks = 1;
+        while(blocks < maxBlocks) {
+            blockAddress_tp next = blockMap.get(fileBlock + blocks);
+            bool hole = (address == Constants::HEADER_ADDRESS());
+            if(hole ? next != Constants::HEADER_ADDRESS() : next != address + blocks) {
+                break;
+            }
+            blocks++;
+        }
+        if(address == Constants::HEADER_ADDRESS()) {
+            memset(buffer + done, 0, blocks * blockSize);
+        } else {
+            _dataBlocks.readDataBlocks(address, buffer + done, blocks);
+        }
+        done += blocks * blockSize;
+    }
+
+    stream.offset += done;
+    stream.cursor = blockMap.getCursor();
+    return done;
+}
+
+uint64_t FileSystem::writeFile(openedFileDescriptor_tp fd, const char *buffer, uint64_t size)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    lockedFile file = lockOpenedFile(fd);
+    openedFileStream &stream = *file.stream;
+    if(!stream.dirtyData.empty() && stream.offset != stream.dirtyOffset + stream.dirtyData.size()) {
+        flushOpenedFile(stream);
+    }
+
+    if(size >= delayedWriteLimit) {
+        // large write goes directly from user buffer, every chunk is allocated at once in its own transaction
+        flushOpenedFile(stream);
+        // segments of chunk use at most half of journal record, bitmap and descriptor blocks fit in the rest
+        const uint64_t segmentBytes = FileBlockMap<FileSystemBlockSource>::blocksInSegment * header().blockByteSize;
+        const uint64_t maxChunk = std::max<uint64_t>(1, std::min(_fsFile->transactionRoom() / 2, maxWriteTransaction / segmentBytes)) * segmentBytes;
+        uint64_t done = 0;
+        while(done < size) {
+            uint64_t chunk = std::min(size - done, maxChunk);
+            uint64_t written;
+            try {
+                written = writeFileData(stream, stream.offset, buffer + done, chunk);
+            } catch(const no_enough_fs_entry &) {
+                if(done == 0) {
+                    throw;
+                }
+                break;
+            }
+            stream.offset += written;
+            done += written;
+            if(written != chunk) {
+                break;
+            }
+        }
+        return done;
+    }
+
+    if(stream.dirtyData.empty()) {
+        stream.dirtyCompressed = openedFileDescriptor(stream).isCompressedFile();
+        stream.dirtyOffset = stream.offset;
+    }
+    // buffered data gets its blocks now, flush must not fail on full file system
+    uint64_t needed = blocksForWrite(stream.dirtyOffset, stream.dirtyData.size() + size, stream.dirtyCompressed);
+    if(needed > stream.reservedBlocks) {
+        if(!_fsFile->reserveBlocks(needed - stream.reservedBlocks)) {
+            // not enough space, direct write reports it by short count
+            flushOpenedFile(stream);
+            uint64_t done = writeFileData(stream, stream.offset, buffer, size);
+            stream.offset += done;
+            return done;
+        }
+        stream.reservedBlocks = needed;
+    }
+    if(stream.dirtyData.empty()) {
+        _dirtyFilesCount++;
+    }
+    stream.dirtyData.insert(stream.dirtyData.end(), buffer, buffer + size);
+    stream.offset += size;
+    if(stream.dirtyData.size() >= delayedWriteLimit) {
+        flushOpenedFile(stream);
+    }
+    return size;
+}
+
+void FileSystem::flushFile(openedFileDescriptor_tp fd)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    flushOpenedFile(*lockOpenedFile(fd).stream);
+}
+
+void FileSystem::flushOpenedFile(openedFileStream &stream)
+{
+    if(stream.dirtyData.empty()) {
+        return;
+    }
+    std::vector<char> data;
+    data.swap(stream.dirtyData);
+    _dirtyFilesCount--;
+
+    // reserved blocks are released under transaction lock, other threads can not take them before allocation
+    Transaction transaction(_fsFile.get());
+    _fsFile->releaseBlocks(stream.reservedBlocks);
+    stream.reservedBlocks = 0;
+    uint64_t done = writeFileData(stream, stream.dirtyOffset, data.data(), data.size());
+    if(done != data.size()) {
+        throw no_enough_fs_entry("Not enough free space. " + std::to_string(data.size() - done) + " buffered bytes are lost.");
+    }
+}
+
+uint64_t FileSystem::blocksForWrite(openedFileOffset_tp offset, uint64_t size, bool compressed) const
+{
+    using blockMap_tp = FileBlockMap<FileSystemBlockSource>;
+    if(size == 0) {
+        return 0;
+    }
+    const uint64_t blockSize = header().blockByteSize;
+    const uint64_t unit = compressed ? FSDescriptor::clusterBlocks : 1;
+    uint64_t firstBlock = offset / blockSize / unit * unit;
+    uint64_t lastBlock = ((offset + size - 1) / blockSize / unit + 1) * unit - 1;
+    auto segmentOf = [](uint64_t fileBlock) -> uint64_t {
+        return fileBlock < blockMap_tp::blocksInDescriptor ? 0 : (fileBlock - blockMap_tp::blocksInDescriptor) / blockMap_tp::blocksInSegment + 1;
+    };
+    // shared segments before range are copied while chain is followed
+    uint64_t segments = hasSharedBlocks() ? segmentOf(lastBlock) : segmentOf(lastBlock) - segmentOf(firstBlock) + 1;
+    return lastBlock - firstBlock + 1 + segments;
+}
+
+bool FileSystem::transactionFull() const
+{
+    return _fsFile->transactionRoom() < transactionStepBlocks;
+}
+
+void FileSystem::flushFileHandles(descriptorIndex_tp descriptor)
+{
+    if(_dirtyFilesCount == 0) {
+        return;
+    }
+    for(const std::shared_ptr<openedFileStream> &opened : openedStreams(descriptor)) {
+        flushOpenedFile(*opened);
+    }
+}
+
+void FileSystem::allocateFileRange(FileBlockMap<FileSystemBlockSource> &blockMap, openedFileOffset_tp offset, uint64_t size)
+{
+    const uint64_t blockSize = header().blockByteSize;
+    uint64_t firstBlock = offset / blockSize;
+    uint64_t lastBlock = (offset + size - 1) / blockSize;
+
+    // holes and shared blocks get new blocks
+    std::vector<uint64_t> holes;
+    std::vector<blockAddress_tp> shared;
+    for(uint64_t block = firstBlock; block <= lastBlock; block++) {
+        blockAddress_tp address = blockMap.getForWrite(block);
+        if(address == Constants::HEADER_ADDRESS() || isBlockShared(address)) {
+            holes.push_back(block);
+            shared.push_back(address);
+        }
+    }
+    if(holes.empty()) {
+        return;
+    }
+
+    blockAddress_tp hint = Constants::HEADER_ADDRESS();
+    if(firstBlock != 0 && blockMap.get(firstBlock - 1) != Constants::HEADER_ADDRESS()) {
+        hint = blockMap.get(firstBlock - 1) + 1;
+    }
+
+    std::vector<blockAddress_tp> addresses;
+    try {
+        addresses = allocateDataBlocks(holes.size(), hint);
+    } catch(const no_enough_fs_entry &) {
+        // blocks are allocated one by one while writing, write will be short
+        return;
+    }
+
+    // block shared only inside this range loses all owners
+    std::vector<blockAddress_tp> freed;
+    for(size_t i = 0; i < holes.size(); i++) {
+        blockMap.set(holes[i], addresses[i]);
+        bool partialHead = (holes[i] == firstBlock && offset % blockSize != 0);
+        bool partialTail = (holes[i] == lastBlock && (offset + size) % blockSize != 0);
+        if(partialHead || partialTail) {
+            if(shared[i] != Constants::HEADER_ADDRESS()) {
+                copyDataBlock(shared[i], addresses[i]);
+            } else {
+                TypedBufferLocker<FSDataBlock> block = _dataBlocks.readData(addresses[i], SyncType::WriteOnly);
+                memset(block->data, 0, blockSize);
+            }
+        }
+        if(shared[i] != Constants::HEADER_ADDRESS() && !unshareBlock(shared[i])) {
+            freed.push_back(shared[i]);
+        }
+    }
+    for(blockAddress_tp block : freed) {
+        _fingerprints.erase(block);
+    }
+    _bitMap.setBlocks(freed, false);
+}
+
+blockAddress_tp FileSystem::writableFileBlock(FileBlockMap<FileSystemBlockSource> &blockMap, uint64_t fileBlock, blockAddress_tp hint, bool *allocated)
+{
+    blockAddress_tp address = blockMap.getForWrite(fileBlock);
+    *allocated = (address == Constants::HEADER_ADDRESS());
+    bool shared = !*allocated && isBlockShared(address);
+    if(*allocated || shared) {
+        blockAddress_tp newAddress = findAndAllocateFreeDataBlock(hint);
+        if(shared) {
+            copyDataBlock(address, newAddress);
+        }
+        blockMap.set(fileBlock, newAddress);
+        if(shared) {
+            unshareBlock(address);
+        }
+        address = newAddress;
+    }
+    return address;
+}
+
+void FileSystem::readScatteredBlocks(const std::vector<blockAddress_tp> &blocks, char *buffer) const
+{
+    const uint64_t blockSize = header().blockByteSize;
+    for(size_t i = 0; i < blocks.size();) {
+        size_t run = 1;
+        while(i + run < blocks.size() && blocks[i + run] == blocks[i] + run) {
+            run++;
+        }
+        _dataBlocks.readDataBlocks(blocks[i], buffer + i * blockSize, run);
+        i += run;
+    }
+}
+
+void FileSystem::writeScatteredBlocks(const std::vector<blockAddress_tp> &blocks, const char *buffer)
+{
+    const uint64_t blockSize = header().blockByteSize;
+    for(size_t i = 0; i < blocks.size();) {
+        size_t run = 1;
+        while(i + run < blocks.size() && blocks[i + run] == blocks[i] + run) {
+            run++;
+        }
+        _dataBlocks.writeDataBlocks(blocks[i], buffer + i * blockSize, run);
+        i += run;
+    }
+}
+
+void FileSystem::readCompressedData(openedFileStream &stream, FileBlockMap<FileSystemBlockSource> &blockMap,
+                                    openedFileOffset_tp offset, char *buffer, uint64_t size)
+{
+    const uint64_t clusterSize = FSDescriptor::clusterBlocks * header().blockByteSize;
+    uint64_t done = 0;
+    while(done < size) {
+        uint64_t cluster = (offset + done) / clusterSize;
+        uint64_t offsetInCluster = (offset + done) % clusterSize;
+        uint64_t count = std::min(clusterSize - offsetInCluster, size - done);
+
+        if(count == clusterSize) {
+            readCluster(blockMap, cluster, buffer + done);
+        } else {
+            if(stream.clusterData.empty() || stream.cachedCluster != cluster) {
+                std::vector<char> data(clusterSize);
+                readCluster(blockMap, cluster, data.data());
+                stream.clusterData.swap(data);
+                stream.cachedCluster = cluster;
+            }
+            memcpy(buffer + done, stream.clusterData.data() + offsetInCluster, count);
+        }
+        done += count;
+    }
+}
+
+uint64_t FileSystem::writeCompressedData(openedFileStream &stream, FSDescriptor &descriptor,
+                                         openedFileOffset_tp offset, const char *buffer, uint64_t size)
+{
+    const uint64_t clusterSize = FSDescriptor::clusterBlocks * header().blockByteSize;
+    FileBlockMap<FileSystemBlockSource> blockMap(FileSystemBlockSource(this), &descriptor);
+    blockMap.setCursor(stream.cursor);
+
+    auto saveDescriptor = [&]() {
+        blockMap.flush();
+        // clusters are moved to new blocks, other handles may have cached them
+        resetFileCursors(stream.descriptor);
+        stream.cursor = blockMap.getCursor();
+        _descriptors.updateDescriptor(stream.descriptor, descriptor);
+    };
+
+    std::vector<char> cluster(clusterSize);
+    uint64_t done = 0;
+    blockAddress_tp hint = Constants::HEADER_ADDRESS();
+    try {
+        while(done < size) {
+            uint64_t position = offset + done;
+            uint64_t clusterIndex = position / clusterSize;
+            uint64_t offsetInCluster = position % clusterSize;
+            uint64_t count = std::min(clusterSize - offsetInCluster, size - done);
+
+            if(count != clusterSize) {
+                readCluster(blockMap, clusterIndex, cluster.data());
+            }
+            memcpy(cluster.data() + offsetInCluster, buffer + done, count);
+            hint = writeCluster(blockMap, clusterIndex, cluster.data(), hint);
+            done += count;
+        }
+    } catch(const no_enough_fs_entry &) {
+        if(done == 0) {
+            saveDescriptor();
+            throw;
+        }
+    }
+
+    if(offset + done > descriptor.fileSize) {
+        descriptor.fileSize = offset + done;
+    }
+    saveDescriptor();
+    return done;
+}
+
+void FileSystem::readCluster(FileBlockMap<FileSystemBlockSource> &blockMap, uint64_t cluster, char *data)
+{
+    const uint64_t blockSize = header().blockByteSize;
+    const uint64_t clusterBlocks = FSDescriptor::clusterBlocks;
+
+    std::vector<blockAddress_tp> blocks;
+    for(uint64_t i = 0; i < clusterBlocks; i++) {
+        blockAddress_tp address = blockMap.get(cluster * clusterBlocks + i);
+        if(address == Constants::HEADER_ADDRESS()) {
+            break;
+        }
+        blocks.push_back(address);
+    }
+
+    if(blocks.empty()) {
+        memset(data, 0, clusterBlocks * blockSize);
+        return;
+    }
+    if(blocks.size() == clusterBlocks) {
+        readScatteredBlocks(blocks, data);
+        return;
+    }
+
+    std::vector<char> packed(blocks.size() * blockSize);
+    readScatteredBlocks(blocks, packed.data());
+    uint32_t packedSize;
+    memcpy(&packedSize, packed.data(), sizeof(packedSize));
+    if(packedSize > packed.size() - sizeof(packedSize)
+            || !LZCodec::decompress(packed.data() + sizeof(packedSize), packedSize, data, clusterBlocks * blockSize)) {
+        throw file_system_exception("Compressed cluster " + std::to_string(cluster) + " is corrupted.");
+    }
+}
+
+blockAddress_tp FileSystem::writeCluster(FileBlockMap<FileSystemBlockSource> &blockMap, uint64_t cluster, const char *data, blockAddress_tp hint)
+{
+    const uint64_t blockSize = header().blockByteSize;
+    const uint64_t clusterBlocks = FSDescriptor::clusterBlocks;
+    const uint64_t clusterSize = clusterBlocks * blockSize;
+
+    // zero cluster is a hole, cluster is stored as is (all blocks mapped) if compression does not save a block,
+    // otherwise first blocks contain 32 bit compressed size and LZCodec data
+    uint64_t blocksCount = clusterBlocks;
+    const char *stored = data;
+    std::vector<char> packed;
+    if(std::all_of(data, data + clusterSize, [](char c) { return c == 0; })) {
+        blocksCount = 0;
+    } else {
+        std::vector<char> compressed;
+        LZCodec::compress(data, clusterSize, compressed);
+        uint32_t packedSize = static_cast<uint32_t>(compressed.size());
+        uint64_t packedBlocks = (sizeof(packedSize) + compressed.size() + blockSize - 1) / blockSize;
+        if(packedBlocks < clusterBlocks) {
+            packed.assign(packedBlocks * blockSize, 0);
+            memcpy(packed.data(), &packedSize, sizeof(packedSize));
+            memcpy(packed.data() + sizeof(packedSize), compressed.data(), compressed.size());
+            blocksCount = packedBlocks;
+            stored = packed.data();
+        }
+    }
+
+    std::vector<blockAddress_tp> blocks;
+    if(blocksCount != 0) {
+        blocks = allocateDataBlocks(blocksCount, hint);
+        writeScatteredBlocks(blocks, stored);
+        hint = blocks.back() + 1;
+    }
+
+    // new blocks are written, old ones can be released
+    std::vector<blockAddress_tp> freed;
+    for(uint64_t i = 0; i < clusterBlocks; i++) {
+        uint64_t fileBlock = cluster * clusterBlocks + i;
+        blockAddress_tp old = blockMap.get(fileBlock);
+        blockAddress_tp address = (i < blocksCount) ? blocks[i] : Constants::HEADER_ADDRESS();
+        if(old == address) {
+            continue;
+        }
+        blockMap.set(fileBlock, address);
+        if(old != Constants::HEADER_ADDRESS() && !unshareBlock(old)) {
+            freed.push_back(old);
+        }
+    }
+    for(blockAddress_tp block : freed) {
+        _fingerprints.erase(block);
+    }
+    _bitMap.setBlocks(freed, false);
+    return hint;
+}
+
+void FileSystem::copyDataBlock(blockAddress_tp from, blockAddress_tp to)
+{
+    TypedBufferLocker<FSDataBlock> source = _dataBlocks.readData(from, SyncType::ReadOnly);
+    TypedBufferLocker<FSDataBlock> destination = _dataBlocks.readData(to, SyncType::WriteOnly);
+    memcpy(destination->data, source->data, sizeof(destination->data));
+}
+
+uint64_t FileSystem::writeFileData(openedFileStream &stream, openedFileOffset_tp offset, const char *buffer, uint64_t size)
+{
+    Transaction transaction(_fsFile.get());
+    FSDescriptor descriptor = openedFileDescriptor(stream);
+    if(descriptor.isCompressedFile()) {
+        return writeCompressedData(stream, descriptor, offset, buffer, size);
+    }
+
+    const uint64_t blockSize = header().blockByteSize;
+    FileBlockMap<FileSystemBlockSource> blockMap(FileSystemBlockSource(this), &descriptor);
+    blockMap.setCursor(stream.cursor);
+
+    // returns block address, allocates new block near previous file block
+    auto blockFor = [&](uint64_t fileBlock, blockAddress_tp previous, bool *allocated) {
+        return writableFileBlock(blockMap, fileBlock, previous == Constants::HEADER_ADDRESS() ? previous : previous + 1, allocated);
+    };
+
+    if(size != 0) {
+        allocateFileRange(blockMap, offset, size);
+    }
+
+    uint64_t done = 0;
+    blockAddress_tp previous = Constants::HEADER_ADDRESS();
+    try {
+        while(done < size) {
+            uint64_t position = offset + done;
+            uint64_t fileBlock = position / blockSize;
+            uint64_t offsetInBlock = position % blockSize;
+            if(previous == Constants::HEADER_ADDRESS() && fileBlock != 0) {
+                previous = blockMap.get(fileBlock - 1);
+            }
+
+            bool allocated = false;
+            blockAddress_tp address = blockFor(fileBlock, previous, &allocated);
+
+            if(offsetInBlock != 0 || size - done < blockSize) {
+                uint64_t count = std::min(blockSize - offsetInBlock, size - done);
+                TypedBufferLocker<FSDataBlock> block = _dataBlocks.readData(address, allocated ? SyncType::WriteOnly : SyncType::ReadWrite);
+                if(allocated) {
+                    memset(block->data, 0, blockSize);
+                }
+                memcpy(block->data + offsetInBlock, buffer + done, count);
+                done += count;
+                previous = address;
+                continue;
+            }
+
+            if(_inlineDedupe) {
+                previous = writeDedupedBlock(blockMap, fileBlock, address, buffer + done);
+                done += blockSize;
+                continue;
+            }
+
+            // whole blocks, contiguous run is written directly from user buffer
+            uint64_t maxBlocks = (size - done) / blockSize;
+            uint64_t blocks = 1;
+            try {
+                while(blocks < maxBlocks) {
+                    blockAddress_tp next = blockFor(fileBlock + blocks, address + blocks - 1, &allocated);
+                    if(next != address + blocks) {
+                        // not contiguous block is written by the next run
+                        break;
+                    }
+                    blocks++;
+                }
+            } catch(const no_enough_fs_entry &) {
+                // write allocated run, next iteration reports error
+            }
+            _dataBlocks.writeDataBlocks(address, buffer + done, blocks);
+            done += blocks * blockSize;
+            previous = address + blocks - 1;
+        }
+    } catch(const no_enough_fs_entry &) {
+        if(done == 0) {
+            blockMap.flush();
+            if(blockMap.segmentsCopied()) {
+                resetFileCursors(stream.descriptor);
+            }
+            stream.cursor = blockMap.getCursor();
+            _descriptors.updateDescriptor(stream.descriptor, descriptor);
+            throw;
+        }
+    }
+
+    if(offset + done > descriptor.fileSize) {
+        descriptor.fileSize = offset + done;
+    }
+    blockMap.flush();
+    if(blockMap.segmentsCopied()) {
+        resetFileCursors(stream.descriptor);
+    }
+    stream.cursor = blockMap.getCursor();
+    _descriptors.updateDescriptor(stream.descriptor, descriptor);
+    return done;
+}
+
+void FileSystem::seekFile(openedFileDescriptor_tp fd, openedFileOffset_tp offset)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    lockOpenedFile(fd).stream->offset = offset;
+}
+
+FileSystem::openedFileOffset_tp FileSystem::seekFileData(openedFileDescriptor_tp fd, openedFileOffset_tp offset)
+{
+    return seekFileBlock(fd, offset, true);
+}
+
+FileSystem::openedFileOffset_tp FileSystem::seekFileHole(openedFileDescriptor_tp fd, openedFileOffset_tp offset)
+{
+    return seekFileBlock(fd, offset, false);
+}
+
+FileSystem::openedFileOffset_tp FileSystem::seekFileBlock(openedFileDescriptor_tp fd, openedFileOffset_tp offset, bool data)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    lockedFile file = lockOpenedFile(fd);
+    openedFileStream &stream = *file.stream;
+    flushFileHandles(stream.descriptor);
+    FSDescriptor descriptor = openedFileDescriptor(stream);
+    if(offset >= descriptor.fileSize) {
+        throw file_system_exception("Offset is beyond end of file.");
+    }
+
+    const uint64_t blockSize = header().blockByteSize;
+    uint64_t endBlock = (descriptor.fileSize + blockSize - 1) / blockSize;
+    FileBlockMap<FileSystemBlockSource> blockMap(FileSystemBlockSource(this), &descriptor);
+    blockMap.setCursor(stream.cursor);
+
+    uint64_t block;
+    if(descriptor.isCompressedFile()) {
+        // cluster is data if its first block is mapped
+        const uint64_t clusterBlocks = FSDescriptor::clusterBlocks;
+        uint64_t endCluster = (endBlock + clusterBlocks - 1) / clusterBlocks;
+        uint64_t cluster = offset / blockSize / clusterBlocks;
+        while(cluster < endCluster && (blockMap.get(cluster * clusterBlocks) != Constants::HEADER_ADDRESS()) != data) {
+            cluster++;
+        }
+        endBlock = endCluster * clusterBlocks;
+        block = cluster * clusterBlocks;
+    } else {
+        block = blockMap.findBlock(offset / blockSize, endBlock, data);
+    }
+    stream.cursor = blockMap.getCursor();
+    if(block == endBlock) {
+        if(data) {
+            throw file_system_exception("No data after offset.");
+        }
+        stream.offset = descriptor.fileSize;
+    } else {
+        stream.offset = std::max(offset, block * blockSize);
+    }
+    return stream.offset;
+}
+
+void FileSystem::truncateFile(descriptorIndex_tp fileDescriptor, uint64_t size)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    descriptorLocks_tp::guard lock(_descriptorLocks, {fileDescriptor});
+    flushFileHandles(fileDescriptor);
+    Transaction transaction(_fsFile.get());
+    FSDescriptor descriptor = _descriptors.getDescriptor(fileDescriptor);
+    if(descriptor.type != DescriptorVariant::File) {
+        throw file_system_exception("Descriptor is not a file.");
+    }
+
+    if(size < descriptor.fileSize) {
+        const uint64_t blockSize = header().blockByteSize;
+        // compressed file is cut by whole clusters
+        const uint64_t unitBlocks = descriptor.isCompressedFile() ? FSDescriptor::clusterBlocks : 1;
+        const uint64_t unitSize = unitBlocks * blockSize;
+        uint64_t blocksCount = (size + unitSize - 1) / unitSize * unitBlocks;
+
+        FileBlockMap<FileSystemBlockSource> blockMap(FileSystemBlockSource(this), &descriptor);
+        // shared blocks stay used by other files
+        auto releaseBlocks = [&](const std::vector<blockAddress_tp> &released) {
+            std::vector<blockAddress_tp> freed;
+            for(blockAddress_tp block : released) {
+                if(!unshareBlock(block)) {
+                    freed.push_back(block);
+                }
+            }
+            for(blockAddress_tp block : freed) {
+                _fingerprints.erase(block);
+            }
+            _bitMap.setBlocks(freed, false);
+        };
+        // file keeps mapped blocks only, next step starts new transaction
+        auto commitStep = [&](uint64_t mapped) {
+            descriptor.fileSize = std::min(descriptor.fileSize, mapped * blockSize);
+            _descriptors.updateDescriptor(fileDescriptor, descriptor);
+            resetFileCursors(fileDescriptor);
+            transaction.commitStep();
+        };
+
+        // blocks are released from the end by steps which fit in journal record, every step leaves shorter file
+        uint64_t mappedCount = (descriptor.fileSize + unitSize - 1) / unitSize * unitBlocks;
+        while(mappedCount > blocksCount) {
+            if(transactionFull()) {
+                commitStep(mappedCount);
+            }
+            // released block changes its bitmap block, segments of step change few more
+            uint64_t step = std::max(unitBlocks, _fsFile->transactionRoom() / 2 / unitBlocks * unitBlocks);
+            mappedCount -= std::min(mappedCount - blocksCount, step);
+            std::vector<blockAddress_tp> released;
+            blockMap.truncate(mappedCount, &released);
+            blockMap.flush();
+            releaseBlocks(released);
+        }
+
+        if(transactionFull()) {
+            commitStep(blocksCount);
+        }
+        // tail of last block must read as zeros if file grows again
+        if(descriptor.isCompressedFile()) {
+            if(size % unitSize != 0 && blockMap.get(blocksCount - unitBlocks) != Constants::HEADER_ADDRESS()) {
+                std::vector<char> cluster(unitSize);
+                readCluster(blockMap, size / unitSize, cluster.data());
+                memset(cluster.data() + size % unitSize, 0, unitSize - size % unitSize);
+                writeCluster(blockMap, size / unitSize, cluster.data(), Constants::HEADER_ADDRESS());
+            }
+        } else if(size % blockSize != 0 && blockMap.get(blocksCount - 1) != Constants::HEADER_ADDRESS()) {
+            bool allocated = false;
+            blockAddress_tp lastBlock = writableFileBlock(blockMap, blocksCount - 1, Constants::HEADER_ADDRESS(), &allocated);
+            TypedBufferLocker<FSDataBlock> block = _dataBlocks.readData(lastBlock, SyncType::ReadWrite);
+            memset(block->data + size % blockSize, 0, blockSize - size % blockSize);
+        }
+        blockMap.flush();
+        resetFileCursors(fileDescriptor);
+    }
+
+    descriptor.fileSize = size;
+    _descriptors.updateDescriptor(fileDescriptor, descriptor);
+    // refused transaction is reported to caller
+    transaction.commit();
+}
+
+void FileSystem::cloneFile(const session &client, descriptorIndex_tp source, const std::string &name)
+{
+    ensureBlockReferenceTable();
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    checkFilename(name);
+    descriptorIndex_tp directory = currentDirectory(client);
+    directoryLocks_tp::guard directoryLock(_directoryLocks, {directory});
+    descriptorLocks_tp::guard lock(_descriptorLocks, {source});
+    flushFileHandles(source);
+    Transaction transaction(_fsFile.get());
+    FSDescriptor descriptor = _descriptors.getDescriptor(source);
+    if(descriptor.type != DescriptorVariant::File) {
+        throw file_system_exception("Descriptor is not a file.");
+    }
+
+    // descriptor owns its data blocks and first segment, next ones are owned by segments
+    for(blockAddress_tp block : descriptor.dataSegments) {
+        if(block != Constants::HEADER_ADDRESS()) {
+            shareBlock(block);
+        }
+    }
+    if(descriptor.nextDataSegment != Constants::HEADER_ADDRESS()) {
+        shareBlock(descriptor.nextDataSegment);
+    }
+
+    // descriptor shares at most blocksInDescriptor + 1 blocks, transaction fits in journal record
+    descriptor.referencesCount = 0;
+    allocAndAppendDescriptorToDirectory(directory, descriptor, name);
+    transaction.commit();
+}
+
+FileSystem::dedupeResult FileSystem::dedupeFiles()
+{
+    std::unique_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    flushFileHandles(Constants::INVALID_DESCRIPTOR_ID());
+    _fingerprints.clear();
+    Transaction transaction(_fsFile.get());
+
+    const uint64_t blockSize = header().blockByteSize;
+    const std::vector<char> zeroBlock(blockSize, 0);
+    dedupeResult result;
+    std::vector<blockAddress_tp> freed;
+    auto releaseFreed = [&]() {
+        for(blockAddress_tp block : freed) {
+            _fingerprints.erase(block);
+        }
+        result.releasedBlocks += freed.size();
+        _bitMap.setBlocks(freed, false);
+        freed.clear();
+    };
+
+    for(descriptorIndex_tp index : _descriptors.findDescriptors(DescriptorVariant::File)) {
+        if(index == header().blockReferencesDescriptor) {
+            continue;
+        }
+        FSDescriptor descriptor = _descriptors.getDescriptor(index);
+        if(descriptor.isCompressedFile()) {
+            continue;   // blocks contain cluster streams, zero block is not a hole there
+        }
+        FSDescriptor original = descriptor;
+        FileBlockMap<FileSystemBlockSource> blockMap(FileSystemBlockSource(this), &descriptor);
+
+        uint64_t blocksCount = (descriptor.fileSize + blockSize - 1) / blockSize;
+        for(uint64_t fileBlock = blockMap.findBlock(0, blocksCount, true);
+            fileBlock < blocksCount;
+            fileBlock = blockMap.findBlock(fileBlock + 1, blocksCount, true)) {
+            blockAddress_tp address = blockMap.get(fileBlock);
+            result.scannedBlocks++;
+
+            // HEADER_ADDRESS() makes a hole
+            blockAddress_tp replacement = address;
+            {
+                TypedBufferLocker<FSDataBlock> block = _dataBlocks.readData(address, SyncType::ReadOnly);
+                if(memcmp(block->data, zeroBlock.data(), blockSize) == 0) {
+                    replacement = Constants::HEADER_ADDRESS();
+                } else {
+                    FingerprintIndex::fingerprint_tp fingerprint = FingerprintIndex::fingerprint(block->data, blockSize);
+                    blockAddress_tp duplicate = _fingerprints.find(fingerprint);
+                    if(duplicate == Constants::HEADER_ADDRESS()) {
+                        _fingerprints.insert(fingerprint, address);
+                    } else if(duplicate != address) {
+                        TypedBufferLocker<FSDataBlock> duplicateBlock = _dataBlocks.readData(duplicate, SyncType::ReadOnly);
+                        if(memcmp(block->data, duplicateBlock->data, blockSize) == 0) {
+                            replacement = duplicate;
+                        }
+                    }
+                }
+            }
+            if(replacement == address) {
+                continue;
+            }
+            if(transactionFull()) {
+                // merged blocks are committed by steps which fit in journal record
+                blockMap.flush();
+                if(memcmp(&original, &descriptor, sizeof(descriptor)) != 0) {
+                    _descriptors.updateDescriptor(index, descriptor);
+                    original = descriptor;
+                }
+                releaseFreed();
+                transaction.commitStep();
+            }
+
+            // segments on the way must be private before change
+            blockMap.getForWrite(fileBlock);
+            if(replacement == Constants::HEADER_ADDRESS()) {
+                result.zeroBlocks++;
+            } else {
+                shareBlock(replacement);
+                result.mergedBlocks++;
+            }
+            blockMap.set(fileBlock, replacement);
+            if(!unshareBlock(address)) {
+                freed.push_back(address);
+            }
+        }
+
+        blockMap.flush();
+        if(blockMap.segmentsCopied()) {
+            resetFileCursors(index);
+        }
+        if(memcmp(&original, &descriptor, sizeof(descriptor)) != 0) {
+            _descriptors.updateDescriptor(index, descriptor);
+        }
+    }
+
+    releaseFreed();
+    transaction.commit();
+    return result;
+}
+
+void FileSystem::setInlineDedupe(bool enabled)
+{
+    if(enabled) {
+        // merged blocks are counted in table, it is not created by concurrent writes
+        ensureBlockReferenceTable();
+    }
+    _inlineDedupe = enabled;
+}
+
+blockAddress_tp FileSystem::writeDedupedBlock(FileBlockMap<FileSystemBlockSource> &blockMap, uint64_t fileBlock, blockAddress_tp address, const char *data)
+{
+    const uint64_t blockSize = header().blockByteSize;
+    FingerprintIndex::fingerprint_tp fingerprint = FingerprintIndex::fingerprint(data, blockSize);
+    blockAddress_tp duplicate = _fingerprints.find(fingerprint);
+    if(duplicate != Constants::HEADER_ADDRESS() && duplicate != address) {
+        bool equal;
+        {
+            TypedBufferLocker<FSDataBlock> block = _dataBlocks.readData(duplicate, SyncType::ReadOnly);
+            equal = (memcmp(block->data, data, blockSize) == 0);
+        }
+        if(equal) {
+            shareBlock(duplicate);
+            blockMap.set(fileBlock, duplicate);
+            // writable block is not shared
+            _fingerprints.erase(address);
+            _bitMap.set(address, false);
+            return duplicate;
+        }
+    }
+
+    _dataBlocks.writeDataBlocks(address, data, 1);
+    _fingerprints.insert(fingerprint, address);
+    return address;
+}
+
+bool FileSystem::hasSharedBlocks() const
 {
-    _fsFile->close();
+    return header().blockReferencesDescriptor != Constants::INVALID_DESCRIPTOR_ID();
 }
 
-void FileSystem::filestat(arguments arg, outputStream out)
+bool FileSystem::isBlockShared(blockAddress_tp block)
 {
-    checkArgumentsCount(arg, 1);
-    descriptorIndex_tp descriptorId = static_cast<descriptorIndex_tp>(std::stoll(arg.at(0)));
-
-    FSDescriptor descriptor;
-    try {
-        descriptor = _descriptors.getDescriptor(descriptorId);
-    } catch(const std::invalid_argument &) {
-        out << "Bad descriptor\n";
-        return;
+    if(!hasSharedBlocks()) {
+        return false;
     }
+    FSDescriptor table = _descriptors.getDescriptor(header().blockReferencesDescriptor);
+    return BlockReferenceTable<FileSystemPrivateBlockSource>(FileSystemPrivateBlockSource(this), &table).get(block) != 0;
+}
 
-    if(descriptor.type == DescriptorVariant::None) {
-        out << "Descriptor does not exist\n";
-        return;
+void FileSystem::ensureBlockReferenceTable()
+{
+    {
+        std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+        if(hasSharedBlocks()) {
+            return;
+        }
     }
-
-    using std::to_string;
-
-    out << "File statistic: \n\tid: " << descriptorId;
-    if(descriptor.type == DescriptorVariant::File) {
-        out << "\n\tSize: " << descriptor.fileSize;
+    std::unique_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    if(!hasSharedBlocks()) {
+        Transaction transaction(_fsFile.get());
+        createBlockReferenceTable();
     }
-    out << "\n\tType: "     << to_string(descriptor.type) <<
-           "\n\tReferences: " << descriptor.referencesCount <<
-           "\n\tHas extended blocks: " << (descriptor.nextDataSegment == Constants::HEADER_ADDRESS() ? "false" : "true") << "\n";
 }
 
-void FileSystem::ls(outputStream out)
+void FileSystem::createBlockReferenceTable()
 {
-    auto curFolder = currentDirectory();
-    auto maxFilename = header().filenameLength;
-    FSDescriptor descriptorData = _descriptors.getDescriptor(curFolder);
-
-    assert(descriptorData.type == DescriptorVariant::Directory);
-
-    out << "name\tdescriptor\n";
+    FSDescriptor table;
+    table.initFile();
+    FSHeader changedHeader = header();
+    changedHeader.blockReferencesDescriptor = allocDescriptor(table);
+    _fsFile->updateHeader(changedHeader);
+}
 
-    DirectoryDescriptorIterator it = getDirectoryDescriptorIterator(curFolder);
+void FileSystem::shareBlock(blockAddress_tp block)
+{
+    if(!hasSharedBlocks()) {
+        createBlockReferenceTable();
+    }
 
-    while(it.hasNext()) {
-        ++it;
-        out << it->toString(maxFilename) << "\n";
+    descriptorIndex_tp tableIndex = header().blockReferencesDescriptor;
+    FSDescriptor table = _descriptors.getDescriptor(tableIndex);
+    BlockReferenceTable<FileSystemPrivateBlockSource> references(FileSystemPrivateBlockSource(this), &table);
+    references.increment(block);
+    if(references.descriptorChanged()) {
+        _descriptors.updateDescriptor(tableIndex, table);
     }
 }
 
-void FileSystem::create(arguments arg)
+bool FileSystem::unshareBlock(blockAddress_tp block)
 {
-    checkArgumentsCount(arg, 1);
-    FSDescriptor fileDescriptor;
-    fileDescriptor.initFile();
-    allocAndAppendDescriptorToCurrentFolder(fileDescriptor, arg.at(0));
+    if(!hasSharedBlocks()) {
+        return false;
+    }
+    FSDescriptor table = _descriptors.getDescriptor(header().blockReferencesDescriptor);
+    return BlockReferenceTable<FileSystemPrivateBlockSource>(FileSystemPrivateBlockSource(this), &table).decrement(block);
 }
 
-void FileSystem::open(arguments arg, outputStream out)
+std::shared_ptr<FileSystem::openedFileStream> FileSystem::openedFile(openedFileDescriptor_tp fd)
 {
-    checkArgumentsCount(arg, 1);
-
-    if(_lastFreeFileDescriptor == std::numeric_limits<openedFileDescriptor_tp>::max() ) {
-        // TODO: reimplement descriptor id select, old unused descriptors can be reused,
-        throw file_system_exception("You opened too many files.");
+    std::lock_guard<std::mutex> lock(_handlesMutex);
+    std::shared_ptr<openedFileStream> *stream = _opennedFiles.find(fd);
+    if(stream == nullptr) {
+        throw file_system_exception("Descriptor currently not open.");
     }
+    return *stream;
+}
 
-    auto descriptor = getLastPathElementDescriptor(arg.at(0));
-
-    auto openedDescriptor = _lastFreeFileDescriptor++;
-    _opennedFiles[openedDescriptor] = openedFileStream{descriptor};
-    out << "Opened file descriptor: " << openedDescriptor << "\n";
+FileSystem::lockedFile FileSystem::lockOpenedFile(openedFileDescriptor_tp fd)
+{
+    lockedFile file;
+    file.stream = openedFile(fd);
+    file.lock = descriptorLocks_tp::guard(_descriptorLocks, {file.stream->descriptor});
+
+    openedFileStream &stream = *file.stream;
+    uint64_t generation = _cachedStateGeneration;
+    if(stream.generation != generation) {
+        stream.cursor = FileBlockMap<FileSystemBlockSource>::cursor();
+        stream.clusterData.clear();
+        stream.generation = generation;
+    }
+    return file;
 }
 
-void FileSystem::close(arguments arg, outputStream out)
+std::vector<std::shared_ptr<FileSystem::openedFileStream>> FileSystem::openedStreams(descriptorIndex_tp descriptor)
 {
-    checkArgumentsCount(arg, 1);
-    uint64_t descriptorToClose = std::stoull(arg.at(0));
+    std::vector<std::shared_ptr<openedFileStream>> result;
+    std::lock_guard<std::mutex> lock(_handlesMutex);
+    _opennedFiles.forEach([&result, descriptor](std::shared_ptr<openedFileStream> &opened) {
+        if(opened->descriptor == descriptor || descriptor == Constants::INVALID_DESCRIPTOR_ID()) {
+            result.push_back(opened);
+        }
+    });
+    return result;
+}
 
-    auto findResult = _opennedFiles.find(descriptorToClose);
-    if(findResult  == _opennedFiles.end()) {
-        throw file_system_exception("Descriptor currently not open.");
-    } else {
-        out << "Descriptor: " << descriptorToClose << " closed.\n";
-        _opennedFiles.erase(findResult);
+void FileSystem::resetCachedState()
+{
+    for(directoryCache &cache : _directoryCaches) {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        cache.entries.clear();
+        cache.filters.clear();
     }
+    _fingerprints.clear();
+    // handles are used by other threads, their cursors are reset when handle is locked
+    _cachedStateGeneration++;
 }
 
-void FileSystem::read(arguments, outputStream)
+void FileSystem::resetFileCursors(descriptorIndex_tp descriptor)
 {
+    for(const std::shared_ptr<openedFileStream> &opened : openedStreams(descriptor)) {
+        opened->cursor = FileBlockMap<FileSystemBlockSource>::cursor();
+        opened->clusterData.clear();
+    }
 }
 
-void FileSystem::write(arguments)
+FSDescriptor FileSystem::openedFileDescriptor(const openedFileStream &stream) const
 {
-
+    FSDescriptor descriptor = _descriptors.getDescriptor(stream.descriptor);
+    if(descriptor.type != DescriptorVariant::File) {
+        throw file_system_exception("Descriptor is not a file.");
+    }
+    return descriptor;
 }
 
 void FileSystem::link(arguments arg)
 {
     checkArgumentsCount(arg, 2);
-    string srcName  = arg.at(0);
-    string destName = arg.at(1);
-
-    descriptorIndex_tp destDir = currentDirectory();
-
-    descriptorIndex_tp srcDir = currentDirectory();
-    auto it = getDirectoryDescriptorIterator(srcDir);
-    while(it.hasNext()) {
-        ++it;
-        if(it->name(header().filenameLength) == srcName) {
-            addDescriptorToDirectory(destDir, it->descriptor, destName);
-        }
-    }
+    linkFile(_consoleSession, arg.at(0), arg.at(1));
 }
 
 void FileSystem::unlink(arguments arg, outputStream out)
 {
     checkArgumentsCount(arg, 1);
     string name = arg.at(0);
-    descriptorIndex_tp dir = currentDirectory();
-    if(removeDescriptorFromDirectory(dir, DescriptorVariant::File | DescriptorVariant::SymLink, name)) {
+    if(unlinkFile(_consoleSession, name)) {
         out << "Descriptor '" << name << "' deleted from current directory.\n";
     } else {
         out << "Descriptor" << name << "is not found\n";
     }
 }
 
-void FileSystem::truncate(arguments)
+void FileSystem::clone(arguments arg, outputStream out)
+{
+    checkArgumentsCount(arg, 2);
+    cloneFile(_consoleSession, lookup(_consoleSession, arg.at(0)), arg.at(1));
+    out << "File '" << arg.at(0) << "' cloned to '" << arg.at(1) << "'.\n";
+}
+
+void FileSystem::dedupe(arguments arg, outputStream out)
 {
+    if(!arg.empty()) {
+        checkArgumentsCount(arg, 2);
+        if(arg.at(0) != "-i" || (arg.at(1) != "on" && arg.at(1) != "off")) {
+            throw file_system_exception("Usage: dedupe [-i on|off]");
+        }
+        setInlineDedupe(arg.at(1) == "on");
+        out << "Inline deduplication " << (_inlineDedupe ? "enabled" : "disabled") << ".\n";
+        return;
+    }
+
+    dedupeResult result = dedupeFiles();
+    out << "Scanned blocks: " << result.scannedBlocks
+        << "\nMerged blocks: " << result.mergedBlocks
+        << "\nZero blocks: " << result.zeroBlocks
+        << "\nReleased blocks: " << result.releasedBlocks << "\n";
+}
 
+void FileSystem::truncate(arguments arg, outputStream out)
+{
+    checkArgumentsCount(arg, 2);
+    descriptorIndex_tp file = lookup(_consoleSession, arg.at(0));
+    uint64_t size = std::stoull(arg.at(1));
+    truncateFile(file, size);
+    out << "File size: " << size << "\n";
 }
 
 void FileSystem::mkdir(arguments arg)
 {
     checkArgumentsCount(arg, 1);
-    FSDescriptor fileDescriptor;
-    fileDescriptor.initDirectory(currentDirectory());
-    string name = arg.at(0);
-    allocAndAppendDescriptorToCurrentFolder(fileDescriptor, name);
+    bool treeDirectory = arg.at(0) == "-b";
+    if(treeDirectory) {
+        checkArgumentsCount(arg, 2);
+    }
+    makeDirectory(_consoleSession, arg.at(treeDirectory ? 1 : 0), treeDirectory);
 }
 
 void FileSystem::rmdir(arguments arg, outputStream out)
 {
     checkArgumentsCount(arg, 1);
     string name = arg.at(0);
-    if(removeDescriptorFromDirectory(currentDirectory(), DescriptorVariant::Directory, name)) {
+    if(removeDirectory(_consoleSession, name)) {
         out << "Directory deleted\n";
     } else {
         out << "Directory not found\n";
@@ -237,18 +1402,107 @@ void FileSystem::rmdir(arguments arg, outputStream out)
 void FileSystem::cd(arguments arg)
 {
     checkArgumentsCount(arg, 1);
-    _currentFolder = getLastPathElementDescriptor(arg.at(0));
+    changeDirectory(_consoleSession, arg.at(0));
 //    auto v = p.getParsedPath();
 }
 
 void FileSystem::pwd(arguments, outputStream out)
 {
-    auto paths = getDirectoryPathFromDescriptor(currentDirectory());
-    out << "/";
-    for(string directory : paths) {
-        out << directory << "/";
+    out << workingDirectory(_consoleSession) << "\n";
+}
+
+descriptorIndex_tp FileSystem::lookup(const session &client, const std::string &path)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    return getLastPathElementDescriptor(currentDirectory(client), path);
+}
+
+descriptorIndex_tp FileSystem::makeFile(const session &client, const std::string &name, bool compressed)
+{
+    FSDescriptor fileDescriptor;
+    fileDescriptor.initFile();
+    if(compressed) {
+        fileDescriptor.flags |= FSDescriptor::compressedFileFlag;
     }
-    out << "\n";
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    descriptorIndex_tp directory = currentDirectory(client);
+    directoryLocks_tp::guard lock(_directoryLocks, {directory});
+    return allocAndAppendDescriptorToDirectory(directory, fileDescriptor, name);
+}
+
+descriptorIndex_tp FileSystem::makeDirectory(const session &client, const std::string &name, bool tree)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    checkFilename(name);
+    descriptorIndex_tp directory = currentDirectory(client);
+    FSDescriptor fileDescriptor;
+    fileDescriptor.initDirectory(directory);
+    fileDescriptor.setDirectoryName(name, header().filenameLength);
+    if(tree) {
+        fileDescriptor.flags |= FSDescriptor::treeDirectoryFlag;
+    }
+    directoryLocks_tp::guard lock(_directoryLocks, {directory});
+    return allocAndAppendDescriptorToDirectory(directory, fileDescriptor, name);
+}
+
+void FileSystem::linkFile(const session &client, const std::string &name, const std::string &linkName)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    descriptorIndex_tp directory = currentDirectory(client);
+    directoryLocks_tp::guard lock(_directoryLocks, {directory});
+    descriptorIndex_tp target = findInDirectory(directory, name);
+    if(target == Constants::INVALID_DESCRIPTOR_ID()) {
+        throw file_system_exception("No such file or directory.");
+    }
+    if(_descriptors.getDescriptor(target).type == DescriptorVariant::Directory) {
+        throw file_system_exception("Unable to link directory.");
+    }
+    addDescriptorToDirectory(directory, target, linkName);
+}
+
+bool FileSystem::unlinkFile(const session &client, const std::string &name)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    descriptorIndex_tp directory = currentDirectory(client);
+    directoryLocks_tp::guard lock(_directoryLocks, {directory});
+    return removeDescriptorFromDirectory(directory, DescriptorVariant::File | DescriptorVariant::SymLink, name);
+}
+
+bool FileSystem::removeDirectory(const session &client, const std::string &name)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    descriptorIndex_tp directory = currentDirectory(client);
+    directoryLocks_tp::guard lock(_directoryLocks, {directory});
+    return removeDescriptorFromDirectory(directory, DescriptorVariant::Directory, name);
+}
+
+void FileSystem::changeDirectory(session &client, const std::string &path)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    descriptorIndex_tp directory = getLastPathElementDescriptor(currentDirectory(client), path);
+    directoryLocks_tp::sharedGuard lock(_directoryLocks, {directory});
+    if(_descriptors.getDescriptor(directory).type != DescriptorVariant::Directory) {
+        throw file_system_exception("Not a directory.");
+    }
+    client.currentDirectory = directory;
+}
+
+std::string FileSystem::workingDirectory(session &client)
+{
+    std::shared_lock<std::shared_timed_mutex> mountLock(_mountLock);
+    descriptorIndex_tp directory = currentDirectory(client);
+    // rolled back transaction could change directories of cached path
+    uint64_t generation = _cachedStateGeneration;
+    if(client.pathHandle != directory || client.pathGeneration != generation) {
+        client.path = getDirectoryPathFromDescriptor(directory);
+        client.pathHandle = directory;
+        client.pathGeneration = generation;
+    }
+    std::string result = "/";
+    for(const string &name : client.path) {
+        result += name + "/";
+    }
+    return result;
 }
 
 void FileSystem::symlink(arguments)
@@ -273,12 +1527,107 @@ void FileSystem::fileFormatChanged()
     assert(_fsFile->isFormatedFS());
     _descriptorAlgo.setEntriesInfo(header().entriesInDirectoryDescriptor, header().entriesInDirectoryBlock);
 
+    {
+        std::lock_guard<std::mutex> lock(_handlesMutex);
+        _opennedFiles.clear();
+    }
+    _dirtyFilesCount = 0;
+    resetCachedState();
+    _consoleSession = session();
+
+    if(header().countersSynced == 0) {
+        recountFreeCounters();
+    }
+
     std::clog << "Install root directory: " << header().rootDirectoryDescriptor << "\n";
-    _currentFolder = header().rootDirectoryDescriptor;
     std::clog << header().toString();
 
 }
 
+void FileSystem::recountFreeCounters()
+{
+    std::clog << "File system was not unmounted, free counters are recounted.\n";
+    _fsFile->setFreeCounters(_bitMap.countFree(_dataBlocks.areaBegin(), _dataBlocks.areaEnd()),
+                             _descriptors.countDescriptors(DescriptorVariant::None));
+}
+
+void FileSystem::repairFileSystem(const ConsistencyChecker::report &report)
+{
+    {
+        // fixes are committed by steps which fit in journal record, every step leaves fewer problems
+        Transaction transaction(_fsFile.get());
+        auto commitStepIfFull = [&]() {
+            if(transactionFull()) {
+                transaction.commitStep();
+            }
+        };
+
+        // block changes at most its bitmap block
+        auto setBlocks = [&](const std::vector<blockAddress_tp> &blocks, bool used) {
+            for(size_t first = 0; first < blocks.size(); first += transactionStepBlocks) {
+                commitStepIfFull();
+                size_t last = std::min(blocks.size(), first + transactionStepBlocks);
+                std::vector<blockAddress_tp> step(blocks.begin() + first, blocks.begin() + last);
+                _bitMap.setBlocks(step, used);
+            }
+        };
+        setBlocks(report.usedBlocks, true);
+        setBlocks(report.freeBlocks, false);
+
+        for(const auto &references : report.referencesCounts) {
+            commitStepIfFull();
+            FSDescriptor descriptor = _descriptors.getDescriptor(references.first);
+            descriptor.referencesCount = references.second;
+            _descriptors.updateDescriptor(references.first, descriptor);
+        }
+
+        for(const ConsistencyChecker::directoryFix &fix : report.directories) {
+            commitStepIfFull();
+            FSDescriptor directory = _descriptors.getDescriptor(fix.directory);
+            if(fix.truncateChain) {
+                if(fix.chainEnd == Constants::HEADER_ADDRESS()) {
+                    directory.nextDataSegment = Constants::HEADER_ADDRESS();
+                } else {
+                    _dataBlocks.readData<FSDescriptorDataPart>(fix.chainEnd, SyncType::ReadWrite)->nextSegment = Constants::HEADER_ADDRESS();
+                }
+            }
+            directory.firstFreeElementIndex = fix.entriesCount;
+            directory.lastSegment = fix.lastSegment;
+            directory.preLastSegment = fix.preLastSegment;
+            _descriptors.updateDescriptor(fix.directory, directory);
+        }
+
+        if(!report.blockOwners.empty()) {
+            descriptorIndex_tp tableIndex = header().blockReferencesDescriptor;
+            auto owners = report.blockOwners.begin();
+            while(owners != report.blockOwners.end()) {
+                commitStepIfFull();
+                // table is opened by step, its changed segment is written before commit
+                FSDescriptor table = _descriptors.getDescriptor(tableIndex);
+                BlockReferenceTable<FileSystemPrivateBlockSource> references(FileSystemPrivateBlockSource(this), &table);
+                do {
+                    // counter is the number of additional owners, not reachable block is released by bitmap repair
+                    uint64_t counter = owners->second != 0 ? owners->second - 1 : 0;
+                    while(references.get(owners->first) > counter) {
+                        references.decrement(owners->first);
+                    }
+                    while(references.get(owners->first) < counter) {
+                        references.increment(owners->first);
+                    }
+                    ++owners;
+                } while(owners != report.blockOwners.end() && !transactionFull());
+                if(references.descriptorChanged()) {
+                    _descriptors.updateDescriptor(tableIndex, table);
+                }
+            }
+        }
+        transaction.commit();
+    }
+
+    _fsFile->setFreeCounters(report.freeBlocksCount, report.freeDescriptorsCount);
+    resetCachedState();
+}
+
 void FileSystem::checkArgumentsCount(arguments arg, size_t minArgumentsCount) const
 {
     if(arg.size() < minArgumentsCount) {
@@ -293,9 +1642,12 @@ void FileSystem::checkFilename(const std::string &filename) const
     }
 }
 
-descriptorIndex_tp FileSystem::currentDirectory() const
+descriptorIndex_tp FileSystem::currentDirectory(const session &client) const
 {
-    return _currentFolder;
+    if(client.currentDirectory == Constants::INVALID_DESCRIPTOR_ID()) {
+        return header().rootDirectoryDescriptor;
+    }
+    return client.currentDirectory;
 }
 
 const FSHeader &FileSystem::header() const
@@ -303,10 +1655,13 @@ const FSHeader &FileSystem::header() const
     return _fsFile->headerExcept();
 }
 
-void FileSystem::allocAndAppendDescriptorToCurrentFolder(const FSDescriptor &descriptor, const std::string &name)
+descriptorIndex_tp FileSystem::allocAndAppendDescriptorToDirectory(descriptorIndex_tp directory, const FSDescriptor &descriptor, const std::string &name)
 {
-    // TODO: check conflicts
+    return addDescriptorToDirectory(directory, Constants::INVALID_DESCRIPTOR_ID(), name, &descriptor);
+}
 
+descriptorIndex_tp FileSystem::allocDescriptor(const FSDescriptor &descriptor)
+{
     blockAddress_tp notFullDescriptorBlock = _bitMap.findFirstFreeBlock(
                                                     _descriptors.areaBegin(),
                                                     _descriptors.areaEnd() );
@@ -320,86 +1675,210 @@ void FileSystem::allocAndAppendDescriptorToCurrentFolder(const FSDescriptor &des
     if(blockBeenFilled) {
         _bitMap.set(notFullDescriptorBlock, true);
     }
-
-    addDescriptorToDirectory(currentDirectory(), newFileDescriptorIndex, name);
+    return newFileDescriptorIndex;
 }
 
-void FileSystem::addDescriptorToDirectory(descriptorIndex_tp directoryDescriptorIndex, descriptorIndex_tp folderElementDescriptor, const string &name)
+descriptorIndex_tp FileSystem::addDescriptorToDirectory(descriptorIndex_tp directoryDescriptorIndex, descriptorIndex_tp folderElementDescriptor,
+                                                       const string &name, const FSDescriptor *newDescriptor)
 {
 //    // TODO: parse name path
 
     checkFilename(name);
+    Transaction transaction(_fsFile.get());
+
+    FSDescriptor dirDescriptor = _descriptors.getDescriptor(directoryDescriptorIndex);
+    checkLiveDirectory(directoryDescriptorIndex, dirDescriptor);
+    // both layouts, before anything is allocated
+    if(findInDirectory(directoryDescriptorIndex, name) != Constants::INVALID_DESCRIPTOR_ID()) {
+        throw file_system_exception("File already exists.");
+    }
 
+    if(newDescriptor != nullptr) {
+        folderElementDescriptor = allocDescriptor(*newDescriptor);
+    }
     directoryEntry newEntry;
     newEntry.set(folderElementDescriptor, name, header().filenameLength);
+    _descriptors.incrementReference(folderElementDescriptor);
 
-    FSDescriptor dirDescriptor = _descriptors.getDescriptor(directoryDescriptorIndex);
+    if(dirDescriptor.isTreeDirectory()) {
+        DirectoryTree<FileSystemBlockSource>(FileSystemBlockSource(this), &dirDescriptor).insert(newEntry);
+        _descriptors.updateDescriptor(directoryDescriptorIndex, dirDescriptor);
+    } else {
+        _descriptorAlgo.appendToEnd(directoryDescriptorIndex, dirDescriptor, newEntry);
+    }
 
-    assert(dirDescriptor.type == DescriptorVariant::Directory);
+    directoryCache &cache = cacheOf(directoryDescriptorIndex);
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.entries.erase(directoryDescriptorIndex, name);
+    auto filter = cache.filters.find(directoryDescriptorIndex);
+    if(filter != cache.filters.end()) {
+        filter->second.add(newEntry.nameHash());
+    }
+    return folderElementDescriptor;
+}
 
-    _descriptorAlgo.appendToEnd(directoryDescriptorIndex, dirDescriptor, newEntry);
+void FileSystem::checkLiveDirectory(descriptorIndex_tp directoryDescriptorIndex, const FSDescriptor &directory) const
+{
+    // removed directory keeps its descriptor without references, it is checked in transaction of change
+    if(directory.type != DescriptorVariant::Directory
+            || (directory.referencesCount == 0 && directoryDescriptorIndex != header().rootDirectoryDescriptor)) {
+        throw file_system_exception("No such file or directory.");
+    }
 }
 
 bool FileSystem::removeDescriptorFromDirectory(descriptorIndex_tp directoryDescriptorIndex, DescriptorVariant type, const std::string &name)
 {
     checkFilename(name);
+    Transaction transaction(_fsFile.get());
+
+    PaddedName key(name, header().filenameLength);
+    FSDescriptor directory = _descriptors.getDescriptor(directoryDescriptorIndex);
+
+    if(directory.isTreeDirectory()) {
+        DirectoryTree<FileSystemBlockSource> tree(FileSystemBlockSource(this), &directory);
+        descriptorIndex_tp removedDescriptor = tree.find(key);
+        if(removedDescriptor == Constants::INVALID_DESCRIPTOR_ID()) {
+            return false;
+        }
+        FSDescriptor elementDescriptor = _descriptors.getDescriptor(removedDescriptor);
+        checkRemovedType(name, elementDescriptor.type, type);
+        _descriptors.decrementReference(removedDescriptor);
+        tree.remove(key);
+        _descriptors.updateDescriptor(directoryDescriptorIndex, directory);
+        directoryEntryRemoved(directoryDescriptorIndex, name, removedDescriptor, elementDescriptor.type);
+        return true;
+    }
 
-    auto it = getDirectoryDescriptorIterator(directoryDescriptorIndex);
+    auto it = getDirectoryDescriptorIterator(directoryDescriptorIndex, directory);
 
     while(it.hasNext()) {
         ++it;
-        if(it->name(header().filenameLength) == name) {
-            FSDescriptor dirDescriptor = _descriptors.getDescriptor(it->descriptor);
-            if((dirDescriptor.type & type) != 0) {
-                _descriptors.decrementReference(it->descriptor);
-                _descriptorAlgo.deleteEntry(it);
-                return true;
-            } else {
-                throw file_system_exception("Unable to remove '" + name + "'. " + std::to_string(dirDescriptor.type) + " is not " + std::to_string(type) + ".");
-            }
+        if(it->hasName(key)) {
+            descriptorIndex_tp removedDescriptor = it->descriptor;
+            FSDescriptor elementDescriptor = _descriptors.getDescriptor(removedDescriptor);
+            checkRemovedType(name, elementDescriptor.type, type);
+            _descriptors.decrementReference(removedDescriptor);
+            _descriptorAlgo.deleteEntry(it);
+            directoryEntryRemoved(directoryDescriptorIndex, name, removedDescriptor, elementDescriptor.type);
+            return true;
         }
     }
     return false;
 }
 
+void FileSystem::checkRemovedType(const std::string &name, DescriptorVariant type, DescriptorVariant expectedType) const
+{
+    if((type & expectedType) == 0) {
+        throw file_system_exception("Unable to remove '" + name + "'. " + std::to_string(type) + " is not " + std::to_string(expectedType) + ".");
+    }
+}
+
+void FileSystem::directoryEntryRemoved(descriptorIndex_tp directoryDescriptorIndex, const std::string &name, descriptorIndex_tp removedDescriptor, DescriptorVariant removedType)
+{
+    if(removedType == DescriptorVariant::Directory) {
+        directoryCache &removedCache = cacheOf(removedDescriptor);
+        std::lock_guard<std::mutex> lock(removedCache.mutex);
+        removedCache.entries.eraseDirectory(removedDescriptor);
+        removedCache.filters.erase(removedDescriptor);
+    }
+
+    directoryCache &cache = cacheOf(directoryDescriptorIndex);
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.entries.erase(directoryDescriptorIndex, name);
+    auto filter = cache.filters.find(directoryDescriptorIndex);
+    if(filter != cache.filters.end()) {
+        filter->second.remove();
+    }
+}
+
+FileSystem::directoryCache &FileSystem::cacheOf(descriptorIndex_tp directory)
+{
+    return _directoryCaches[directory % directoryCacheShards];
+}
+
 std::list<string> FileSystem::getDirectoryPathFromDescriptor(descriptorIndex_tp handle)
 {
     std::list<string> resultPath;
     descriptorIndex_tp currentHandle = handle;
     while(currentHandle != header().rootDirectoryDescriptor) {
-        bool found = false;
-        DirectoryDescriptorIterator it = getDirectoryDescriptorIterator(currentHandle);
-        while(it.hasNext()) {
-            ++it;
-            if(it->descriptor == currentHandle) {
-                resultPath.push_front(it->name(header().filenameLength));
-                found = true;
-                break;
-            }
+        FSDescriptor directory = _descriptors.getDescriptor(currentHandle);
+        if(directory.type != DescriptorVariant::Directory || directory.parent == currentHandle) {
+            throw std::runtime_error("Error in file format. Bad parent directory.");
         }
-        if(!found) {
-            throw std::runtime_error("Error in file format. Entry not found in parent directory.");
-        }
-        currentHandle = it.descriptor().nextDataSegment;
+        resultPath.push_front(directory.directoryName(header().filenameLength));
+        currentHandle = directory.parent;
     }
 
     return resultPath;
 }
 
-blockAddress_tp FileSystem::findAndAllocateFreeDataBlock()
+blockAddress_tp FileSystem::findAndAllocateFreeDataBlock(blockAddress_tp hint)
 {
-    blockAddress_tp freeBlock = _bitMap.findFirstFreeBlock(
-                _dataBlocks.areaBegin(),
-                _dataBlocks.areaEnd());
+    // blocks reserved by buffered writes are not used
+    if(_fsFile->availableBlocks() == 0) {
+        throw no_enough_fs_entry("Not enough free space.");
+    }
+    blockAddress_tp freeBlock = Constants::HEADER_ADDRESS();
+    if(_dataBlocks.inRange(hint)) {
+        freeBlock = _bitMap.findFirstFreeBlock(hint, _dataBlocks.areaEnd());
+    }
+    if(freeBlock == Constants::HEADER_ADDRESS()) {
+        freeBlock = _bitMap.findFirstFreeBlock(_dataBlocks.areaBegin(), _dataBlocks.areaEnd());
+    }
     if(freeBlock == Constants::HEADER_ADDRESS()) {
         throw no_enough_fs_entry("Not enough free space.");
     }
     _bitMap.set(freeBlock, true);
+    // block could be metadata before release
+    _fsFile->resetChecksum(freeBlock);
     return freeBlock;
 }
 
+std::vector<blockAddress_tp> FileSystem::allocateDataBlocks(uint64_t count, blockAddress_tp hint)
+{
+    if(_fsFile->availableBlocks() < count) {
+        throw no_enough_fs_entry("Not enough free space.");
+    }
+    blockAddress_tp first = Constants::HEADER_ADDRESS();
+    if(_dataBlocks.inRange(hint)) {
+        first = _bitMap.findFreeRange(hint, _dataBlocks.areaEnd(), count);
+    }
+    if(first == Constants::HEADER_ADDRESS()) {
+        first = _bitMap.findFreeRange(_dataBlocks.areaBegin(), _dataBlocks.areaEnd(), count);
+    }
+
+    std::vector<blockAddress_tp> blocks;
+    blocks.reserve(count);
+    if(first != Constants::HEADER_ADDRESS()) {
+        for(uint64_t i = 0; i < count; i++) {
+            blocks.push_back(first + i);
+        }
+    } else {
+        // no free range, take any free blocks
+        blockAddress_tp from = _dataBlocks.areaBegin();
+        while(blocks.size() < count) {
+            blockAddress_tp block = Constants::HEADER_ADDRESS();
+            if(from <= _dataBlocks.areaEnd()) {
+                block = _bitMap.findFirstFreeBlock(from, _dataBlocks.areaEnd());
+            }
+            if(block == Constants::HEADER_ADDRESS()) {
+                throw no_enough_fs_entry("Not enough free space.");
+            }
+            blocks.push_back(block);
+            from = block + 1;
+        }
+    }
+
+    _bitMap.setBlocks(blocks, true);
+    for(blockAddress_tp block : blocks) {
+        _fsFile->resetChecksum(block);
+    }
+    return blocks;
+}
+
 void FileSystem::formatFile()
 {
+    std::unique_lock<std::shared_timed_mutex> mountLock(_mountLock);
     FSHeader header;
     header.init();
     header.blockByteSize = Constants::blockByteSize();
@@ -414,12 +1893,31 @@ void FileSystem::formatFile()
     header._bitMapEnd = header._bitMapBegin + (blockCount / header.bitsInBitMapBlock());
     auto descriptorBlocks = (blockCount / 4 / header.descriptorsInBlock());
     header._descriptorsEnd = header._bitMapEnd + 1 + descriptorBlocks;
-    header._dataEnd = blockCount - 1;
+    // 32 bit checksum for every block before checksums area
+    auto checksumBlocks = (blockCount * sizeof(uint32_t) + header.blockByteSize - 1) / header.blockByteSize;
+    header.checksumsEnd = blockCount - 1;
+    header.checksumsBegin = blockCount - checksumBlocks;
+    // 1/64 of blocks for metadata journal before checksums
+    // record holds bounded operations and steps of split ones
+    constexpr uint64_t minJournalBlocks = 64;
+    constexpr uint64_t maxJournalBlocks = 4096;
+    auto journalBlocks = std::min(std::max(blockCount / 64, minJournalBlocks), maxJournalBlocks);
+    if(header.checksumsBegin <= header._descriptorsEnd + journalBlocks + 1) {
+        throw bad_state_exception("File is too small.");
+    }
+    header.journalEnd = header.checksumsBegin - 1;
+    header.journalBegin = header.journalEnd - journalBlocks + 1;
+    header._dataEnd = header.journalBegin - 1;
 
-    _fsFile->formatFS(header);
+    header.freeBlocks = header.dataBlocksCount();
+    header.freeDescriptors = header.descriptorsCount() - 1;     // root directory
+    header.countersSynced = 1;
+
+    // bitmap and descriptors are zeros, they are cleared when they are written first time
+    header.bitMapLazyBegin = header.bitMapBegin();
+    header.descriptorsLazyBegin = header.descriptorsBegin();
 
-    _bitMap.initBlocks();
-    _descriptors.initBlocks();
+    _fsFile->formatFS(header);
 
     FSDescriptor rootDirectory;
     rootDirectory.initDirectory(header.rootDirectoryDescriptor);
@@ -432,45 +1930,176 @@ void FileSystem::formatFile()
     fileFormatChanged();
 }
 
-descriptorIndex_tp FileSystem::getLastPathElementDescriptor(const std::string path)
+descriptorIndex_tp FileSystem::getLastPathElementDescriptor(descriptorIndex_tp start, const std::string path)
 {
     Path p(path);
-    return getLastPathElementDescriptor(p.getParsedPath(), p.isAbsolute());
+    return getLastPathElementDescriptor(start, p.getParsedPath(), p.isAbsolute());
 }
 
-descriptorIndex_tp FileSystem::getLastPathElementDescriptor(const std::vector<std::string> &path, bool isAbsolute)
+descriptorIndex_tp FileSystem::getLastPathElementDescriptor(descriptorIndex_tp start, const std::vector<std::string> &path, bool isAbsolute)
 {
-    descriptorIndex_tp currentHandle = isAbsolute ? header().rootDirectoryDescriptor : currentDirectory();
+    descriptorIndex_tp currentHandle = isAbsolute ? header().rootDirectoryDescriptor : start;
 
     // TODO: symbolic link and check symbolic link loop
 
-//    for(const string &currentName: path) {
-    for(auto currentName = path.cbegin(); ; ++currentName) {
-        if(currentName == path.cend()) {
-            return currentHandle;
-        }
-        DirectoryDescriptorIterator dIt = getDirectoryDescriptorIterator(currentHandle);
-        bool foundNext = false;
-        while(dIt.hasNext()) {
-            ++dIt;
-            if(dIt->name(header().filenameLength) == *currentName) {
-                foundNext = true;
-                currentHandle = dIt->descriptor;
+    for(const string &currentName: path) {
+        directoryLocks_tp::sharedGuard lock(_directoryLocks, {currentHandle});
+        currentHandle = findInDirectory(currentHandle, currentName);
+        if(currentHandle == Constants::INVALID_DESCRIPTOR_ID()) {
+            throw file_system_exception("No such file or directory.");
+        }
+    }
+    return currentHandle;
+}
+
+descriptorIndex_tp FileSystem::findInDirectory(descriptorIndex_tp directoryDescriptorIndex, const std::string &name)
+{
+    directoryCache &cache = cacheOf(directoryDescriptorIndex);
+    descriptorIndex_tp result;
+    bool buildFilter;
+    PaddedName key(name, header().filenameLength);
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        if(cache.entries.find(directoryDescriptorIndex, name, &result)) {
+            return result;
+        }
+
+        auto filter = cache.filters.find(directoryDescriptorIndex);
+        if(filter != cache.filters.end() && filter->second.needRebuild()) {
+            cache.filters.erase(filter);
+            filter = cache.filters.end();
+        }
+        if(!key.isValid()) {
+            return Constants::INVALID_DESCRIPTOR_ID();
+        }
+
+        if(filter != cache.filters.end() && !filter->second.mayContain(key.hash())) {
+            cache.entries.insertNegative(directoryDescriptorIndex, name);
+            return Constants::INVALID_DESCRIPTOR_ID();
+        }
+        buildFilter = (filter == cache.filters.end());
+    }
+
+    // directory is read without cache lock, readers of other directories of shard are not blocked
+
+    FSDescriptor directory = _descriptors.getDescriptor(directoryDescriptorIndex);
+    if(directory.type != DescriptorVariant::Directory) {
+        // path goes through file, its data is not read as entries and nothing is cached
+        throw file_system_exception("Not a directory.");
+    }
+    if(directory.isTreeDirectory()) {
+        if(name == ".") {
+            result = directoryDescriptorIndex;
+        } else if(name == "..") {
+            result = directory.parent;
+        } else {
+            result = DirectoryTree<FileSystemBlockSource>(FileSystemBlockSource(this), &directory).find(key);
+        }
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        cache.entries.insert(directoryDescriptorIndex, name, result);
+        return result;
+    }
+
+    // first lookup in directory reads it completely to build filter,
+    // room for as many new names, create checks every name with filter
+    DirectoryIterator it = getDirectoryDescriptorIterator(directoryDescriptorIndex, directory);
+    DirectoryBloomFilter newFilter(buildFilter ? 2 * (it.descriptor().firstFreeElementIndex + 2) : 0);
+
+    result = Constants::INVALID_DESCRIPTOR_ID();
+    while(it.hasNext()) {
+        ++it;
+        if(buildFilter) {
+            newFilter.add(it->nameHash());
+        }
+        if(result == Constants::INVALID_DESCRIPTOR_ID() && it->hasName(key)) {
+            result = it->descriptor;
+            if(!buildFilter) {
                 break;
             }
         }
-        if(!foundNext) {
-            throw file_system_exception("No such file or directory.");
+    }
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if(buildFilter) {
+        cache.filters[directoryDescriptorIndex] = std::move(newFilter);
+    }
+    cache.entries.insert(directoryDescriptorIndex, name, result);
+    return result;
+}
+
+std::vector<directoryEntry> FileSystem::readDirectory(descriptorIndex_tp directoryDescriptorIndex, const std::string &prefix)
+{
+    if(prefix.size() > header().filenameLength) {
+        return {};
+    }
+
+    std::vector<directoryEntry> result;
+    FSDescriptor directory = _descriptors.getDescriptor(directoryDescriptorIndex);
+    assert(directory.type == DescriptorVariant::Directory);
+
+    if(directory.isTreeDirectory()) {
+        if(prefix.empty()) {
+            result.resize(2);
+            result[0].set(directoryDescriptorIndex, ".", header().filenameLength);
+            result[1].set(directory.parent, "..", header().filenameLength);
+        }
+        result.reserve(result.size() + directory.firstFreeElementIndex);
+
+        DirectoryTree<FileSystemBlockSource> tree(FileSystemBlockSource(this), &directory);
+        PaddedName from(prefix, header().filenameLength);
+        tree.scan(prefix.empty() ? nullptr : &from, [&](const directoryEntry &entry) {
+            if(!entry.hasPrefix(prefix)) {
+                return false;
+            }
+            result.push_back(entry);
+            return true;
+        });
+        return result;
+    }
+
+    result.reserve(directory.firstFreeElementIndex + 2);
+    DirectoryIterator it = getDirectoryDescriptorIterator(directoryDescriptorIndex, directory);
+    while(it.hasNext()) {
+        ++it;
+        if(it->hasPrefix(prefix)) {
+            result.push_back(*it);
         }
     }
+    if(!prefix.empty()) {
+        std::sort(result.begin(), result.end(), [](const directoryEntry &first, const directoryEntry &second) {
+            return memcmp(first.__name, second.__name, sizeof(first.__name)) < 0;
+        });
+    }
+    return result;
 }
 
-DirectoryDescriptorIterator FileSystem::getDirectoryDescriptorIterator(descriptorIndex_tp directoryDescriptorIndex)
+std::vector<FileSystem::directoryEntryPlus> FileSystem::readDirectoryPlus(descriptorIndex_tp directoryDescriptorIndex, const std::string &prefix)
 {
-    FSDescriptor dirDescriptor = _descriptors.getDescriptor(directoryDescriptorIndex);
+    std::vector<directoryEntry> entries = readDirectory(directoryDescriptorIndex, prefix);
+
+    std::vector<descriptorIndex_tp> indices;
+    indices.reserve(entries.size());
+    for(const directoryEntry &entry : entries) {
+        indices.push_back(entry.descriptor);
+    }
+    std::vector<FSDescriptor> descriptors = _descriptors.getDescriptors(indices);
+
+    std::vector<directoryEntryPlus> result;
+    result.reserve(entries.size());
+    for(size_t i = 0; i < entries.size(); i++) {
+        result.push_back(directoryEntryPlus{entries[i].name(header().filenameLength), entries[i].descriptor, descriptors[i]});
+    }
+    return result;
+}
 
+FileSystem::DirectoryIterator FileSystem::getDirectoryDescriptorIterator(descriptorIndex_tp directoryDescriptorIndex)
+{
+    return getDirectoryDescriptorIterator(directoryDescriptorIndex, _descriptors.getDescriptor(directoryDescriptorIndex));
+}
+
+FileSystem::DirectoryIterator FileSystem::getDirectoryDescriptorIterator(descriptorIndex_tp directoryDescriptorIndex, const FSDescriptor &dirDescriptor)
+{
     assert(dirDescriptor.type == DescriptorVariant::Directory);
-    _descriptorAlgo.setEntriesInfo(header().entriesInDirectoryDescriptor,
-                                   header().entriesInDirectoryBlock);
+    assert(!dirDescriptor.isTreeDirectory());
     return _descriptorAlgo.iterator(directoryDescriptorIndex, dirDescriptor);
 }
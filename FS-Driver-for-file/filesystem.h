@@ -6,46 +6,248 @@
 #include "fsdescriptoriterator.h"
 #include "filesystemarea.h"
 #include "fileaccessor.h"
+#include "dentrycache.h"
+#include "bloomfilter.h"
+#include "fileblockmap.h"
+#include "handletable.h"
+#include "fingerprintindex.h"
+#include "transaction.h"
+#include "consistencychecker.h"
+#include "locktable.h"
 
 #include <unordered_map>
 #include <memory>
 #include <string>
 #include <vector>
+#include <list>
+#include <array>
 #include <tuple>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <cassert>
 
 using std::string;
 
 // TODO: make block commodification check
 
+class FileSystem;
+
+/**
+ * @brief The FileSystemBlockSource class
+ * BlockSource for directory iterator, calls FileSystem areas directly
+ */
+class FileSystemBlockSource
+{
+public:
+    explicit FileSystemBlockSource(FileSystem *fs = nullptr) :
+        _fs(fs)
+    { }
+
+    inline TypedBufferLocker<FSDescriptorDataPart> readSegment(blockAddress_tp block) const;
+    template<typename T>
+    TypedBufferLocker<T> readBlock(blockAddress_tp block, SyncType type) const;
+    inline void updateDescriptor(descriptorIndex_tp descriptorIndex, const FSDescriptor &descriptor) const;
+    inline blockAddress_tp allocBlock() const;
+    inline void deallocBlock(blockAddress_tp block) const;
+
+    inline bool hasSharedBlocks() const;
+    inline bool isBlockShared(blockAddress_tp block) const;
+    inline void shareBlock(blockAddress_tp block) const;
+    inline bool unshareBlock(blockAddress_tp block) const;
+
+private:
+    FileSystem *_fs;
+};
+
+/**
+ * @brief The FileSystemPrivateBlockSource class
+ * BlockSource for internal files which are never cloned (block reference table)
+ */
+class FileSystemPrivateBlockSource : public FileSystemBlockSource
+{
+public:
+    explicit FileSystemPrivateBlockSource(FileSystem *fs = nullptr) :
+        FileSystemBlockSource(fs)
+    { }
+
+    bool hasSharedBlocks() const {
+        return false;
+    }
+    bool isBlockShared(blockAddress_tp) const {
+        return false;
+    }
+    void shareBlock(blockAddress_tp) const {
+        assert(false);
+    }
+    bool unshareBlock(blockAddress_tp) const {
+        return false;
+    }
+};
+
+/**
+ * @brief The FileSystem class
+ * Public operations are thread safe, locks are taken in order:
+ * mount lock (shared by operations, exclusive for mount, format, check and dedupe),
+ * directory locks (shared for lookup and listing, exclusive for entries changes),
+ * descriptor locks (data, size and opened handles of file),
+ * transaction lock of accessor (allocation: bitmap, descriptors, shared blocks counters, fingerprints),
+ * leaf mutexes (opened handles table, lookup cache shards, buffer pool, checksums, file stream).
+ * Path lookup holds one directory lock at a time, it is done before exclusive directory lock is taken.
+ */
 class FileSystem : public ConsoleOperationHandler
 {
-    using openedFileDescriptor_tp = uint64_t;
-    using openedFileOffset_tp     = uint64_t;  // WARNING: change to 128 bit integer, if you have filesystem which contains more than 2^64 bytes
+    friend class FileSystemBlockSource;
+
+    using DirectoryIterator = BasicDirectoryDescriptorIterator<FileSystemBlockSource>;
 
 public:
+    using openedFileDescriptor_tp = uint64_t;  // HandleTable handle
+    using openedFileOffset_tp     = uint64_t;  // WARNING: change to 128 bit integer, if you have filesystem which contains more than 2^64 bytes
+
+    /**
+     * @brief The session struct
+     * State of one file system client, it is used by one thread at a time.
+     */
+    struct session {
+        descriptorIndex_tp currentDirectory = Constants::INVALID_DESCRIPTOR_ID();    // root directory if not set
+        // pwd result for pathHandle directory, valid for pathGeneration of cached state
+        std::list<string> path;
+        descriptorIndex_tp pathHandle = Constants::INVALID_DESCRIPTOR_ID();
+        uint64_t pathGeneration = 0;
+    };
+
     FileSystem(std::shared_ptr<FormatedFileAccessor> fsFile);
     ~FileSystem() override;
 
     void registerCommands(Console *console) override;
 
+    /**
+     * @brief find descriptor of path, relative path starts from current directory of session
+     * @throw file_system_exception if there is no such file or directory
+     */
+    descriptorIndex_tp lookup(const session &client, const std::string &path);
+    // entries are created and removed in current directory of session
+    descriptorIndex_tp makeFile(const session &client, const std::string &name, bool compressed = false);
+    descriptorIndex_tp makeDirectory(const session &client, const std::string &name, bool tree = false);
+    // directories have one name, it is stored in their descriptor
+    void linkFile(const session &client, const std::string &name, const std::string &linkName);
+    // false if there is no such entry
+    bool unlinkFile(const session &client, const std::string &name);
+    bool removeDirectory(const session &client, const std::string &name);
+    void changeDirectory(session &client, const std::string &path);
+    std::string workingDirectory(session &client);
+
     void mount(arguments str);
     void umount();
 
     void filestat(arguments arg, outputStream out);
-    void ls(outputStream out);
+    void df(arguments arg, outputStream out);
+    // paramethers: [-l] [-p prefix]
+    void ls(arguments arg, outputStream out);
 
+    // paramethers: [-c] name, -c creates compressed file
     void create(arguments arg);
     void open(arguments arg, outputStream out);
     void close(arguments arg, outputStream out);
 
-    void read(arguments, outputStream);
-    void write(arguments);
+    // paramethers: descriptor size
+    void read(arguments arg, outputStream out);
+    // paramethers: descriptor data
+    void write(arguments arg, outputStream out);
+    // paramethers: descriptor
+    void flush(arguments arg, outputStream out);
+    // paramethers: descriptor offset
+    void seek(arguments arg, outputStream out);
+    // paramethers: descriptor offset
+    void seekData(arguments arg, outputStream out);
+    // paramethers: descriptor offset
+    void seekHole(arguments arg, outputStream out);
+
+    openedFileDescriptor_tp openFile(const std::string &path);
+    openedFileDescriptor_tp openFile(const session &client, const std::string &path);
+    void closeFile(openedFileDescriptor_tp fd);
+
+    /**
+     * @brief read from opened file current offset, moves offset
+     * @return bytes read, less than size at the end of file
+     */
+    uint64_t readFile(openedFileDescriptor_tp fd, char *buffer, uint64_t size);
+    /**
+     * @brief write to opened file current offset, moves offset.
+     * Small writes are buffered in handle, blocks are allocated at flush or close time.
+     * @return bytes written, less than size if file system is full
+     */
+    uint64_t writeFile(openedFileDescriptor_tp fd, const char *buffer, uint64_t size);
+    /**
+     * @brief write buffered data, allocates blocks for it contiguously
+     * @throw no_enough_fs_entry if buffered data does not fit, it is dropped
+     */
+    void flushFile(openedFileDescriptor_tp fd);
+    void seekFile(openedFileDescriptor_tp fd, openedFileOffset_tp offset);
+    /**
+     * @brief move to first data offset >= offset, not allocated blocks are holes
+     * @throw file_system_exception if there is no data after offset
+     */
+    openedFileOffset_tp seekFileData(openedFileDescriptor_tp fd, openedFileOffset_tp offset);
+    /**
+     * @brief move to first hole offset >= offset, end of file is a hole
+     */
+    openedFileOffset_tp seekFileHole(openedFileDescriptor_tp fd, openedFileOffset_tp offset);
+    /**
+     * @brief shrink frees blocks beyond size, grow makes a hole without allocation
+     */
+    void truncateFile(descriptorIndex_tp fileDescriptor, uint64_t size);
+    /**
+     * @brief create file which shares data blocks with source, blocks are copied on write
+     */
+    void cloneFile(const session &client, descriptorIndex_tp source, const std::string &name);
+
+    struct dedupeResult {
+        uint64_t scannedBlocks = 0;
+        uint64_t mergedBlocks = 0;      // replaced with equal block of other file
+        uint64_t zeroBlocks = 0;        // replaced with hole
+        uint64_t releasedBlocks = 0;
+    };
+    /**
+     * @brief merge equal data blocks of all files, they are shared as cloned blocks
+     */
+    dedupeResult dedupeFiles();
+    /**
+     * @brief written whole blocks are merged with equal blocks known from previous writes and dedupeFiles()
+     */
+    void setInlineDedupe(bool enabled);
+
+    struct statistics {
+        uint64_t blockSize;
+        uint64_t totalBlocks;       // data blocks
+        uint64_t freeBlocks;
+        uint64_t totalDescriptors;
+        uint64_t freeDescriptors;
+    };
+    /**
+     * @brief capacity from header counters of committed transactions, nothing is read
+     */
+    statistics statFS() const;
+    /**
+     * @brief check file system structure, descriptor blocks are checked by parallel threads
+     * @param repair fix bitmap, references counters, directories sizes, shared blocks counters and free counters
+     */
+    ConsistencyChecker::report checkFileSystem(bool repair);
 
     void link(arguments arg);
     void unlink(arguments arg, outputStream out);
 
-    void truncate(arguments str);
+    // paramethers: path size
+    void truncate(arguments arg, outputStream out);
+    // paramethers: source destination, destination is created in current directory
+    void clone(arguments arg, outputStream out);
+    // paramethers: [-i on|off], -i switches deduplication of written blocks
+    void dedupe(arguments arg, outputStream out);
+    // paramethers: [-r], -r repairs found problems
+    void check(arguments arg, outputStream out);
 
+    // paramethers: [-b] name, -b creates B+tree directory
     void mkdir(arguments arg);
     void rmdir(arguments arg, outputStream out);
 
@@ -62,6 +264,13 @@ public:
 
 private:
     void fileFormatChanged();
+    // scan bitmap and descriptors, counters of header could miss changes before crash
+    void recountFreeCounters();
+    // duplicated not shared blocks and entries with bad descriptors are not repaired
+    void repairFileSystem(const ConsistencyChecker::report &report);
+    // header is changed when table is created, it is done with exclusive mount lock
+    void ensureBlockReferenceTable();
+    void createBlockReferenceTable();
 
     std::shared_ptr<FormatedFileAccessor> _fsFile;
 
@@ -69,51 +278,242 @@ private:
     DescriptorsArea _descriptors;
     DataArea _dataBlocks;
 
-    descriptorIndex_tp _currentFolder;
+    session _consoleSession;
+
+    static constexpr size_t directoryLockStripes = 256;
+    static constexpr size_t descriptorLockStripes = 256;
+    using directoryLocks_tp = LockTable<std::shared_timed_mutex, directoryLockStripes>;
+    using descriptorLocks_tp = LockTable<std::mutex, descriptorLockStripes>;
+
+    mutable std::shared_timed_mutex _mountLock;
+    directoryLocks_tp _directoryLocks;
+    descriptorLocks_tp _descriptorLocks;
 
     // TODO: arguments pattern
     void checkArgumentsCount(arguments arg, size_t minArgumentsCount) const;
     void checkFilename(const string &filename) const;
 
-    descriptorIndex_tp currentDirectory() const;
+    descriptorIndex_tp currentDirectory(const session &client) const;
 
     const FSHeader &header() const;
 
-    void allocAndAppendDescriptorToCurrentFolder(const FSDescriptor &descriptor,const std::string &name);
+    descriptorIndex_tp allocAndAppendDescriptorToDirectory(descriptorIndex_tp directory, const FSDescriptor &descriptor, const std::string &name);
+    descriptorIndex_tp allocDescriptor(const FSDescriptor &descriptor);
 
-    void addDescriptorToDirectory(descriptorIndex_tp folderDescriptor, descriptorIndex_tp folderElementDescriptor, const std::string &name);
+    /**
+     * @brief add entry, directory must be locked exclusively
+     * @param newDescriptor if not null, it is allocated after name check instead of folderElementDescriptor
+     * @throw file_system_exception if name exists
+     * @return descriptor of entry
+     */
+    descriptorIndex_tp addDescriptorToDirectory(descriptorIndex_tp folderDescriptor, descriptorIndex_tp folderElementDescriptor,
+                                                const std::string &name, const FSDescriptor *newDescriptor = nullptr);
+    // removed directory could be target of operation which waited for its lock
+    void checkLiveDirectory(descriptorIndex_tp directoryDescriptorIndex, const FSDescriptor &directory) const;
 
     bool removeDescriptorFromDirectory(descriptorIndex_tp folderDescriptor, DescriptorVariant type, const std::string &name);
+    void checkRemovedType(const std::string &name, DescriptorVariant type, DescriptorVariant expectedType) const;
+    // updates caches
+    void directoryEntryRemoved(descriptorIndex_tp directoryDescriptorIndex, const std::string &name,
+                               descriptorIndex_tp removedDescriptor, DescriptorVariant removedType);
 
     /**
-     * @brief get directory path from descriptor handle
+     * @brief get directory path from descriptor handle, follows parent links
      * @param handle
      * @return path from root directory (not inclusive root element)
      */
     std::list<string> getDirectoryPathFromDescriptor(descriptorIndex_tp handle);
 
-    blockAddress_tp findAndAllocateFreeDataBlock();
+    // search starts from hint if it is valid data block
+    blockAddress_tp findAndAllocateFreeDataBlock(blockAddress_tp hint = Constants::HEADER_ADDRESS());
+    /**
+     * @brief allocate count blocks, contiguous range if there is one (search starts from hint)
+     * @throw no_enough_fs_entry if there is not enough free blocks, nothing is allocated
+     */
+    std::vector<blockAddress_tp> allocateDataBlocks(uint64_t count, blockAddress_tp hint);
     
-    descriptorIndex_tp getLastPathElementDescriptor(const std::string path);
-    descriptorIndex_tp getLastPathElementDescriptor(const std::vector<std::string> &path, bool isAbsolute);
+    // directories of path are locked one by one, caller must not hold directory locks
+    descriptorIndex_tp getLastPathElementDescriptor(descriptorIndex_tp start, const std::string path);
+    descriptorIndex_tp getLastPathElementDescriptor(descriptorIndex_tp start, const std::vector<std::string> &path, bool isAbsolute);
+
+    /**
+     * @brief find entry in directory, uses dentry cache and directory filters.
+     * Caller holds directory lock.
+     * @return entry descriptor or Constants::INVALID_DESCRIPTOR_ID() if entry not found
+     */
+    descriptorIndex_tp findInDirectory(descriptorIndex_tp directoryDescriptorIndex, const std::string &name);
+
+    struct directoryEntryPlus {
+        string name;
+        descriptorIndex_tp index;
+        FSDescriptor descriptor;
+    };
 
-    DirectoryDescriptorIterator getDirectoryDescriptorIterator(descriptorIndex_tp directoryDescriptorIndex);
+    /**
+     * @brief read all directory entries together with their descriptors,
+     * descriptors are read sorted by block, every block once
+     * @return entries in directory order, "." and ".." included
+     */
+    std::vector<directoryEntryPlus> readDirectoryPlus(descriptorIndex_tp directoryDescriptorIndex, const std::string &prefix = "");
+
+    /**
+     * @brief read directory entries, names starting with prefix only
+     * @return entries in directory order, "." and ".." included if prefix is empty;
+     * entries are sorted by name for tree directory or not empty prefix
+     */
+    std::vector<directoryEntry> readDirectory(descriptorIndex_tp directoryDescriptorIndex, const std::string &prefix = "");
+
+    DirectoryIterator getDirectoryDescriptorIterator(descriptorIndex_tp directoryDescriptorIndex);
+    DirectoryIterator getDirectoryDescriptorIterator(descriptorIndex_tp directoryDescriptorIndex, const FSDescriptor &dirDescriptor);
 
     struct openedFileStream {
-        descriptorIndex_tp s;
-//        openedFileOffset_tp offset;
-//        FSDescriptor currentDescriptor;
-//        openedFileOffset_tp currentDescriptorOffset;
+        descriptorIndex_tp descriptor;
+        openedFileOffset_tp offset;
+        FileBlockMap<FileSystemBlockSource>::cursor cursor;     // last used segment of blocks chain
+
+        // delayed write: data for [dirtyOffset:dirtyOffset + dirtyData.size())
+        openedFileOffset_tp dirtyOffset;
+        std::vector<char> dirtyData;
+        // free blocks reserved for dirty data, they are released at flush
+        uint64_t reservedBlocks;
+        bool dirtyCompressed;
+
+        // last read cluster of compressed file, empty if there is no one
+        uint64_t cachedCluster;
+        std::vector<char> clusterData;
 
+        // cursor and cluster are valid for this _cachedStateGeneration
+        uint64_t generation;
 
         /* flags */
     };
 
-    std::unordered_map<openedFileDescriptor_tp, openedFileStream> _opennedFiles;
-    static constexpr openedFileDescriptor_tp initialFileDescriptor = 1;
-    openedFileDescriptor_tp _lastFreeFileDescriptor = initialFileDescriptor;
+    // opened file with locked descriptor
+    struct lockedFile {
+        std::shared_ptr<openedFileStream> stream;
+        descriptorLocks_tp::guard lock;
+    };
 
-    DescriptorAlgorithms _descriptorAlgo;
+    std::shared_ptr<openedFileStream> openedFile(openedFileDescriptor_tp fd);
+    lockedFile lockOpenedFile(openedFileDescriptor_tp fd);
+    std::vector<std::shared_ptr<openedFileStream>> openedStreams(descriptorIndex_tp descriptor);
+    FSDescriptor openedFileDescriptor(const openedFileStream &stream) const;
+    // write at offset, allocates holes in range at once
+    uint64_t writeFileData(openedFileStream &stream, openedFileOffset_tp offset, const char *buffer, uint64_t size);
+    void allocateFileRange(FileBlockMap<FileSystemBlockSource> &blockMap, openedFileOffset_tp offset, uint64_t size);
+    // block which can be changed in place: hole is allocated, shared block is copied
+    blockAddress_tp writableFileBlock(FileBlockMap<FileSystemBlockSource> &blockMap, uint64_t fileBlock, blockAddress_tp hint, bool *allocated);
+    void copyDataBlock(blockAddress_tp from, blockAddress_tp to);
+    // blocks are transferred by contiguous runs
+    void readScatteredBlocks(const std::vector<blockAddress_tp> &blocks, char *buffer) const;
+    void writeScatteredBlocks(const std::vector<blockAddress_tp> &blocks, const char *buffer);
+
+    // compressed files, cluster is mapped to file blocks [cluster * clusterBlocks : (cluster + 1) * clusterBlocks)
+    void readCompressedData(openedFileStream &stream, FileBlockMap<FileSystemBlockSource> &blockMap,
+                            openedFileOffset_tp offset, char *buffer, uint64_t size);
+    uint64_t writeCompressedData(openedFileStream &stream, FSDescriptor &descriptor,
+                                 openedFileOffset_tp offset, const char *buffer, uint64_t size);
+    void readCluster(FileBlockMap<FileSystemBlockSource> &blockMap, uint64_t cluster, char *data);
+    /**
+     * @brief store cluster in new blocks, old blocks are released
+     * @return hint for next cluster allocation
+     */
+    blockAddress_tp writeCluster(FileBlockMap<FileSystemBlockSource> &blockMap, uint64_t cluster, const char *data, blockAddress_tp hint);
+    // write whole block to writable file block or share equal block instead, returns block used
+    blockAddress_tp writeDedupedBlock(FileBlockMap<FileSystemBlockSource> &blockMap, uint64_t fileBlock, blockAddress_tp address, const char *data);
+
+    // references of blocks shared by cloned files
+    bool hasSharedBlocks() const;
+    bool isBlockShared(blockAddress_tp block);
+    void shareBlock(blockAddress_tp block);
+    // false if block is not shared and can be released
+    bool unshareBlock(blockAddress_tp block);
+    // upper bound of blocks allocated by write of range: data blocks (whole clusters), segments, copies of shared segments
+    uint64_t blocksForWrite(openedFileOffset_tp offset, uint64_t size, bool compressed) const;
+    void flushOpenedFile(openedFileStream &stream);
+    // INVALID_DESCRIPTOR_ID() flushes all files, caller holds descriptor lock or exclusive mount lock
+    void flushFileHandles(descriptorIndex_tp descriptor);
+
+    openedFileOffset_tp seekFileBlock(openedFileDescriptor_tp fd, openedFileOffset_tp offset, bool data);
+    // must be called if segments of file are released or compressed clusters are changed
+    void resetFileCursors(descriptorIndex_tp descriptor);
+    // cached lookups, fingerprints and cursors could describe discarded or repaired state
+    void resetCachedState();
+
+    std::mutex _handlesMutex;
+    HandleTable<std::shared_ptr<openedFileStream>> _opennedFiles;
+    std::atomic<size_t> _dirtyFilesCount{0};
+    static constexpr uint64_t delayedWriteLimit = 1024 * 1024;
+    // large write is split to transactions of this size, smaller if journal record could not hold their segments
+    static constexpr uint64_t maxWriteTransaction = 16 * delayedWriteLimit;
+    // split operation commits its step when journal record has less room, one unit of its work changes fewer metadata blocks
+    static constexpr uint64_t transactionStepBlocks = 16;
+    // true if next unit of split operation could not fit in journal record with changes of active transaction
+    bool transactionFull() const;
+    // cursors of other threads handles are reset lazily
+    std::atomic<uint64_t> _cachedStateGeneration{0};
+
+    // changed with transaction lock
+    FingerprintIndex _fingerprints;
+    std::atomic<bool> _inlineDedupe{false};
+
+    BasicDescriptorAlgorithms<FileSystemBlockSource> _descriptorAlgo;
+
+    static constexpr size_t directoryCacheShards = 16;
+    // lookup caches sharded by directory, shard mutex is held for cache access only
+    struct directoryCache {
+        std::mutex mutex;
+        DentryCache entries;
+        std::unordered_map<descriptorIndex_tp, DirectoryBloomFilter> filters;
+    };
+    std::array<directoryCache, directoryCacheShards> _directoryCaches;
+    directoryCache &cacheOf(descriptorIndex_tp directory);
 };
 
+TypedBufferLocker<FSDescriptorDataPart> FileSystemBlockSource::readSegment(blockAddress_tp block) const
+{
+    return _fs->_dataBlocks.readData<FSDescriptorDataPart>(block, SyncType::ReadWrite);
+}
+
+template<typename T>
+TypedBufferLocker<T> FileSystemBlockSource::readBlock(blockAddress_tp block, SyncType type) const
+{
+    return _fs->_dataBlocks.readData<T>(block, type);
+}
+
+void FileSystemBlockSource::updateDescriptor(descriptorIndex_tp descriptorIndex, const FSDescriptor &descriptor) const
+{
+    _fs->_descriptors.updateDescriptor(descriptorIndex, descriptor);
+}
+
+blockAddress_tp FileSystemBlockSource::allocBlock() const
+{
+    return _fs->findAndAllocateFreeDataBlock();
+}
+
+void FileSystemBlockSource::deallocBlock(blockAddress_tp block) const
+{
+    _fs->_bitMap.set(block, false);
+}
+
+bool FileSystemBlockSource::hasSharedBlocks() const
+{
+    return _fs->hasSharedBlocks();
+}
+
+bool FileSystemBlockSource::isBlockShared(blockAddress_tp block) const
+{
+    return _fs->isBlockShared(block);
+}
+
+void FileSystemBlockSource::shareBlock(blockAddress_tp block) const
+{
+    _fs->shareBlock(block);
+}
+
+bool FileSystemBlockSource::unshareBlock(blockAddress_tp block) const
+{
+    return _fs->unshareBlock(block);
+}
+
 #endif // FILESYSTEM_H
@@ -2,6 +2,7 @@
 
 #include "fileaccessor.h"
 
+#include <algorithm>
 #include <cassert>
 
 FileSystemArea::FileSystemArea(shared_ptr<FormatedFileAccessor> fsFile) :
@@ -73,6 +74,69 @@ FSDescriptor DescriptorsArea::getDescriptor(descriptorIndex_tp descriptorIndex,
     return block->descriptors[descriptorBlockPos.second];
 }
 
+std::vector<FSDescriptor> DescriptorsArea::getDescriptors(const std::vector<descriptorIndex_tp> &indices) const
+{
+    struct position {
+        blockAddress_tp block;
+        uint64_t indexInBlock;
+        size_t resultIndex;
+    };
+
+    std::vector<position> positions;
+    positions.reserve(indices.size());
+    for(size_t i = 0; i < indices.size(); i++) {
+        auto pos = descriptorPosFromBlock(indices[i]);
+        positions.push_back({pos.first, pos.second, i});
+    }
+    std::sort(positions.begin(), positions.end(), [](const position &a, const position &b) {
+        return a.block < b.block;
+    });
+
+    std::vector<FSDescriptor> result(indices.size());
+    TypedBufferLocker<FSDescriptorsContainerBlock> block;
+    blockAddress_tp currentBlock = Constants::HEADER_ADDRESS();
+    for(const position &pos : positions) {
+        if(pos.block != currentBlock) {
+            block = file()->read<FSDescriptorsContainerBlock>(pos.block, SyncType::ReadOnly);
+            currentBlock = pos.block;
+        }
+        result[pos.resultIndex] = block->descriptors[pos.indexInBlock];
+    }
+    return result;
+}
+
+std::vector<descriptorIndex_tp> DescriptorsArea::findDescriptors(DescriptorVariant type) const
+{
+    std::vector<descriptorIndex_tp> result;
+    for(blockAddress_tp address = areaBegin(); address <= areaEnd(); address++) {
+        TypedBufferLocker<FSDescriptorsContainerBlock> block =
+                file()->read<FSDescriptorsContainerBlock>(address, SyncType::ReadOnly);
+        for(uint64_t i = 0; i < header().descriptorsInBlock(); i++) {
+            descriptorIndex_tp index = (address - areaBegin()) * header().descriptorsInBlock() + i;
+            if(index != Constants::INVALID_DESCRIPTOR_ID() && block->descriptors[i].type == type) {
+                result.push_back(index);
+            }
+        }
+    }
+    return result;
+}
+
+uint64_t DescriptorsArea::countDescriptors(DescriptorVariant type) const
+{
+    uint64_t count = 0;
+    for(blockAddress_tp address = areaBegin(); address <= areaEnd(); address++) {
+        TypedBufferLocker<FSDescriptorsContainerBlock> block =
+                file()->read<FSDescriptorsContainerBlock>(address, SyncType::ReadOnly);
+        uint64_t first = (address == areaBegin()) ? 1 : 0;     // INVALID_DESCRIPTOR_ID()
+        for(uint64_t i = first; i < header().descriptorsInBlock(); i++) {
+            if(block->descriptors[i].type == type) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
 void DescriptorsArea::updateDescriptor(descriptorIndex_tp descriptorIndex, const FSDescriptor &descriptor)
 {
     auto descriptorBlockPos = descriptorPosFromBlock(descriptorIndex);
@@ -106,13 +170,16 @@ descriptorIndex_tp DescriptorsArea::appendDescriptor(blockAddress_tp freePlaceAd
         }
     }
 
+    if(block->descriptors[freeDescriptor].type == DescriptorVariant::None) {
+        file()->changeFreeCounters(0, -1);
+    }
     block->descriptors[freeDescriptor] = descriptor;
 
-    if((freeDescriptor + 1) == header().descriptorsInBlock()) {
+    if((freeDescriptor + 1) == header().descriptorsInBlock() && filled != nullptr) {
         *filled = true;
     }
 
-    return freeDescriptor;
+    return blockPosToDescriptorIndex(freePlaceAddress, freeDescriptor);
 }
 
 blockAddress_tp DescriptorsArea::areaBegin() const
@@ -125,21 +192,6 @@ blockAddress_tp DescriptorsArea::areaEnd() const
     return header().descriptorsEnd();
 }
 
-void DescriptorsArea::initBlocks()
-{
-    file()->clearBlocks(areaBegin(), areaEnd());
-//    std::unique_ptr<FSDescriptorsContainerBlock> pureDescriptorBlock(
-//                reinterpret_cast<FSDescriptorsContainerBlock*>(new char[header().blockByteSize]));
-
-//    for(size_t i = 0; i < header().descriptorsInBlock(); i++) {
-//        pureDescriptorBlock->descriptors[i].init();
-//    }
-
-//    for(auto i = areaBegin(); i <= areaEnd(); ++i) {
-//        file()->write(i, pureDescriptorBlock.get(), header().blockByteSize);
-//    }
-}
-
 void DescriptorsArea::incrementReference(descriptorIndex_tp index)
 {
     FSDescriptor descriptor = getDescriptor(index);
@@ -176,7 +228,7 @@ std::pair<blockAddress_tp, uint64_t> DescriptorsArea::descriptorPosFromBlock(des
 descriptorIndex_tp DescriptorsArea::blockPosToDescriptorIndex(blockAddress_tp bitMapBlockAddress, uint64_t indexInBlock)
 {
     if(inRange(bitMapBlockAddress) && indexInBlock < header().descriptorsInBlock()) {
-        return bitMapBlockAddress * header().descriptorsInBlock() + indexInBlock;
+        return (bitMapBlockAddress - header().descriptorsBegin()) * header().descriptorsInBlock() + indexInBlock;
     }
     throw std::invalid_argument("Bad argument in DescriptorsArea::blockPosToDescriptorIndex: " + std::to_string(bitMapBlockAddress) + ":" + std::to_string(indexInBlock));
 }
@@ -200,41 +252,90 @@ void BitMapArea::set(blockAddress_tp blockAddr, const bool &value)
 
     TypedBufferLocker<FSBitMapBlock> bitBlock = file()->read<FSBitMapBlock>(localPos.first, SyncType::ReadWrite);
 
+    if(isDataBlock(blockAddr) && bitBlock->get(localPos.second) != value) {
+        file()->changeFreeCounters(value ? -1 : 1, 0);
+    }
     bitBlock->set(localPos.second, value);
 }
 
-blockAddress_tp BitMapArea::findFirstFreeBlock(blockAddress_tp begin, blockAddress_tp end)
+void BitMapArea::setBlocks(std::vector<blockAddress_tp> &blocks, bool value)
+{
+    std::sort(blocks.begin(), blocks.end());
+
+    TypedBufferLocker<FSBitMapBlock> bitBlock;
+    blockAddress_tp currentBitBlock = Constants::HEADER_ADDRESS();
+    int64_t changed = 0;
+    for(blockAddress_tp block : blocks) {
+        auto localPos = bitMapPosFromBlock(block);
+        if(localPos.first != currentBitBlock) {
+            bitBlock = readToBuff<FSBitMapBlock>(localPos.first, SyncType::ReadWrite);
+            currentBitBlock = localPos.first;
+        }
+        if(isDataBlock(block) && bitBlock->get(localPos.second) != value) {
+            changed++;
+        }
+        bitBlock->set(localPos.second, value);
+    }
+    if(changed != 0) {
+        file()->changeFreeCounters(value ? -changed : changed, 0);
+    }
+}
+
+uint64_t BitMapArea::countFree(blockAddress_tp begin, blockAddress_tp end)
 {
     const auto beginBlockAddr  = bitMapPosFromBlock(begin);
     const auto endBitBlockAddr = bitMapPosFromBlock(end);
 
-    if(beginBlockAddr.second != 0) {
-        TypedBufferLocker<FSBitMapBlock> bitBlock = readToBuff<FSBitMapBlock>(beginBlockAddr.first, SyncType::ReadOnly);
-        uint64_t endBit = (beginBlockAddr.first == endBitBlockAddr.first) ? endBitBlockAddr.second + 1 : header().bitsInBitMapBlock();
-        auto offset = bitBlock->findFirstZero(beginBlockAddr.second, endBit);
-        if(offset == endBit) {
-            if(beginBlockAddr.first == endBitBlockAddr.first) {
-                return Constants::HEADER_ADDRESS();
-            }
-        } else {
-            return blockPosFromBitMapPos(beginBlockAddr.first, offset);
-        }
+    uint64_t count = 0;
+    for(auto i = beginBlockAddr.first; i <= endBitBlockAddr.first; i++) {
+        TypedBufferLocker<FSBitMapBlock> bitBlock = readToBuff<FSBitMapBlock>(i, SyncType::ReadOnly);
+        uint64_t beginBit = (i == beginBlockAddr.first) ? beginBlockAddr.second : 0;
+        uint64_t endBit = (i == endBitBlockAddr.first) ? endBitBlockAddr.second + 1 : header().bitsInBitMapBlock();
+        count += bitBlock->countZeros(beginBit, endBit);
     }
+    return count;
+}
 
+blockAddress_tp BitMapArea::findFirstFreeBlock(blockAddress_tp begin, blockAddress_tp end)
+{
+    const auto beginBlockAddr  = bitMapPosFromBlock(begin);
+    const auto endBitBlockAddr = bitMapPosFromBlock(end);
 
-    for(auto i = beginBlockAddr.first + 1; i < endBitBlockAddr.first; i++) {
+    for(auto i = beginBlockAddr.first; i <= endBitBlockAddr.first; i++) {
         TypedBufferLocker<FSBitMapBlock> bitBlock = readToBuff<FSBitMapBlock>(i, SyncType::ReadOnly);
-        auto offset = bitBlock->findFirstZero(0, header().bitsInBitMapBlock());
-        if(offset != header().bitsInBitMapBlock()) {
+        uint64_t beginBit = (i == beginBlockAddr.first) ? beginBlockAddr.second : 0;
+        uint64_t endBit = (i == endBitBlockAddr.first) ? endBitBlockAddr.second + 1 : header().bitsInBitMapBlock();
+        auto offset = bitBlock->findFirstZero(beginBit, endBit);
+        if(offset != endBit) {
             return blockPosFromBitMapPos(i, offset);
         }
     }
 
-    if(endBitBlockAddr.second != 0) {
-        TypedBufferLocker<FSBitMapBlock> bitBlock = readToBuff<FSBitMapBlock>(end, SyncType::ReadOnly);
-        auto offset = bitBlock->findFirstZero(0, endBitBlockAddr.second + 1);       // .second != limits.max()
-        if(offset != endBitBlockAddr.second + 1) {
-            return blockPosFromBitMapPos(endBitBlockAddr.first, offset);
+    return Constants::HEADER_ADDRESS();
+}
+
+blockAddress_tp BitMapArea::findFreeRange(blockAddress_tp begin, blockAddress_tp end, uint64_t count)
+{
+    const auto beginBlockAddr  = bitMapPosFromBlock(begin);
+    const auto endBitBlockAddr = bitMapPosFromBlock(end);
+
+    blockAddress_tp rangeBegin = Constants::HEADER_ADDRESS();
+    uint64_t rangeLength = 0;
+    for(auto i = beginBlockAddr.first; i <= endBitBlockAddr.first; i++) {
+        TypedBufferLocker<FSBitMapBlock> bitBlock = readToBuff<FSBitMapBlock>(i, SyncType::ReadOnly);
+        uint64_t beginBit = (i == beginBlockAddr.first) ? beginBlockAddr.second : 0;
+        uint64_t endBit = (i == endBitBlockAddr.first) ? endBitBlockAddr.second + 1 : header().bitsInBitMapBlock();
+        for(uint64_t bit = beginBit; bit < endBit; bit++) {
+            if(bitBlock->get(bit)) {
+                rangeLength = 0;
+                continue;
+            }
+            if(rangeLength == 0) {
+                rangeBegin = blockPosFromBitMapPos(i, bit);
+            }
+            if(++rangeLength == count) {
+                return rangeBegin;
+            }
         }
     }
 
@@ -251,9 +352,9 @@ blockAddress_tp BitMapArea::areaEnd() const
     return header().bitMapEnd();
 }
 
-void BitMapArea::initBlocks()
+bool BitMapArea::isDataBlock(blockAddress_tp block) const
 {
-    file()->clearBlocks(areaBegin(), areaEnd());
+    return block >= header().dataBlockBegin() && block <= header().dataBlockEnd();
 }
 
 std::pair<blockAddress_tp, uint64_t> BitMapArea::bitMapPosFromBlock(blockAddress_tp blockAddress)
@@ -300,3 +401,22 @@ void DataArea::writeDataFromBuffer(blockAddress_tp block, BlockBufferLocker &loc
     file()->write(block, locker.atBlock(), header().blockByteSize);
 }
 
+
+void DataArea::readDataBlocks(blockAddress_tp first, char *buffer, uint64_t count) const
+{
+    checkDataRange(first, count);
+    file()->readBlocks(first, buffer, count);
+}
+
+void DataArea::writeDataBlocks(blockAddress_tp first, const char *buffer, uint64_t count)
+{
+    checkDataRange(first, count);
+    file()->writeBlocks(first, buffer, count);
+}
+
+void DataArea::checkDataRange(blockAddress_tp first, uint64_t count) const
+{
+    if(count == 0 || !inRange(first) || !inRange(first + count - 1)) {
+        throw std::invalid_argument("Bad blocks in DataArea: " + std::to_string(first) + ":" + std::to_string(count));
+    }
+}
@@ -2,6 +2,7 @@
 #define FILESYSTEMAREA_H
 
 #include <memory>
+#include <vector>
 using std::shared_ptr;
 
 class FileSystem;
@@ -47,17 +48,23 @@ public:
     BitMapArea(shared_ptr<FormatedFileAccessor> fsFile);
 
     bool get(blockAddress_tp block);
+    // changes of data blocks bits update free blocks counter
     void set(blockAddress_tp blockAddr, const bool &value);
+    // every bitmap block is changed once, blocks are sorted
+    void setBlocks(std::vector<blockAddress_tp> &blocks, bool value);
+    // free blocks in [areaBegin:areaEnd], whole range is read
+    uint64_t countFree(blockAddress_tp areaBegin, blockAddress_tp areaEnd);
 
     // inclusive
     blockAddress_tp findFirstFreeBlock(blockAddress_tp areaBegin, blockAddress_tp areaEnd);
+    // first of count free sequential blocks in [areaBegin:areaEnd], HEADER_ADDRESS() if there is no such range
+    blockAddress_tp findFreeRange(blockAddress_tp areaBegin, blockAddress_tp areaEnd, uint64_t count);
 
     virtual blockAddress_tp areaBegin() const;
     virtual blockAddress_tp areaEnd() const;
 
-    virtual void initBlocks();
-
 protected:
+    bool isDataBlock(blockAddress_tp block) const;
     std::pair<blockAddress_tp, uint64_t> bitMapPosFromBlock(blockAddress_tp blockAddress);
     blockAddress_tp blockPosFromBitMapPos(blockAddress_tp bitMapBlockAddress, uint64_t offsetInBlock);
 };
@@ -67,15 +74,25 @@ public:
     DescriptorsArea(shared_ptr<FormatedFileAccessor> fsFile);
 
     FSDescriptor getDescriptor(descriptorIndex_tp descriptorIndex, DescriptorVariant type = DescriptorVariant::Any) const;
+    /**
+     * @brief read many descriptors, every descriptors block is read once
+     * @return descriptors in the same order as indices
+     */
+    std::vector<FSDescriptor> getDescriptors(const std::vector<descriptorIndex_tp> &indices) const;
+    /**
+     * @brief indices of all descriptors with type, whole area is read
+     */
+    std::vector<descriptorIndex_tp> findDescriptors(DescriptorVariant type) const;
+    // whole area is read, not valid descriptor 0 is not counted
+    uint64_t countDescriptors(DescriptorVariant type) const;
     void updateDescriptor(descriptorIndex_tp descriptorIndex, const FSDescriptor &descriptor);
 
+    // free descriptors counter is updated
     descriptorIndex_tp appendDescriptor(blockAddress_tp freePlaceAddress, const FSDescriptor &descriptor, bool *filled = nullptr);
 
     virtual blockAddress_tp areaBegin() const;
     virtual blockAddress_tp areaEnd() const;
 
-    virtual void initBlocks();
-
     void incrementReference(descriptorIndex_tp index);
     void decrementReference(descriptorIndex_tp index);
 
@@ -101,6 +118,13 @@ public:
     }
 
     void writeDataFromBuffer(blockAddress_tp block, BlockBufferLocker &locker);
+
+    // direct transfer of blocks [first:first + count), bypasses block buffers
+    void readDataBlocks(blockAddress_tp first, char *buffer, uint64_t count) const;
+    void writeDataBlocks(blockAddress_tp first, const char *buffer, uint64_t count);
+
+private:
+    void checkDataRange(blockAddress_tp first, uint64_t count) const;
 };
 
 
@@ -1,6 +1,8 @@
 #include "filesystemblock.h"
 #include "project_exceptions.h"
 
+#include <algorithm>
+#include <bitset>
 #include <cassert>
 #include <type_traits>
 
@@ -24,6 +26,23 @@ uint64_t FSBitMapBlock::findFirstZero(uint64_t begin, uint64_t maxBits) const
     return maxBits;
 }
 
+uint64_t FSBitMapBlock::countZeros(uint64_t begin, uint64_t end) const
+{
+    uint64_t zeros = 0;
+    uint64_t i = begin;
+    for(; i < end && (i & 7) != 0; i++) {
+        zeros += get(i) ? 0 : 1;
+    }
+    // whole bytes
+    for(; i + 8 <= end; i += 8) {
+        zeros += 8 - std::bitset<8>(bits[i / 8]).count();
+    }
+    for(; i < end; i++) {
+        zeros += get(i) ? 0 : 1;
+    }
+    return zeros;
+}
+
 void FSBitMapBlock::set(uint64_t bit, bool data)
 {
     if(data) {
@@ -99,17 +118,22 @@ void directoryEntry::set(descriptorIndex_tp descriptor, std::string name, filena
         name = name.substr(0, maxLength);
     }
 
-    uint64_t i = 0;
-    for(; i < name.size(); i++) {
-        this->__name[i] = name[i];
-    }
-    if(i != maxLength) {
-        this->__name[i] = '\0';
-    }
+    // zero padding allows compare full name with PaddedName
+    memset(this->__name, 0, sizeof(this->__name));
+    memcpy(this->__name, name.data(), std::min(name.size(), sizeof(this->__name)));
 
     this->descriptor = descriptor;
 }
 
+PaddedName::PaddedName(const std::string &name, filenameLength_tp maxFilename)
+{
+    words[0] = 0;
+    words[1] = 0;
+    if(!name.empty() && name.size() <= maxFilename && name.size() <= sizeof(words)) {
+        memcpy(words, name.data(), name.size());
+    }
+}
+
 std::string directoryEntry::name(filenameLength_tp maxFilename) const
 {
     std::string result;
@@ -150,6 +174,28 @@ void directoryEntry::clear()
 }
 
 
+void FSDescriptor::setDirectoryName(const std::string &name, filenameLength_tp maxLength)
+{
+    assert(name.size() <= maxLength);    // for debug
+
+    uint64_t i = 0;
+    for(; i < name.size() && i < maxLength; i++) {
+        __directoryName[i] = name[i];
+    }
+    if(i != maxLength) {
+        __directoryName[i] = '\0';
+    }
+}
+
+std::string FSDescriptor::directoryName(filenameLength_tp maxLength) const
+{
+    std::string result;
+    for(uint64_t i = 0; i < maxLength && __directoryName[i] != '\0'; i++) {
+        result += __directoryName[i];
+    }
+    return result;
+}
+
 bool FSDescriptor::isHaveExtendedSegment()
 {
     return nextDataSegment != Constants::HEADER_ADDRESS();
@@ -184,6 +230,9 @@ std::string FSDescriptor::toString(const FSHeader &data) const
         break;
     case DescriptorVariant::Directory:
         res += "\nParent: " + to_string(parent);
+        res += "\nName: " + directoryName(data.filenameLength);
+        res += "\nLast segment: " + to_string(lastSegment);
+        res += "\nPre last segment: " + to_string(preLastSegment);
         for(uint64_t i = 0; i < firstFreeElementIndex && i < data.entriesInDirectoryDescriptor; i++) {
             res += "\n  " + directoryEntries[i].toString(data.filenameLength);
         }
@@ -201,6 +250,7 @@ std::string FSDescriptorDataPart::toString(const FSHeader &data) const
     std::string res;
     res += "'FSDescriptorDataPart' block";
     res += "\nNext segment: " + std::to_string(nextSegment);
+    res += "\nPrev segment: " + std::to_string(prevSegment);
 
     res += "/*TODO: other data;*/";
     res += "Folder data: \n";
@@ -238,6 +288,27 @@ std::string FSDescriptorsContainerBlock::toString(const FSHeader &data) const
 }
 
 
+std::string FSDirectoryTreeNode::toString(const FSHeader &data) const
+{
+    std::string res;
+    res += "'FSDirectoryTreeNode' block";
+    res += isLeaf ? "\nLeaf" : "\nInner node";
+    res += "\nCount: " + std::to_string(count);
+    if(isLeaf) {
+        res += "\nNext leaf: " + std::to_string(nextLeaf);
+        res += "\nPrev leaf: " + std::to_string(prevLeaf);
+        for(uint32_t i = 0; i < count; i++) {
+            res += "\n  " + entries[i].toString(data.filenameLength);
+        }
+    } else {
+        res += "\nFirst child: " + std::to_string(firstChild);
+        for(uint32_t i = 0; i < count; i++) {
+            res += "\n  " + std::string(items[i].key, strnlen(items[i].key, sizeof(items[i].key))) + "\t" + std::to_string(items[i].child);
+        }
+    }
+    return res + "\n";
+}
+
 std::string FSDataBlock::toString(const FSHeader &) const
 {
     return "'FSDataBlock'\n";
@@ -0,0 +1,97 @@
+#ifndef FINGERPRINTINDEX_H
+#define FINGERPRINTINDEX_H
+
+#include "constants.h"
+
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+/**
+ * @brief The FingerprintIndex class
+ * Data block content fingerprints for deduplication. Fingerprint is a fast not cryptographic hash,
+ * equal fingerprints do not mean equal blocks, content must be compared before merge.
+ * One block is kept for every fingerprint. Index is not stored in file system.
+ */
+class FingerprintIndex
+{
+public:
+    using fingerprint_tp = uint64_t;
+
+    static fingerprint_tp fingerprint(const void *block, size_t size)
+    {
+        const unsigned char *data = static_cast<const unsigned char *>(block);
+        // xxHash64 round for every 8 bytes
+        constexpr uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+        constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+        uint64_t hash = size * prime1;
+        size_t i = 0;
+        for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+            word *= prime2;
+            word = (word << 31) | (word >> 33);
+            word *= prime1;
+            hash ^= word;
+            hash = ((hash << 27) | (hash >> 37)) * prime1 + prime2;
+        }
+        for(; i < size; i++) {
+            hash = (hash ^ data[i]) * prime1;
+        }
+        hash ^= hash >> 33;
+        hash *= prime2;
+        hash ^= hash >> 29;
+        return hash;
+    }
+
+    /**
+     * @return block with fingerprint or Constants::HEADER_ADDRESS()
+     */
+    blockAddress_tp find(fingerprint_tp fingerprint) const
+    {
+        auto it = _blocks.find(fingerprint);
+        return it == _blocks.end() ? Constants::HEADER_ADDRESS() : it->second;
+    }
+
+    /**
+     * @brief set block for fingerprint, previous block of fingerprint and previous fingerprint of block are removed
+     */
+    void insert(fingerprint_tp fingerprint, blockAddress_tp block)
+    {
+        erase(block);
+        auto it = _blocks.find(fingerprint);
+        if(it != _blocks.end()) {
+            _fingerprints.erase(it->second);
+        }
+        _blocks[fingerprint] = block;
+        _fingerprints[block] = fingerprint;
+    }
+
+    // must be called when block is released
+    void erase(blockAddress_tp block)
+    {
+        auto it = _fingerprints.find(block);
+        if(it == _fingerprints.end()) {
+            return;
+        }
+        _blocks.erase(it->second);
+        _fingerprints.erase(it);
+    }
+
+    void clear()
+    {
+        _blocks.clear();
+        _fingerprints.clear();
+    }
+
+    size_t size() const
+    {
+        return _blocks.size();
+    }
+
+private:
+    std::unordered_map<fingerprint_tp, blockAddress_tp> _blocks;
+    std::unordered_map<blockAddress_tp, fingerprint_tp> _fingerprints;
+};
+
+#endif // FINGERPRINTINDEX_H
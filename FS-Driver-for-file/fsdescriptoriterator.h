@@ -1,53 +1,68 @@
 #ifndef FSDESCRIPTORITERATOR_H
 #define FSDESCRIPTORITERATOR_H
 
+#include "project_exceptions.h"
 #include "filesystemblock.h"
 #include "blockbuffer.h"
 #include "constants.h"
 
 #include <iterator>
 #include <functional>
+#include <memory>
+#include <stdexcept>
+#include <cassert>
+#include <tuple>
 
-class DescriptorAlgorithms;
+template<typename BlockSource>
+class BasicDescriptorAlgorithms;
 
 // TODO: Create iterator for all descriptors types
 /**
- * You need flush all changes in iterator element data
+ * BlockSource gives access to file system blocks, it is copied to every iterator,
+ * so it must be cheap to copy. Required methods:
+ *   TypedBufferLocker<FSDescriptorDataPart> readSegment(blockAddress_tp block) const;
+ *   void updateDescriptor(descriptorIndex_tp descriptorIndex, const FSDescriptor &descriptor) const;
+ *   blockAddress_tp allocBlock() const;
+ *   void deallocBlock(blockAddress_tp block) const;
+ *
+ * Segments are read lazily, copy of iterator does not read blocks.
+ * You need flush all changes in iterator element data, iterator does not write anything by itself.
  */
-class DirectoryDescriptorIterator : public std::iterator<std::forward_iterator_tag, directoryEntry>
+template<typename BlockSource>
+class BasicDirectoryDescriptorIterator : public std::iterator<std::forward_iterator_tag, directoryEntry>
 {
-    friend class DescriptorAlgorithms;
-
-    using readSegmentFunction_tp = std::function<TypedBufferLocker<FSDescriptorDataPart>(blockAddress_tp)>;
-    using updateDescriptorFunction_tp = const std::function<void(const FSDescriptor&)>;
+    template<typename> friend class BasicDescriptorAlgorithms;
 
+public:
     using reference = directoryEntry&;
     using pointer   = directoryEntry*;
 
-public:
-    DirectoryDescriptorIterator(descriptorIndex_tp descriptorIndex,
-                                FSDescriptor descriptorBlockData,
-                                const directoryEntryIndex_tp entriesInDescriptor,
-                                const directoryEntryIndex_tp entriesInBlock,
-                                readSegmentFunction_tp readFunction);
+    BasicDirectoryDescriptorIterator(descriptorIndex_tp descriptorIndex,
+                                     FSDescriptor descriptorBlockData,
+                                     const directoryEntryIndex_tp entriesInDescriptor,
+                                     const directoryEntryIndex_tp entriesInBlock,
+                                     BlockSource source,
+                                     bool syncDescriptor = true);
 
-    DirectoryDescriptorIterator(descriptorIndex_tp descriptorIndex,
-                                FSDescriptor descriptorBlockData,
-                                const directoryEntryIndex_tp entriesInDescriptor,
-                                const directoryEntryIndex_tp entriesInBlock,
-                                readSegmentFunction_tp readFunction,
-                                updateDescriptorFunction_tp updateFumtion);
+    BasicDirectoryDescriptorIterator(const BasicDirectoryDescriptorIterator &other);
+
+    BasicDirectoryDescriptorIterator(const BasicDirectoryDescriptorIterator &other, bool syncDescriptor);
 
-    DirectoryDescriptorIterator(const DirectoryDescriptorIterator &other);
+    BasicDirectoryDescriptorIterator(BasicDirectoryDescriptorIterator &&other) = default;
 
-    DirectoryDescriptorIterator(const DirectoryDescriptorIterator &other, bool syncDescriptor);
+    ~BasicDirectoryDescriptorIterator();
 
-    ~DirectoryDescriptorIterator();
+    bool hasNext() const {
+        return _currentIndex + 1 < _descriptorData.firstFreeElementIndex || _currentIndex + 1 == _dotPosition || _currentIndex + 1 == _dotDotPosition;
+    }
 
-    bool hasNext();
+    bool operator == (const BasicDirectoryDescriptorIterator &other) const {
+        return std::tie(_currentIndex, _descriptorHandle) == std::tie(other._currentIndex, other._descriptorHandle);
+    }
 
-    bool operator == (const DirectoryDescriptorIterator &other);
-    bool operator != (const DirectoryDescriptorIterator &other);
+    bool operator != (const BasicDirectoryDescriptorIterator &other) const {
+        return !operator ==(other);
+    }
 
     /**
      * Be careful, synchronization does not happen immediately
@@ -64,10 +79,12 @@ public:
      * @brief operator ->
      * @return
      */
-    pointer operator ->();
+    pointer operator ->() {
+        return &(this->operator *());
+    }
 
-    DirectoryDescriptorIterator &operator++();
-    DirectoryDescriptorIterator operator++(int);
+    BasicDirectoryDescriptorIterator &operator++();
+    BasicDirectoryDescriptorIterator operator++(int);
 
     void flush();
 
@@ -75,26 +92,51 @@ public:
 
     void toLast();
 
-    FSDescriptor descriptor() const;
-    descriptorIndex_tp descriptorHandle() const;
+    FSDescriptor descriptor() const {
+        return _descriptorData;
+    }
 
-private:
+    descriptorIndex_tp descriptorHandle() const {
+        return _descriptorHandle;
+    }
+
+protected:
     static constexpr directoryEntryIndex_tp _badPosition = -3;
     static constexpr directoryEntryIndex_tp _dotPosition = -2;
     static constexpr directoryEntryIndex_tp _dotDotPosition = -1;
     directoryEntry _dotDotEntry;
     directoryEntry _dotEntry;
 
-    bool weInDescriptor() const;
+    bool weInDescriptor() const {
+        return _currentIndex < _entriesInDescriptor || _currentIndex == directoryEntryIndex_tp(-1);
+    }
+
+    directoryEntryIndex_tp currentBlockEntriesLimit() const {
+        return weInDescriptor() ? _entriesInDescriptor : _entriesInBlock;
+    }
+
+    blockAddress_tp currentBlockNextSegmentAddress() {
+        return weInDescriptor() ? _descriptorData.nextDataSegment : currentBlock()->nextSegment;
+    }
+
+    directoryEntry *currentEntryArray() {
+        return weInDescriptor() ? _descriptorData.directoryEntries : currentBlock()->directoryEntries;
+    }
 
-    directoryEntryIndex_tp currentBlockEntriesLimit() const;
-    blockAddress_tp currentBlockNextSegmentAddress() const;
-    directoryEntry *currentEntryArray();
     void setNextAddressInCurrentContainer(blockAddress_tp nextBlock);
 
+    TypedBufferLocker<FSDescriptorDataPart> &currentBlock() {
+        if(!_currentBlock.isValid()) {
+            _currentBlock = _source.readSegment(_currentBlockAddress);
+        }
+        return _currentBlock;
+    }
+
+    void moveToBlock(blockAddress_tp block);
+
     directoryEntryIndex_tp _currentIndex = _badPosition;
     directoryEntryIndex_tp _currentOffsetInBlock = _badPosition;
-    mutable TypedBufferLocker<FSDescriptorDataPart> _currentBlock;
+    TypedBufferLocker<FSDescriptorDataPart> _currentBlock;    // invalid until first access
     blockAddress_tp _currentBlockAddress = Constants::HEADER_ADDRESS();
     blockAddress_tp _prevBlockAddress = Constants::HEADER_ADDRESS();
 
@@ -104,8 +146,7 @@ private:
     FSDescriptor _descriptorData;
     const directoryEntryIndex_tp _entriesInDescriptor;
     const directoryEntryIndex_tp _entriesInBlock;
-    const readSegmentFunction_tp _readSegment;
-    const updateDescriptorFunction_tp _updateDescriptor;
+    BlockSource _source;
 };
 
 struct descriptorAlgorithmCallbacks {
@@ -115,19 +156,338 @@ struct descriptorAlgorithmCallbacks {
     std::function<void(descriptorIndex_tp descriptorIndex, const FSDescriptor&)> updateDescriptor;
 };
 
-class DescriptorAlgorithms {
+/**
+ * @brief The CallbackBlockSource class
+ * BlockSource over std::function callbacks, callbacks are shared between copies
+ */
+class CallbackBlockSource
+{
+public:
+    CallbackBlockSource() = default;
+    explicit CallbackBlockSource(std::shared_ptr<const descriptorAlgorithmCallbacks> callbacks) :
+        _callbacks(callbacks)
+    { }
+
+    TypedBufferLocker<FSDescriptorDataPart> readSegment(blockAddress_tp block) const {
+        return _callbacks->readExtendedSegment(block);
+    }
+
+    void updateDescriptor(descriptorIndex_tp descriptorIndex, const FSDescriptor &descriptor) const {
+        _callbacks->updateDescriptor(descriptorIndex, descriptor);
+    }
+
+    blockAddress_tp allocBlock() const {
+        return _callbacks->allocNewFreeBlock();
+    }
+
+    void deallocBlock(blockAddress_tp block) const {
+        _callbacks->deallocBlock(block);
+    }
+
+private:
+    std::shared_ptr<const descriptorAlgorithmCallbacks> _callbacks;
+};
+
+/**
+ * @brief The DirectoryDescriptorIterator class
+ * Iterator with std::function callbacks
+ */
+class DirectoryDescriptorIterator : public BasicDirectoryDescriptorIterator<CallbackBlockSource>
+{
+    using readSegmentFunction_tp = std::function<TypedBufferLocker<FSDescriptorDataPart>(blockAddress_tp)>;
+    using updateDescriptorFunction_tp = const std::function<void(const FSDescriptor&)>;
+
+public:
+    DirectoryDescriptorIterator(descriptorIndex_tp descriptorIndex,
+                                FSDescriptor descriptorBlockData,
+                                const directoryEntryIndex_tp entriesInDescriptor,
+                                const directoryEntryIndex_tp entriesInBlock,
+                                readSegmentFunction_tp readFunction);
+
+    DirectoryDescriptorIterator(descriptorIndex_tp descriptorIndex,
+                                FSDescriptor descriptorBlockData,
+                                const directoryEntryIndex_tp entriesInDescriptor,
+                                const directoryEntryIndex_tp entriesInBlock,
+                                readSegmentFunction_tp readFunction,
+                                updateDescriptorFunction_tp updateFumtion);
+
+    DirectoryDescriptorIterator(const BasicDirectoryDescriptorIterator<CallbackBlockSource> &other);
+    DirectoryDescriptorIterator(BasicDirectoryDescriptorIterator<CallbackBlockSource> &&other);
+};
+
+template<typename BlockSource>
+class BasicDescriptorAlgorithms {
 public:
-    void deleteEntry(DirectoryDescriptorIterator &it);
+    using iterator_tp = BasicDirectoryDescriptorIterator<BlockSource>;
+
+    void deleteEntry(iterator_tp &it);
     void appendToEnd(descriptorIndex_tp descriptorIndex, FSDescriptor descriptor, directoryEntry entry);
 
-    DirectoryDescriptorIterator iterator(descriptorIndex_tp descriptorIndex, const FSDescriptor &descriptorBlockData, bool syncDescriptor = true) const;
+    iterator_tp iterator(descriptorIndex_tp descriptorIndex, const FSDescriptor &descriptorBlockData, bool syncDescriptor = true) const {
+        return iterator_tp(descriptorIndex, descriptorBlockData, _entriesInDescriptor, _entriesInBlock, _source, syncDescriptor);
+    }
 
-    void setEntriesInfo(directoryEntryIndex_tp entriesInDescriptor, directoryEntryIndex_tp entrienInBlock);
-    void setCallbacks(descriptorAlgorithmCallbacks callbacks);
+    void setEntriesInfo(directoryEntryIndex_tp entriesInDescriptor, directoryEntryIndex_tp entrienInBlock) {
+        _entriesInDescriptor = entriesInDescriptor;
+        _entriesInBlock = entrienInBlock;
+    }
+
+    void setSource(BlockSource source) {
+        _source = source;
+    }
 
     directoryEntryIndex_tp _entriesInDescriptor;
     directoryEntryIndex_tp _entriesInBlock;
-    descriptorAlgorithmCallbacks _callbacks;
+    BlockSource _source;
 };
 
+/**
+ * @brief The DescriptorAlgorithms class
+ * Algorithms with std::function callbacks
+ */
+class DescriptorAlgorithms : public BasicDescriptorAlgorithms<CallbackBlockSource> {
+public:
+    void setCallbacks(descriptorAlgorithmCallbacks callbacks);
+};
+
+
+template<typename BlockSource>
+constexpr directoryEntryIndex_tp BasicDirectoryDescriptorIterator<BlockSource>::_badPosition;
+template<typename BlockSource>
+constexpr directoryEntryIndex_tp BasicDirectoryDescriptorIterator<BlockSource>::_dotPosition;
+template<typename BlockSource>
+constexpr directoryEntryIndex_tp BasicDirectoryDescriptorIterator<BlockSource>::_dotDotPosition;
+
+template<typename BlockSource>
+BasicDirectoryDescriptorIterator<BlockSource>::BasicDirectoryDescriptorIterator(descriptorIndex_tp descriptorIndex, FSDescriptor descriptorBlockData, const directoryEntryIndex_tp entriesInDescriptor, const directoryEntryIndex_tp entriesInBlock, BlockSource source, bool syncDescriptor) :
+    _syncDescriptor(syncDescriptor),
+    _descriptorHandle(descriptorIndex),
+    _descriptorData(descriptorBlockData),
+    _entriesInDescriptor(entriesInDescriptor),
+    _entriesInBlock(entriesInBlock),
+    _source(source)
+{
+    static_assert(sizeof(directoryEntry::__name) >= 3, "filename too small for '..' element.");
+    _dotEntry.set(_descriptorHandle, ".", 2);
+    _dotDotEntry.set(_descriptorData.parent, "..", 3);
+}
+
+// current segment is not copied, it will be read on first access
+template<typename BlockSource>
+BasicDirectoryDescriptorIterator<BlockSource>::BasicDirectoryDescriptorIterator(const BasicDirectoryDescriptorIterator &other) :
+    _dotDotEntry(other._dotDotEntry),
+    _dotEntry(other._dotEntry),
+    _currentIndex(other._currentIndex),
+    _currentOffsetInBlock(other._currentOffsetInBlock),
+    _currentBlockAddress(other._currentBlockAddress),
+    _prevBlockAddress(other._prevBlockAddress),
+    _syncDescriptor(other._syncDescriptor),
+    _descriptorHandle(other._descriptorHandle),
+    _descriptorData(other._descriptorData),
+    _entriesInDescriptor(other._entriesInDescriptor),
+    _entriesInBlock(other._entriesInBlock),
+    _source(other._source)
+{
+}
+
+template<typename BlockSource>
+BasicDirectoryDescriptorIterator<BlockSource>::BasicDirectoryDescriptorIterator(const BasicDirectoryDescriptorIterator &other, bool syncDescriptor) :
+    BasicDirectoryDescriptorIterator(other)
+{
+    _syncDescriptor = syncDescriptor;
+}
+
+template<typename BlockSource>
+BasicDirectoryDescriptorIterator<BlockSource>::~BasicDirectoryDescriptorIterator()
+{
+    // not flushed changes are dropped
+    if(_currentBlock.isValid()) {
+        _currentBlock.setSyncType(SyncType::ReadOnly);
+    }
+}
+
+template<typename BlockSource>
+typename BasicDirectoryDescriptorIterator<BlockSource>::reference BasicDirectoryDescriptorIterator<BlockSource>::operator *()
+{
+    switch (_currentOffsetInBlock) {
+    case _badPosition:
+        throw bad_state_exception("Invalid iterator state.");
+    case _dotPosition:
+        return _dotEntry;
+    case _dotDotPosition:
+        return _dotDotEntry;
+    default:
+        return currentEntryArray()[_currentOffsetInBlock];
+    }
+}
+
+template<typename BlockSource>
+BasicDirectoryDescriptorIterator<BlockSource> &BasicDirectoryDescriptorIterator<BlockSource>::operator++()
+{
+    assert(_currentIndex + 1 != _badPosition);
+
+    if(!hasNext()) {
+        throw std::out_of_range("No such element.");
+    }
+
+    if(_currentOffsetInBlock + 1 == currentBlockEntriesLimit()) {
+        _currentOffsetInBlock = 0;
+        if(!weInDescriptor()) {
+            _prevBlockAddress = _currentBlockAddress;
+        }
+        moveToBlock(currentBlockNextSegmentAddress());
+    } else {
+        _currentOffsetInBlock++;
+    }
+    _currentIndex++;
+
+    return *this;
+}
+
+template<typename BlockSource>
+BasicDirectoryDescriptorIterator<BlockSource> BasicDirectoryDescriptorIterator<BlockSource>::operator++(int)
+{
+    BasicDirectoryDescriptorIterator tmp = *this;
+    this->operator ++();
+    return tmp;
+}
+
+template<typename BlockSource>
+void BasicDirectoryDescriptorIterator<BlockSource>::flush()
+{
+    flushDesciptor();
+    if(_currentBlock.isValid()) {
+        _currentBlock.flush();
+    }
+}
+
+template<typename BlockSource>
+void BasicDirectoryDescriptorIterator<BlockSource>::flushDesciptor()
+{
+    if(_dotEntry.descriptor != _descriptorHandle) {
+        throw bad_state_exception("'Dot entry' has been changed.");
+    }
+    if(_dotDotEntry.descriptor != _descriptorData.parent) {
+        throw bad_state_exception("'DotDot entry' has been changed.");
+    }
+    if(_syncDescriptor) {
+        _source.updateDescriptor(_descriptorHandle, _descriptorData);
+    }
+}
+
+template<typename BlockSource>
+void BasicDirectoryDescriptorIterator<BlockSource>::toLast()
+{
+    // Jump straight to the tail, segments addresses are stored in descriptor
+    directoryEntryIndex_tp elements = _descriptorData.firstFreeElementIndex;
+    if(elements == 0) {
+        _currentIndex = _dotDotPosition;
+        _currentOffsetInBlock = _dotDotPosition;
+        _prevBlockAddress = Constants::HEADER_ADDRESS();
+        moveToBlock(Constants::HEADER_ADDRESS());
+        return;
+    }
+
+    _currentIndex = elements - 1;
+    if(weInDescriptor()) {
+        _currentOffsetInBlock = _currentIndex;
+        _prevBlockAddress = Constants::HEADER_ADDRESS();
+        moveToBlock(Constants::HEADER_ADDRESS());
+    } else {
+        _currentOffsetInBlock = (_currentIndex - _entriesInDescriptor) % _entriesInBlock;
+        _prevBlockAddress = _descriptorData.preLastSegment;
+        moveToBlock(_descriptorData.lastSegment);
+    }
+}
+
+template<typename BlockSource>
+void BasicDirectoryDescriptorIterator<BlockSource>::setNextAddressInCurrentContainer(blockAddress_tp nextBlock)
+{
+    if(weInDescriptor()) {
+        _descriptorData.nextDataSegment = nextBlock;
+    } else {
+        currentBlock()->nextSegment = nextBlock;
+    }
+}
+
+template<typename BlockSource>
+void BasicDirectoryDescriptorIterator<BlockSource>::moveToBlock(blockAddress_tp block)
+{
+    if(block == _currentBlockAddress) {
+        return;
+    }
+    if(_currentBlock.isValid()) {
+        _currentBlock.setSyncType(SyncType::ReadOnly);
+        _currentBlock = TypedBufferLocker<FSDescriptorDataPart>();
+    }
+    _currentBlockAddress = block;
+}
+
+template<typename BlockSource>
+void BasicDescriptorAlgorithms<BlockSource>::deleteEntry(iterator_tp &it)
+{
+    iterator_tp itInEnd(it, false);
+    itInEnd.toLast();
+
+    if(!itInEnd.weInDescriptor() && itInEnd._currentBlockAddress == it._currentBlockAddress) {
+        // both iterators point to the same segment, 'it' owns all changes
+        it.currentEntryArray()[it._currentOffsetInBlock] = it.currentEntryArray()[itInEnd._currentOffsetInBlock];
+    } else {
+        *it = *itInEnd;
+    }
+
+    if(itInEnd._currentOffsetInBlock == 0 && !itInEnd.weInDescriptor()) {
+        blockAddress_tp releasedBlock = itInEnd._currentBlockAddress;
+        blockAddress_tp newLastBlock = itInEnd._prevBlockAddress;
+        assert(it._descriptorData.lastSegment == releasedBlock);
+
+        if(newLastBlock == Constants::HEADER_ADDRESS()) {
+            assert(it._descriptorData.nextDataSegment == releasedBlock);
+            it._descriptorData.nextDataSegment = Constants::HEADER_ADDRESS();
+            it._descriptorData.preLastSegment = Constants::HEADER_ADDRESS();
+        } else if(it._currentBlockAddress == newLastBlock) {
+            assert(it.currentBlock()->nextSegment == releasedBlock);
+            it.currentBlock()->nextSegment = Constants::HEADER_ADDRESS();
+            it._descriptorData.preLastSegment = it.currentBlock()->prevSegment;
+        } else {
+            auto prevBlock = _source.readSegment(newLastBlock);
+
+            assert(prevBlock->nextSegment == releasedBlock);
+            prevBlock->nextSegment = Constants::HEADER_ADDRESS();
+            it._descriptorData.preLastSegment = prevBlock->prevSegment;
+        }
+        it._descriptorData.lastSegment = newLastBlock;
+
+        if(it._currentBlockAddress == releasedBlock) {
+            // 'it' pointed to the removed tail entry
+            it.moveToBlock(Constants::HEADER_ADDRESS());
+        }
+        _source.deallocBlock(releasedBlock);
+    }
+    it._descriptorData.firstFreeElementIndex--;
+    it.flush();
+}
+
+template<typename BlockSource>
+void BasicDescriptorAlgorithms<BlockSource>::appendToEnd(descriptorIndex_tp directoryDescriptorIndex, FSDescriptor directoryDescriptorData, directoryEntry entry)
+{
+    auto it = iterator(directoryDescriptorIndex, directoryDescriptorData);
+    it.toLast();
+    if(it._currentOffsetInBlock + 1 != it.currentBlockEntriesLimit()) {
+        it.currentEntryArray()[it._currentOffsetInBlock + 1] = entry;
+    } else {
+        blockAddress_tp newBlockAddress = _source.allocBlock();
+        auto newBlock = _source.readSegment(newBlockAddress);
+        newBlock->init();
+        newBlock->prevSegment = it._descriptorData.lastSegment;
+        newBlock->directoryEntries[0] = entry;
+        it.setNextAddressInCurrentContainer(newBlockAddress);
+
+        it._descriptorData.preLastSegment = it._descriptorData.lastSegment;
+        it._descriptorData.lastSegment = newBlockAddress;
+    }
+    it._descriptorData.firstFreeElementIndex++;
+    it.flush();
+}
+
 #endif // FSDESCRIPTORITERATOR_H
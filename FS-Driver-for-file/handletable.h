@@ -0,0 +1,125 @@
+#ifndef HANDLETABLE_H
+#define HANDLETABLE_H
+
+#include "project_exceptions.h"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/**
+ * @brief The HandleTable class
+ * Slot array with intrusive free list. Handle is (generation << 32) | (slot + 1),
+ * slot generation is changed on erase, so stale handles are not found after slot reuse.
+ * Handle 0 is never used.
+ */
+template<typename T>
+class HandleTable
+{
+public:
+    using handle_tp = uint64_t;
+
+    handle_tp insert(const T &value)
+    {
+        uint32_t index = _firstFree;
+        if(index == noSlot) {
+            if(_slots.size() >= noSlot) {
+                throw fs_excetion::file_system_exception("You opened too many files.");
+            }
+            index = static_cast<uint32_t>(_slots.size());
+            _slots.push_back(slot());
+        } else {
+            _firstFree = _slots[index].nextFree;
+        }
+
+        slot &s = _slots[index];
+        s.value = value;
+        s.used = true;
+        s.nextFree = noSlot;
+        _size++;
+        return makeHandle(index, s.generation);
+    }
+
+    /**
+     * @return nullptr for not used or stale handle
+     */
+    T *find(handle_tp handle)
+    {
+        slot *s = slotOf(handle);
+        return s == nullptr ? nullptr : &s->value;
+    }
+
+    bool erase(handle_tp handle)
+    {
+        slot *s = slotOf(handle);
+        if(s == nullptr) {
+            return false;
+        }
+        s->value = T();
+        s->used = false;
+        s->generation++;
+        s->nextFree = _firstFree;
+        _firstFree = static_cast<uint32_t>(s - _slots.data());
+        _size--;
+        return true;
+    }
+
+    template<typename Visitor>
+    void forEach(Visitor visitor)
+    {
+        for(slot &s : _slots) {
+            if(s.used) {
+                visitor(s.value);
+            }
+        }
+    }
+
+    void clear()
+    {
+        // generations are kept, old handles stay invalid
+        for(size_t i = 0; i < _slots.size(); i++) {
+            if(_slots[i].used) {
+                erase(makeHandle(static_cast<uint32_t>(i), _slots[i].generation));
+            }
+        }
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+private:
+    static constexpr uint32_t noSlot = std::numeric_limits<uint32_t>::max();
+
+    struct slot {
+        T value = T();
+        uint32_t generation = 0;
+        uint32_t nextFree = noSlot;
+        bool used = false;
+    };
+
+    static handle_tp makeHandle(uint32_t index, uint32_t generation)
+    {
+        return (static_cast<handle_tp>(generation) << 32) | (static_cast<handle_tp>(index) + 1);
+    }
+
+    slot *slotOf(handle_tp handle)
+    {
+        uint64_t index = (handle & 0xFFFFFFFFULL);
+        if(index == 0 || index > _slots.size()) {
+            return nullptr;
+        }
+        slot &s = _slots[index - 1];
+        if(!s.used || s.generation != static_cast<uint32_t>(handle >> 32)) {
+            return nullptr;
+        }
+        return &s;
+    }
+
+    std::vector<slot> _slots;
+    uint32_t _firstFree = noSlot;
+    size_t _size = 0;
+};
+
+#endif // HANDLETABLE_H
@@ -0,0 +1,447 @@
+#include "journal.h"
+
+#include "fileaccessor.h"
+#include "crc32c.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+
+constexpr uint64_t MetadataJournal::groupCommitTransactions;
+constexpr std::chrono::milliseconds MetadataJournal::commitInterval;
+constexpr uint64_t MetadataJournal::recordMagic;
+constexpr uint64_t MetadataJournal::superBlockMagic;
+
+MetadataJournal::MetadataJournal(BlockFileAccessor *file) :
+    _file(file)
+{
+}
+
+MetadataJournal::~MetadataJournal()
+{
+    stop();
+}
+
+uint64_t MetadataJournal::open(blockAddress_tp begin, blockAddress_tp end)
+{
+    discard();
+    _begin = begin;
+    _end = end;
+    _blockSize = _file->getBlockSize();
+    uint64_t replayed = replay();
+    _open = true;
+    start();
+    return replayed;
+}
+
+void MetadataJournal::format(blockAddress_tp begin, blockAddress_tp end)
+{
+    discard();
+    _begin = begin;
+    _end = end;
+    _blockSize = _file->getBlockSize();
+    // area is not cleared, records of previous file system must not match sequence of new one
+    std::vector<char> block(_blockSize);
+    _file->BlockFileAccessor::_read(_begin, block.data(), _blockSize);
+    superBlock super;
+    memcpy(&super, block.data(), sizeof(super));
+    if(super.magic == superBlockMagic) {
+        // every record takes at least two blocks, previous ones have smaller sequences
+        _sequence = super.sequence + (_end - _begin + 1);
+    } else {
+        // there was no journal at this place, sequence of left records can not be known
+        _sequence = static_cast<uint64_t>(std::chrono::system_clock::now().time_since_epoch().count()) | 1;
+    }
+    _head = _begin + 1;
+    writeSuperBlock();
+    _open = true;
+    start();
+}
+
+void MetadataJournal::close()
+{
+    if(!_open) {
+        return;
+    }
+    stop();
+    {
+        std::lock_guard<std::mutex> io(_ioMutex);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _openTransactions = 0;
+        }
+        commitLocked();
+        checkpointLocked();
+    }
+    discard();
+}
+
+void MetadataJournal::discard()
+{
+    stop();
+    std::lock_guard<std::mutex> lock(_mutex);
+    _blocks.clear();
+    _dirtyBlocks.clear();
+    _committedBlocks = 0;
+    _journaledBlocks.clear();
+    _openTransactions = 0;
+    _closedTransactions = 0;
+    _open = false;
+}
+
+bool MetadataJournal::isOpen() const
+{
+    return _open;
+}
+
+void MetadataJournal::beginTransaction(uint64_t blocksCount)
+{
+    bool commitFirst;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // commit is split between transactions only, replay does not apply part of transaction
+        commitFirst = _openTransactions == 0 && !_dirtyBlocks.empty() && _dirtyBlocks.size() + blocksCount > recordCapacity();
+    }
+    if(commitFirst) {
+        commit();
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _openTransactions++;
+}
+
+void MetadataJournal::endTransaction()
+{
+    bool commitNow = false;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_openTransactions == 0 || --_openTransactions != 0) {
+            return;
+        }
+        _closedTransactions++;
+        commitNow = _closedTransactions >= groupCommitTransactions || _dirtyBlocks.size() >= recordCapacity() / 4;
+    }
+    if(commitNow) {
+        commit();
+    }
+}
+
+void MetadataJournal::log(blockAddress_tp block, const char *data)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    pendingBlock &entry = _blocks[block];
+    if(!entry.dirty) {
+        entry.dirty = true;
+        if(_dirtyBlocks.empty()) {
+            _firstDirtyTime = std::chrono::steady_clock::now();
+        }
+        _dirtyBlocks.push_back(block);
+    }
+    entry.current.assign(data, data + _blockSize);
+}
+
+bool MetadataJournal::read(blockAddress_tp block, char *data) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _blocks.find(block);
+    if(it == _blocks.end()) {
+        return false;
+    }
+    const std::vector<char> &version = it->second.dirty ? it->second.current : it->second.committed;
+    memcpy(data, version.data(), _blockSize);
+    return true;
+}
+
+void MetadataJournal::revoke(blockAddress_tp first, uint64_t count)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_blocks.empty() && _journaledBlocks.empty()) {
+            return;
+        }
+        bool found = false;
+        for(blockAddress_tp block = first; block < first + count && !found; block++) {
+            found = _blocks.count(block) != 0 || _journaledBlocks.count(block) != 0;
+        }
+        if(!found) {
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> io(_ioMutex);
+    bool journaled = false;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for(blockAddress_tp block = first; block < first + count; block++) {
+            auto it = _blocks.find(block);
+            if(it != _blocks.end()) {
+                if(it->second.hasCommitted) {
+                    _committedBlocks--;
+                }
+                _blocks.erase(it);
+            }
+            journaled = journaled || _journaledBlocks.count(block) != 0;
+        }
+    }
+    if(journaled) {
+        // records with old version are dropped from journal
+        checkpointLocked();
+    }
+}
+
+void MetadataJournal::commit()
+{
+    std::lock_guard<std::mutex> io(_ioMutex);
+    commitLocked();
+}
+
+void MetadataJournal::checkpoint()
+{
+    std::lock_guard<std::mutex> io(_ioMutex);
+    checkpointLocked();
+}
+
+uint64_t MetadataJournal::descriptorBlocksCount(uint64_t blocksCount) const
+{
+    return (sizeof(recordHeader) + blocksCount * sizeof(blockAddress_tp) + _blockSize - 1) / _blockSize;
+}
+
+uint64_t MetadataJournal::recordCapacity() const
+{
+    uint64_t areaBlocks = _end - _begin;
+    return areaBlocks - descriptorBlocksCount(areaBlocks);
+}
+
+void MetadataJournal::commitLocked()
+{
+    // versions are moved to committed, they are changed under _ioMutex only
+    std::vector<blockAddress_tp> blocks;
+    std::vector<const char *> data;
+    uint64_t sequence = _sequence;
+    std::unique_lock<std::mutex> lock(_mutex);
+    for(;;) {
+        if(!_open || _dirtyBlocks.empty() || _openTransactions != 0) {
+            return;
+        }
+        std::sort(_dirtyBlocks.begin(), _dirtyBlocks.end());
+        _dirtyBlocks.erase(std::unique(_dirtyBlocks.begin(), _dirtyBlocks.end()), _dirtyBlocks.end());
+        // group is committed before transaction which would not fit, accessor refuses larger transaction
+        uint64_t count = _dirtyBlocks.size();
+        assert(count <= recordCapacity());
+        if(_head + descriptorBlocksCount(count) + count <= _end + 1 || _head == _begin + 1) {
+            break;
+        }
+        // committed versions of previous records are replaced below, they must be written before
+        lock.unlock();
+        checkpointLocked();
+        lock.lock();
+    }
+
+    for(blockAddress_tp block : _dirtyBlocks) {
+        auto it = _blocks.find(block);
+        if(it == _blocks.end() || !it->second.dirty) {
+            continue;   // revoked
+        }
+        pendingBlock &entry = it->second;
+        entry.committed.swap(entry.current);
+        entry.dirty = false;
+        if(!entry.hasCommitted) {
+            entry.hasCommitted = true;
+            _committedBlocks++;
+        }
+        entry.recordSequence = sequence;
+        blocks.push_back(block);
+        data.push_back(entry.committed.data());
+    }
+    _dirtyBlocks.clear();
+    _closedTransactions = 0;
+    lock.unlock();
+
+    if(!blocks.empty()) {
+        writeRecord(blocks.data(), data.data(), blocks.size());
+    }
+}
+
+void MetadataJournal::checkpointLocked()
+{
+    std::vector<std::pair<blockAddress_tp, const char *>> blocks;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for(const auto &item : _blocks) {
+            if(item.second.hasCommitted && item.second.recordSequence < _sequence) {
+                blocks.push_back({item.first, item.second.committed.data()});
+            }
+        }
+    }
+    if(blocks.empty() && _head == _begin + 1) {
+        return;
+    }
+    writeHome(blocks);
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for(const auto &written : blocks) {
+            auto it = _blocks.find(written.first);
+            pendingBlock &entry = it->second;
+            entry.hasCommitted = false;
+            std::vector<char>().swap(entry.committed);
+            _committedBlocks--;
+            if(!entry.dirty) {
+                _blocks.erase(it);
+            }
+        }
+        _journaledBlocks.clear();
+    }
+    // all records are applied, journal starts from next record
+    _head = _begin + 1;
+    writeSuperBlock();
+}
+
+void MetadataJournal::writeRecord(const blockAddress_tp *blocks, const char * const *data, uint64_t count)
+{
+    uint64_t descriptorBlocks = descriptorBlocksCount(count);
+    std::vector<char> record((descriptorBlocks + count) * _blockSize, 0);
+
+    recordHeader header = {recordMagic, _sequence, count, static_cast<uint32_t>(descriptorBlocks), 0};
+    memcpy(record.data() + sizeof(header), blocks, count * sizeof(blockAddress_tp));
+    for(uint64_t i = 0; i < count; i++) {
+        memcpy(record.data() + (descriptorBlocks + i) * _blockSize, data[i], _blockSize);
+    }
+    memcpy(record.data(), &header, sizeof(header));
+    header.checksum = crc32c(record.data(), record.size());
+    memcpy(record.data(), &header, sizeof(header));
+
+    // one write and flush for whole record
+    _file->BlockFileAccessor::_write(_head, record.data(), record.size());
+    _head += descriptorBlocks + count;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _sequence++;
+    _journaledBlocks.insert(blocks, blocks + count);
+}
+
+void MetadataJournal::writeSuperBlock()
+{
+    std::vector<char> block(_blockSize, 0);
+    superBlock super = {superBlockMagic, _sequence};
+    memcpy(block.data(), &super, sizeof(super));
+    _file->BlockFileAccessor::_write(_begin, block.data(), _blockSize);
+}
+
+void MetadataJournal::writeHome(std::vector<std::pair<blockAddress_tp, const char *>> &blocks)
+{
+    std::sort(blocks.begin(), blocks.end());
+    std::vector<char> run;
+    for(size_t first = 0; first < blocks.size();) {
+        size_t last = first + 1;
+        while(last < blocks.size() && blocks[last].first == blocks[last - 1].first + 1) {
+            last++;
+        }
+        run.resize((last - first) * _blockSize);
+        for(size_t i = first; i < last; i++) {
+            memcpy(run.data() + (i - first) * _blockSize, blocks[i].second, _blockSize);
+        }
+        _file->BlockFileAccessor::_write(blocks[first].first, run.data(), run.size());
+        first = last;
+    }
+}
+
+uint64_t MetadataJournal::replay()
+{
+    std::vector<char> block(_blockSize);
+    _file->BlockFileAccessor::_read(_begin, block.data(), _blockSize);
+    superBlock super;
+    memcpy(&super, block.data(), sizeof(super));
+    _head = _begin + 1;
+    if(super.magic != superBlockMagic) {
+        _sequence = 1;
+        writeSuperBlock();
+        return 0;
+    }
+    _sequence = super.sequence;
+
+    // last version of every block
+    std::unordered_map<blockAddress_tp, std::vector<char>> replayed;
+    uint64_t records = 0;
+    for(blockAddress_tp position = _begin + 1; position <= _end;) {
+        _file->BlockFileAccessor::_read(position, block.data(), _blockSize);
+        recordHeader header;
+        memcpy(&header, block.data(), sizeof(header));
+        if(header.magic != recordMagic || header.sequence != _sequence || header.blocksCount > recordCapacity() ||
+                header.descriptorBlocks != descriptorBlocksCount(header.blocksCount) ||
+                position + header.descriptorBlocks + header.blocksCount > _end + 1) {
+            break;
+        }
+        std::vector<char> record((header.descriptorBlocks + header.blocksCount) * _blockSize);
+        _file->BlockFileAccessor::_read(position, record.data(), record.size());
+        memset(record.data() + offsetof(recordHeader, checksum), 0, sizeof(header.checksum));
+        if(crc32c(record.data(), record.size()) != header.checksum) {
+            break;  // torn record
+        }
+
+        for(uint64_t i = 0; i < header.blocksCount; i++) {
+            blockAddress_tp address;
+            memcpy(&address, record.data() + sizeof(header) + i * sizeof(address), sizeof(address));
+            const char *data = record.data() + (header.descriptorBlocks + i) * _blockSize;
+            replayed[address].assign(data, data + _blockSize);
+        }
+        position += header.descriptorBlocks + header.blocksCount;
+        _sequence++;
+        records++;
+    }
+
+    std::vector<std::pair<blockAddress_tp, const char *>> blocks;
+    for(const auto &item : replayed) {
+        blocks.push_back({item.first, item.second.data()});
+    }
+    writeHome(blocks);
+    writeSuperBlock();
+    return records;
+}
+
+void MetadataJournal::start()
+{
+    _stop = false;
+    _checkpointer = std::thread(&MetadataJournal::run, this);
+}
+
+void MetadataJournal::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    if(_checkpointer.joinable()) {
+        _checkpointer.join();
+    }
+}
+
+void MetadataJournal::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while(!_stop) {
+        _wake.wait_for(lock, commitInterval);
+        if(_stop) {
+            break;
+        }
+        bool commitDue = !_dirtyBlocks.empty() && _openTransactions == 0 &&
+                std::chrono::steady_clock::now() - _firstDirtyTime >= commitInterval;
+        bool checkpointDue = commitDue || _committedBlocks != 0;
+        if(!checkpointDue) {
+            continue;
+        }
+        lock.unlock();
+        try {
+            std::lock_guard<std::mutex> io(_ioMutex);
+            if(commitDue) {
+                commitLocked();
+            }
+            checkpointLocked();
+        } catch(const std::exception &e) {
+            std::cerr << "Journal checkpoint error: " << e.what() << "\n";
+        }
+        lock.lock();
+    }
+}
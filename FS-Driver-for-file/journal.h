@@ -0,0 +1,137 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "constants.h"
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+class BlockFileAccessor;
+
+/**
+ * @brief The MetadataJournal class
+ * Write-ahead log of metadata blocks in journal area [begin:end].
+ * Logged blocks are kept in memory, transactions closed since last commit are written as one record
+ * with one flush (group commit), background thread writes committed blocks to their home locations (checkpoint).
+ *
+ * Area layout: superblock (sequence of first valid record), records from begin + 1.
+ * Record: descriptor blocks (recordHeader, block addresses), copies of blocks.
+ * Replay stops at first record with wrong sequence or checksum.
+ */
+class MetadataJournal
+{
+public:
+    explicit MetadataJournal(BlockFileAccessor *file);
+    ~MetadataJournal();
+
+    /**
+     * @brief replay committed records to home locations, start checkpoint thread
+     * @return count of replayed records
+     */
+    uint64_t open(blockAddress_tp begin, blockAddress_tp end);
+    // open empty journal of new file system, only superblock is written
+    void format(blockAddress_tp begin, blockAddress_tp end);
+    // commit and checkpoint all logged blocks, journal is empty after close
+    void close();
+    // not written changes are lost
+    void discard();
+
+    bool isOpen() const;
+
+    /**
+     * @brief blocks logged until endTransaction are committed in one record
+     * @param blocksCount blocks of transaction, previous transactions are committed first if record could not hold them
+     */
+    void beginTransaction(uint64_t blocksCount);
+    void endTransaction();
+
+    void log(blockAddress_tp block, const char *data);
+    /**
+     * @brief copy logged block which is not written to home location yet
+     * @return false if home location is up to date
+     */
+    bool read(blockAddress_tp block, char *data) const;
+    // blocks are overwritten not through journal, their logged versions must not be written or replayed
+    void revoke(blockAddress_tp first, uint64_t count);
+
+    void commit();
+    void checkpoint();
+
+    // max blocks in one record, transaction is never split to several records
+    uint64_t recordCapacity() const;
+
+    static constexpr uint64_t groupCommitTransactions = 64;
+    static constexpr std::chrono::milliseconds commitInterval{50};
+
+private:
+    struct pendingBlock {
+        std::vector<char> current;      // last logged version, valid if dirty
+        std::vector<char> committed;    // version from journal record, not written to home location
+        bool dirty = false;
+        bool hasCommitted = false;
+        uint64_t recordSequence = 0;    // committed version is written to home location after this record
+    };
+
+    struct recordHeader {
+        uint64_t magic;
+        uint64_t sequence;
+        uint64_t blocksCount;
+        uint32_t descriptorBlocks;
+        uint32_t checksum;          // CRC32C of whole record with zero checksum
+    };
+
+    struct superBlock {
+        uint64_t magic;
+        uint64_t sequence;          // first valid record
+    };
+
+    static constexpr uint64_t recordMagic = 0x4C4E524A4D534623;    // "#FSMJRNL"
+    static constexpr uint64_t superBlockMagic = 0x4B4C42524A534623;    // "#FSJRBLK"
+
+    uint64_t descriptorBlocksCount(uint64_t blocksCount) const;
+
+    // _ioMutex must be locked
+    void commitLocked();
+    void checkpointLocked();
+    void writeRecord(const blockAddress_tp *blocks, const char * const *data, uint64_t count);
+    void writeSuperBlock();
+    // sorted blocks are written by contiguous runs
+    void writeHome(std::vector<std::pair<blockAddress_tp, const char *>> &blocks);
+    uint64_t replay();
+
+    void start();
+    void stop();
+    void run();
+
+    BlockFileAccessor *_file;
+    uint64_t _blockSize = 0;
+
+    blockAddress_tp _begin = Constants::HEADER_ADDRESS();
+    blockAddress_tp _end = Constants::HEADER_ADDRESS();
+    blockAddress_tp _head = Constants::HEADER_ADDRESS();   // next record position
+    uint64_t _sequence = 1;                                 // next record sequence
+
+    std::unordered_map<blockAddress_tp, pendingBlock> _blocks;
+    std::vector<blockAddress_tp> _dirtyBlocks;
+    uint64_t _committedBlocks = 0;
+    // blocks in records written after last checkpoint, replay would write them
+    std::unordered_set<blockAddress_tp> _journaledBlocks;
+    uint64_t _openTransactions = 0;
+    uint64_t _closedTransactions = 0;
+    std::chrono::steady_clock::time_point _firstDirtyTime;
+
+    // lock order: _ioMutex, _mutex
+    std::mutex _ioMutex;            // journal and checkpoint writes
+    mutable std::mutex _mutex;      // in memory state
+    std::condition_variable _wake;
+    std::thread _checkpointer;
+    bool _stop = false;
+    bool _open = false;
+};
+
+#endif // JOURNAL_H
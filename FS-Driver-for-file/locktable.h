@@ -0,0 +1,116 @@
+#ifndef LOCKTABLE_H
+#define LOCKTABLE_H
+
+#include <array>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <type_traits>
+
+/**
+ * @brief The LockTable class
+ * Striped locks: key is mapped to one of Stripes mutexes, keys of one stripe share it.
+ * Guard locks stripes of its keys in ascending order, every stripe once,
+ * so threads locking several keys do not deadlock.
+ * Mutex must provide lock_shared() if sharedGuard is used.
+ */
+template<typename Mutex, size_t Stripes>
+class LockTable
+{
+    template<bool Shared>
+    class basicGuard
+    {
+        basicGuard(const basicGuard &) = delete;
+        basicGuard &operator =(const basicGuard &) = delete;
+
+    public:
+        static constexpr size_t maxKeys = 4;
+
+        basicGuard() = default;
+
+        basicGuard(LockTable &table, std::initializer_list<uint64_t> keys) :
+            _table(&table)
+        {
+            if(keys.size() > maxKeys) {
+                throw std::invalid_argument("Too many keys in LockTable guard.");
+            }
+            // sorted insert, stripe shared by keys is kept once
+            for(uint64_t key : keys) {
+                size_t keyStripe = stripe(key);
+                size_t position = 0;
+                while(position < _count && _stripes[position] < keyStripe) {
+                    position++;
+                }
+                if(position < _count && _stripes[position] == keyStripe) {
+                    continue;
+                }
+                for(size_t i = _count; i > position; i--) {
+                    _stripes[i] = _stripes[i - 1];
+                }
+                _stripes[position] = keyStripe;
+                _count++;
+            }
+            for(size_t i = 0; i < _count; i++) {
+                lock(_table->_locks[_stripes[i]], std::integral_constant<bool, Shared>());
+            }
+        }
+
+        basicGuard(basicGuard &&other) :
+            _table(other._table),
+            _stripes(other._stripes),
+            _count(other._count)
+        {
+            other._count = 0;
+        }
+
+        basicGuard &operator =(basicGuard &&other)
+        {
+            if(&other != this) {
+                unlock();
+                _table = other._table;
+                _stripes = other._stripes;
+                _count = other._count;
+                other._count = 0;
+            }
+            return *this;
+        }
+
+        ~basicGuard()
+        {
+            unlock();
+        }
+
+        void unlock()
+        {
+            while(_count != 0) {
+                _count--;
+                unlock(_table->_locks[_stripes[_count]], std::integral_constant<bool, Shared>());
+            }
+        }
+
+    private:
+        static void lock(Mutex &mutex, std::false_type) { mutex.lock(); }
+        static void lock(Mutex &mutex, std::true_type) { mutex.lock_shared(); }
+        static void unlock(Mutex &mutex, std::false_type) { mutex.unlock(); }
+        static void unlock(Mutex &mutex, std::true_type) { mutex.unlock_shared(); }
+
+        LockTable *_table = nullptr;
+        std::array<size_t, maxKeys> _stripes;
+        size_t _count = 0;
+    };
+
+public:
+    using guard = basicGuard<false>;
+    using sharedGuard = basicGuard<true>;
+
+    static size_t stripe(uint64_t key)
+    {
+        // neighbour keys (descriptors of one block) get different stripes
+        return static_cast<size_t>(key % Stripes);
+    }
+
+private:
+    std::array<Mutex, Stripes> _locks;
+};
+
+#endif // LOCKTABLE_H
@@ -0,0 +1,146 @@
+#include "lzcodec.h"
+
+#include <algorithm>
+#include <cstring>
+
+constexpr size_t LZCodec::minMatch;
+constexpr size_t LZCodec::maxOffset;
+constexpr unsigned LZCodec::hashBits;
+
+namespace {
+
+uint32_t read32(const char *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+uint32_t hash32(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZCodec::hashBits);
+}
+
+// reads extended length after 15 in token, false on end of input
+bool readLength(const unsigned char *&in, const unsigned char *end, size_t &length)
+{
+    unsigned char byte;
+    do {
+        if(in == end) {
+            return false;
+        }
+        byte = *in++;
+        length += byte;
+    } while(byte == 255);
+    return true;
+}
+
+}
+
+void LZCodec::compress(const char *source, size_t size, std::vector<char> &destination)
+{
+    destination.clear();
+    destination.reserve(size / 2 + 16);
+
+    std::vector<int64_t> table(size_t(1) << hashBits, -1);
+    size_t anchor = 0;
+    size_t position = 0;
+    while(position + minMatch <= size) {
+        uint32_t sequence = read32(source + position);
+        int64_t &entry = table[hash32(sequence)];
+        int64_t candidate = entry;
+        entry = static_cast<int64_t>(position);
+
+        if(candidate < 0 || position - candidate > maxOffset || read32(source + candidate) != sequence) {
+            position++;
+            continue;
+        }
+
+        size_t length = minMatch;
+        while(position + length < size && source[candidate + length] == source[position + length]) {
+            length++;
+        }
+        writeSequence(destination, source + anchor, position - anchor, position - candidate, length);
+        position += length;
+        anchor = position;
+    }
+
+    // last literals
+    size_t literalsCount = size - anchor;
+    destination.push_back(static_cast<char>(std::min<size_t>(literalsCount, 15) << 4));
+    if(literalsCount >= 15) {
+        writeLength(destination, literalsCount - 15);
+    }
+    destination.insert(destination.end(), source + anchor, source + size);
+}
+
+bool LZCodec::decompress(const char *source, size_t size, char *destination, size_t destinationSize)
+{
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(source);
+    const unsigned char *end = in + size;
+    size_t out = 0;
+
+    while(in != end) {
+        unsigned char token = *in++;
+
+        size_t literalsCount = token >> 4;
+        if(literalsCount == 15 && !readLength(in, end, literalsCount)) {
+            return false;
+        }
+        if(literalsCount > size_t(end - in) || literalsCount > destinationSize - out) {
+            return false;
+        }
+        memcpy(destination + out, in, literalsCount);
+        in += literalsCount;
+        out += literalsCount;
+
+        if(in == end) {
+            break;  // last sequence
+        }
+
+        if(end - in < 2) {
+            return false;
+        }
+        size_t offset = in[0] | (size_t(in[1]) << 8);
+        in += 2;
+        size_t matchLength = token & 0x0F;
+        if(matchLength == 15 && !readLength(in, end, matchLength)) {
+            return false;
+        }
+        matchLength += minMatch;
+        if(offset == 0 || offset > out || matchLength > destinationSize - out) {
+            return false;
+        }
+        // byte by byte, match can overlap itself
+        for(size_t i = 0; i < matchLength; i++) {
+            destination[out + i] = destination[out - offset + i];
+        }
+        out += matchLength;
+    }
+    return out == destinationSize;
+}
+
+void LZCodec::writeLength(std::vector<char> &destination, size_t length)
+{
+    while(length >= 255) {
+        destination.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    destination.push_back(static_cast<char>(length));
+}
+
+void LZCodec::writeSequence(std::vector<char> &destination, const char *literals, size_t literalsCount,
+                            size_t offset, size_t matchLength)
+{
+    size_t extraMatch = matchLength - minMatch;
+    destination.push_back(static_cast<char>((std::min<size_t>(literalsCount, 15) << 4) | std::min<size_t>(extraMatch, 15)));
+    if(literalsCount >= 15) {
+        writeLength(destination, literalsCount - 15);
+    }
+    destination.insert(destination.end(), literals, literals + literalsCount);
+    destination.push_back(static_cast<char>(offset & 0xFF));
+    destination.push_back(static_cast<char>(offset >> 8));
+    if(extraMatch >= 15) {
+        writeLength(destination, extraMatch - 15);
+    }
+}
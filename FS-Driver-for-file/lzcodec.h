@@ -0,0 +1,33 @@
+#ifndef LZCODEC_H
+#define LZCODEC_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief The LZCodec class
+ * LZ77 codec with LZ4 like sequence format:
+ * token (literals count << 4 | match length - minMatch), literals, 16 bit offset, extended lengths are 255 byte runs.
+ * Last sequence contains literals only.
+ */
+class LZCodec
+{
+public:
+    static void compress(const char *source, size_t size, std::vector<char> &destination);
+    /**
+     * @return false if source is corrupted or does not decompress to exactly destinationSize bytes
+     */
+    static bool decompress(const char *source, size_t size, char *destination, size_t destinationSize);
+
+    static constexpr size_t minMatch = 4;
+    static constexpr size_t maxOffset = 0xFFFF;
+    static constexpr unsigned hashBits = 12;
+
+private:
+    static void writeLength(std::vector<char> &destination, size_t length);
+    static void writeSequence(std::vector<char> &destination, const char *literals, size_t literalsCount,
+                              size_t offset, size_t matchLength);
+};
+
+#endif // LZCODEC_H
@@ -1,10 +1,12 @@
 #include <iostream>
+#include <chrono>
 
 using namespace std;
 
 #include "filesystemblock.h"
 #include "filesystem.h"
 #include "console.h"
+#include "asyncfilesystem.h"
 
 // warning asserts
 static_assert(Constants::HEADER_ADDRESS() == 0, "Need project refactor, if you change this value.");
@@ -17,6 +19,8 @@ static_assert(std::is_pod<FSDescriptor>::value, "Used not 'plain of data' (pod)
 static_assert(std::is_pod<FSDescriptorsContainerBlock>::value, "Used not 'plain of data' (pod) structures");
 static_assert(std::is_pod<FSDescriptorDataPart>::value, "Used not 'plain of data' (pod) structures");
 static_assert(std::is_pod<FSDataBlock>::value, "Used not 'plain of data' (pod) structures");
+static_assert(std::is_pod<FSDirectoryTreeNode>::value, "Used not 'plain of data' (pod) structures");
+static_assert(sizeof(FSDirectoryTreeNode) <= Constants::blockByteSize(), "FSDirectoryTreeNode is larger than block.");
 static_assert(std::is_pod<FSHeader>::value, "Used not 'plain of data' (pod) structures");
 
 int main()
@@ -63,6 +67,186 @@ int main()
     };
     console.addCommand("q_testCase", new FunctionConsoleOperation(testCase));
 
+    // paramethers: [files count] [image path]
+    auto benchCreate = [&](arguments arg, outputStream out) {
+        uint64_t filesCount = arg.size() > 0 ? std::stoull(arg.at(0)) : 100000;
+        string imagePath = arg.size() > 1 ? arg.at(1) : "bench";
+
+        // every block of descriptors area contains (blockSize / descriptorSize) descriptors
+        // and descriptors area takes 1/4 of all blocks
+        uint64_t blockCount = 4 * (filesCount + 2) + 1024;
+        std::ofstream::pos_type imageSize = blockCount * Constants::blockByteSize();
+
+        consoleCommand com;
+        com.command = "createFile";
+        com.arguments = {imagePath, std::to_string(imageSize)};
+        console.runCommand(com);
+
+        com.command = "mount";
+        com.arguments = {imagePath};
+        console.runCommand(com);
+
+        com.command = "format";
+        com.arguments.clear();
+        console.runCommand(com);
+
+        out << "Create " << filesCount << " files in one directory\n";
+        auto begin = std::chrono::steady_clock::now();
+        auto stepBegin = begin;
+        com.command = "create";
+        for(uint64_t i = 0; i < filesCount; i++) {
+            com.arguments = {"f" + std::to_string(i)};
+            console.runCommand(com);
+            if((i + 1) % 10000 == 0) {
+                auto now = std::chrono::steady_clock::now();
+                out << "\t" << (i + 1) << " files, last 10000: "
+                    << std::chrono::duration_cast<std::chrono::milliseconds>(now - stepBegin).count() << " ms\n";
+                stepBegin = now;
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        out << "Total: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << " ms\n";
+    };
+    console.addCommand("q_benchCreate", new FunctionConsoleOperation(benchCreate));
+
+    // paramethers: [megabytes] [image path] [chunk bytes]
+    auto benchIO = [&](arguments arg, outputStream out) {
+        uint64_t megabytes = arg.size() > 0 ? std::stoull(arg.at(0)) : 64;
+        string imagePath = arg.size() > 1 ? arg.at(1) : "bench";
+        uint64_t chunkSize = arg.size() > 2 ? std::stoull(arg.at(2)) : 1024 * 1024;
+        constexpr uint64_t megabyte = 1024 * 1024;
+        uint64_t chunksCount = megabytes * megabyte / chunkSize;
+
+        // data, descriptors (1/4 of blocks) and segments
+        uint64_t blockCount = 2 * megabytes * (megabyte / Constants::blockByteSize()) + 1024;
+        std::ofstream::pos_type imageSize = blockCount * Constants::blockByteSize();
+
+        consoleCommand com;
+        com.command = "createFile";
+        com.arguments = {imagePath, std::to_string(imageSize)};
+        console.runCommand(com);
+
+        com.command = "mount";
+        com.arguments = {imagePath};
+        console.runCommand(com);
+
+        com.command = "format";
+        com.arguments.clear();
+        console.runCommand(com);
+
+        com.command = "create";
+        com.arguments = {"data"};
+        console.runCommand(com);
+
+        std::vector<char> chunk(chunkSize);
+        for(uint64_t i = 0; i < chunkSize; i++) {
+            chunk[i] = static_cast<char>(i * 31 + 7);
+        }
+
+        auto fd = fs.openFile("data");
+        auto speed = [&](std::chrono::steady_clock::duration time) {
+            double seconds = std::chrono::duration<double>(time).count();
+            return seconds > 0 ? megabytes / seconds : 0;
+        };
+
+        auto begin = std::chrono::steady_clock::now();
+        for(uint64_t i = 0; i < chunksCount; i++) {
+            fs.writeFile(fd, chunk.data(), chunkSize);
+        }
+        out << "Write " << megabytes << " MB: " << speed(std::chrono::steady_clock::now() - begin) << " MB/s\n";
+
+        fs.seekFile(fd, 0);
+        std::vector<char> readChunk(chunkSize);
+        bool valid = true;
+        begin = std::chrono::steady_clock::now();
+        for(uint64_t i = 0; i < chunksCount; i++) {
+            valid = fs.readFile(fd, readChunk.data(), chunkSize) == chunkSize && valid;
+        }
+        out << "Read " << megabytes << " MB: " << speed(std::chrono::steady_clock::now() - begin) << " MB/s\n";
+        valid = valid && readChunk == chunk;
+        out << "Data " << (valid ? "valid" : "corrupted") << "\n";
+        fs.closeFile(fd);
+    };
+    console.addCommand("q_benchIO", new FunctionConsoleOperation(benchIO));
+
+    // paramethers: [files count] [image path] [threads]
+    auto benchAsync = [&](arguments arg, outputStream out) {
+        uint64_t filesCount = arg.size() > 0 ? std::stoull(arg.at(0)) : 10000;
+        string imagePath = arg.size() > 1 ? arg.at(1) : "bench";
+        unsigned threads = arg.size() > 2 ? std::stoul(arg.at(2)) : 0;
+        constexpr uint64_t fileSize = 1000;
+
+        // descriptors area takes 1/4 of blocks, every file has data block and segment
+        uint64_t blockCount = 8 * (filesCount + 2) + 1024;
+        std::ofstream::pos_type imageSize = blockCount * Constants::blockByteSize();
+
+        consoleCommand com;
+        com.command = "createFile";
+        com.arguments = {imagePath, std::to_string(imageSize)};
+        console.runCommand(com);
+
+        com.command = "mount";
+        com.arguments = {imagePath};
+        console.runCommand(com);
+
+        com.command = "format";
+        com.arguments.clear();
+        console.runCommand(com);
+
+        AsyncFileSystem async(fs, threads);
+        FileSystem::session client;
+        auto milliseconds = [](std::chrono::steady_clock::time_point begin) {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+        };
+
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<std::future<descriptorIndex_tp>> created;
+        for(uint64_t i = 0; i < filesCount; i++) {
+            created.push_back(async.makeFile(client, "f" + std::to_string(i)));
+        }
+        for(auto &file : created) {
+            file.get();
+        }
+        out << "Create " << filesCount << " files: " << milliseconds(begin) << " ms\n";
+
+        begin = std::chrono::steady_clock::now();
+        std::vector<std::future<FileSystem::openedFileDescriptor_tp>> opened;
+        for(uint64_t i = 0; i < filesCount; i++) {
+            opened.push_back(async.openFile(client, "f" + std::to_string(i)));
+        }
+        std::vector<FileSystem::openedFileDescriptor_tp> handles;
+        std::vector<std::future<std::vector<char>>> reads;
+        for(uint64_t i = 0; i < filesCount; i++) {
+            auto fd = opened[i].get();
+            handles.push_back(fd);
+            async.writeFile(fd, std::vector<char>(fileSize, static_cast<char>('a' + i % 26)));
+            async.flushFile(fd);
+            reads.push_back(async.readFile(fd, fileSize));
+        }
+        bool valid = true;
+        for(auto &read : reads) {
+            valid = read.get().empty() && valid;     // cursor is at the end of written data
+        }
+        for(auto fd : handles) {
+            async.closeFile(fd);
+        }
+        out << "Write " << filesCount << " files: " << milliseconds(begin) << " ms\n";
+
+        begin = std::chrono::steady_clock::now();
+        reads.clear();
+        for(uint64_t i = 0; i < filesCount; i++) {
+            auto fd = async.openFile(client, "f" + std::to_string(i)).get();
+            reads.push_back(async.readFile(fd, fileSize));
+            async.closeFile(fd);
+        }
+        for(uint64_t i = 0; i < filesCount; i++) {
+            valid = reads[i].get() == std::vector<char>(fileSize, static_cast<char>('a' + i % 26)) && valid;
+        }
+        out << "Read " << filesCount << " files: " << milliseconds(begin) << " ms\n";
+        out << "Data " << (valid ? "valid" : "corrupted") << "\n";
+    };
+    console.addCommand("q_benchAsync", new FunctionConsoleOperation(benchAsync));
+
     console.run();
 
     return 0;
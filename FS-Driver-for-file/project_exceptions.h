@@ -70,6 +70,15 @@ public:
         file_system_exception(message)
     { }
 };
+
+class checksum_exception : public file_system_exception
+{
+public:
+    explicit
+    checksum_exception (const std::string &message) :
+        file_system_exception(message)
+    { }
+};
 }
 
 #endif // PROJECT_EXCEPTIONS
@@ -0,0 +1,103 @@
+#include "transaction.h"
+
+#include "fileaccessor.h"
+
+#include <cstring>
+#include <exception>
+#include <iostream>
+
+Transaction::Transaction(FormatedFileAccessor *file) :
+    _file(file)
+{
+    _outermost = _file->beginTransaction(this);
+}
+
+Transaction::~Transaction()
+{
+    if(_finished) {
+        return;
+    }
+    if(std::uncaught_exception()) {
+        rollback();
+        return;
+    }
+    try {
+        commit();
+    } catch(const std::exception &e) {
+        std::cerr << "Transaction is not committed: " << e.what() << "\n";
+    }
+}
+
+void Transaction::commit()
+{
+    if(_finished) {
+        return;
+    }
+    _finished = true;
+    if(_outermost) {
+        _file->commitTransaction(*this);
+    }
+}
+
+void Transaction::rollback()
+{
+    if(_finished) {
+        return;
+    }
+    _finished = true;
+    if(_outermost) {
+        _file->rollbackTransaction(*this);
+    }
+}
+
+void Transaction::commitStep()
+{
+    if(_finished || !_outermost) {
+        return;
+    }
+    _finished = true;
+    _file->commitTransaction(*this);
+    _blocks.clear();
+    _headerChanged = false;
+    _headerSaved = false;
+    _finished = false;
+    _outermost = _file->beginTransaction(this);
+}
+
+void Transaction::write(blockAddress_tp block, const char *data, uint64_t size)
+{
+    std::vector<char> &version = _blocks[block];
+    version.assign(data, data + size);
+}
+
+bool Transaction::read(blockAddress_tp block, char *data, uint64_t size) const
+{
+    auto it = _blocks.find(block);
+    if(it == _blocks.end()) {
+        return false;
+    }
+    memcpy(data, it->second.data(), size);
+    return true;
+}
+
+void Transaction::revoke(blockAddress_tp first, uint64_t count)
+{
+    if(_blocks.empty()) {
+        return;
+    }
+    _blocks.erase(_blocks.lower_bound(first), _blocks.lower_bound(first + count));
+}
+
+void Transaction::headerChanged(const FSHeader &previous)
+{
+    countersChanged(previous);
+    _headerChanged = true;
+}
+
+void Transaction::countersChanged(const FSHeader &previous)
+{
+    if(!_headerSaved) {
+        _headerSaved = true;
+        _previousHeader = previous;
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef TRANSACTION_H
+#define TRANSACTION_H
+
+#include "constants.h"
+#include "filesystemblock.h"
+
+#include <map>
+#include <vector>
+
+class FormatedFileAccessor;
+
+/**
+ * @brief The Transaction class
+ * Collects metadata blocks and header changes written by one file system operation.
+ * Repeated writes of a block keep the last version. At commit blocks are applied sorted by address:
+ * logged to journal as one transaction, or written by contiguous runs if file system has no journal.
+ * Transaction larger than journal record is rolled back at commit, commit throws.
+ * Free counters changes are kept in memory header, they are not written at commit.
+ * Rollback discards collected blocks and restores header.
+ *
+ * Destructor commits, or rolls back if transaction is destroyed by exception.
+ * Nested transactions join the outermost one.
+ */
+class Transaction
+{
+    friend class FormatedFileAccessor;
+
+    Transaction(const Transaction &) = delete;
+    Transaction &operator =(const Transaction &) = delete;
+
+public:
+    explicit Transaction(FormatedFileAccessor *file);
+    ~Transaction();
+
+    void commit();
+    void rollback();
+    /**
+     * @brief commit changes made so far and continue in new transaction
+     * Operation which could not fit in one journal record is split by steps, every step leaves file system consistent.
+     * Nested transaction is not split.
+     */
+    void commitStep();
+
+private:
+    void write(blockAddress_tp block, const char *data, uint64_t size);
+    bool read(blockAddress_tp block, char *data, uint64_t size) const;
+    // blocks are overwritten not through transaction
+    void revoke(blockAddress_tp first, uint64_t count);
+    // header is written at commit
+    void headerChanged(const FSHeader &previous);
+    // header is restored at rollback only
+    void countersChanged(const FSHeader &previous);
+
+    FormatedFileAccessor *_file;
+    bool _outermost;
+    bool _finished = false;
+
+    std::map<blockAddress_tp, std::vector<char>> _blocks;
+    bool _headerChanged = false;
+    bool _headerSaved = false;
+    FSHeader _previousHeader;       // header before transaction, valid if _headerSaved
+};
+
+#endif // TRANSACTION_H